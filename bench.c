@@ -0,0 +1,537 @@
+/**
+ * bench: connection-scalability benchmark for the proxy.
+ *
+ * Starts a local stub origin and the proxy (the command given after `--`),
+ * then holds many slow client connections open against the proxy:
+ *  - half of them trickle their request header one byte per tick, and
+ *  - half of them request a large object and read the response slowly.
+ * While those connections are held, a small stream of fast probe requests
+ * measures the latency an ordinary client sees.
+ *
+ * Reported: proxy RSS (total and per connection), proxy thread count,
+ * connect ("accept") latency and probe latency percentiles.
+ *
+ * With -T, the connections are then released and a closed-loop throughput
+ * phase runs: -C clients issue back-to-back GETs over a small set of URLs
+ * (so both the miss and the hit path are exercised). This is also the
+ * training workload of `make pgo`.
+ *
+ * usage: ./bench [options] [-- <proxy command...>]
+ *   -n <conns>   slow connections to hold           (default 10000)
+ *   -x <port>    port the proxy listens on          (default 15213)
+ *   -o <port>    port of the stub origin            (default 15214)
+ *   -i <ms>      tick interval of slow clients      (default 1000)
+ *   -H <secs>    how long to hold the connections   (default 10)
+ *   -P <probes>  number of fast probe requests      (default 100)
+ *   -b <bytes>   size of the large object           (default 1048576)
+ *   -T <secs>    closed-loop throughput phase       (default 0, off)
+ *   -C <clients> concurrent clients in that phase   (default 8)
+ *   -v           keep proxy output (default: /dev/null)
+ * The default proxy command is `./proxy <port>`. Extra proxy flags (engine
+ * mode, config file, ...) are passed through unchanged, so every mode the
+ * proxy supports can be benchmarked the same way.
+ */
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define SMALL_BODY "ok\n"
+#define ORIGIN_MAX_REQ 4096
+
+/* Benchmark parameters (see usage above). */
+static int    n_conns      = 10000;
+static int    proxy_port   = 15213;
+static int    origin_port  = 15214;
+static int    tick_ms      = 1000;
+static int    hold_secs    = 10;
+static int    n_probes     = 100;
+static size_t big_size     = 1048576;
+static int    verbose      = 0;
+static int    tput_secs    = 0;
+static int    tput_clients = 8;
+
+/* Slow client connection. */
+typedef struct {
+    int fd;
+    int kind;       // SLOW_HEADERS or SLOW_READER
+    size_t sent;    // bytes of request sent so far
+    int open;
+} slow_conn_t;
+
+enum { SLOW_HEADERS, SLOW_READER };
+
+/* Stub origin connection. */
+typedef struct {
+    char req[ORIGIN_MAX_REQ];
+    size_t req_len;
+    const char *hdr;
+    size_t hdr_len, hdr_off;
+    size_t body_len, body_off;
+    int responding;
+} origin_conn_t;
+
+static char *big_body;
+static volatile int stop_origin;
+
+static double now_ms ( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double ( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of an already-sorted array. */
+static double percentile ( const double *v, int n, double p )
+{
+    if (n == 0) return 0.0;
+    int i = (int)(p / 100.0 * n + 0.5) - 1;
+    if (i < 0) i = 0;
+    if (i >= n) i = n - 1;
+    return v[i];
+}
+
+static void set_nonblocking ( int fd )
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* read `field` (e.g. "VmRSS:" or "Threads:") from /proc/<pid>/status. */
+static long proc_status_field ( pid_t pid, const char *field )
+{
+    char path[64], line[256];
+    long value = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, strlen(field)) == 0) {
+            value = strtol(line + strlen(field), NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+/* Stub origin: a single epoll loop, so that it never becomes the bottleneck.
+   "/big..." gets `big_size` bytes, anything else gets a tiny body. */
+static void *origin_main ( void *arg )
+{
+    int listen_fd = *(int *)arg;
+    int epfd = epoll_create1(0);
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    origin_conn_t **conns = calloc(rl.rlim_cur, sizeof(origin_conn_t *));
+    static char big_hdr[256], small_hdr[256];
+    size_t big_hdr_len = snprintf(big_hdr, sizeof(big_hdr),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", big_size);
+    size_t small_hdr_len = snprintf(small_hdr, sizeof(small_hdr),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", strlen(SMALL_BODY));
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = listen_fd };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    struct epoll_event events[256];
+    while (!stop_origin) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                int cfd;
+                while ((cfd = accept(listen_fd, NULL, NULL)) >= 0) {
+                    if ((rlim_t)cfd >= rl.rlim_cur) { close(cfd); continue; }
+                    set_nonblocking(cfd);
+                    conns[cfd] = calloc(1, sizeof(origin_conn_t));
+                    struct epoll_event cev = { .events = EPOLLIN, .data.fd = cfd };
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &cev);
+                }
+                continue;
+            }
+            origin_conn_t *c = conns[fd];
+            if (!c) continue;
+            if (!c->responding) {
+                ssize_t r = read(fd, c->req + c->req_len, ORIGIN_MAX_REQ - 1 - c->req_len);
+                if (r <= 0) {
+                    if (r < 0 && errno == EAGAIN) continue;
+                    goto done;
+                }
+                c->req_len += r;
+                c->req[c->req_len] = '\0';
+                if (!strstr(c->req, "\r\n\r\n")) {
+                    if (c->req_len == ORIGIN_MAX_REQ - 1) goto done;
+                    continue;
+                }
+                char *path = strchr(c->req, ' ');
+                int big = path && strncmp(path + 1, "/big", 4) == 0;
+                c->hdr = big ? big_hdr : small_hdr;
+                c->hdr_len = big ? big_hdr_len : small_hdr_len;
+                c->body_len = big ? big_size : strlen(SMALL_BODY);
+                c->responding = 1;
+                struct epoll_event cev = { .events = EPOLLOUT, .data.fd = fd };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &cev);
+            }
+            /* write as much as the socket accepts; resume on EPOLLOUT. */
+            while (c->hdr_off < c->hdr_len) {
+                ssize_t w = write(fd, c->hdr + c->hdr_off, c->hdr_len - c->hdr_off);
+                if (w < 0 && errno == EAGAIN) goto next;
+                if (w <= 0) goto done;
+                c->hdr_off += w;
+            }
+            while (c->body_off < c->body_len) {
+                const char *body = c->hdr == big_hdr ? big_body : SMALL_BODY;
+                ssize_t w = write(fd, body + c->body_off, c->body_len - c->body_off);
+                if (w < 0 && errno == EAGAIN) goto next;
+                if (w <= 0) goto done;
+                c->body_off += w;
+            }
+        done:
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            close(fd);
+            free(c);
+            conns[fd] = NULL;
+        next:
+            ;
+        }
+    }
+    close(epfd);
+    free(conns);
+    return NULL;
+}
+
+static int listen_local ( int port )
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+        perror("stub origin");
+        exit(1);
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+/* connect to the proxy. a distinct loopback source address per 60000
+   connections keeps us clear of ephemeral port exhaustion. */
+static int connect_proxy ( int idx, int nonblocking, int rcvbuf )
+{
+    struct sockaddr_in src = { .sin_family = AF_INET,
+                               .sin_addr.s_addr = htonl(0x7f000001 + 1 + idx / 60000) };
+    struct sockaddr_in dst = { .sin_family = AF_INET, .sin_port = htons(proxy_port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (idx >= 0) bind(fd, (struct sockaddr *)&src, sizeof(src));
+    if (nonblocking) set_nonblocking(fd);
+    if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* one fast GET through the proxy; returns latency in ms, or -1. */
+static double probe ( int i )
+{
+    char req[256], buf[4096];
+    double t0 = now_ms();
+    int fd = connect_proxy(-1, 0, 0);
+    if (fd < 0) return -1;
+    struct timeval tv = { .tv_sec = 10 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int len = snprintf(req, sizeof(req),
+        "GET http://127.0.0.1:%d/probe/%d HTTP/1.0\r\nHost: 127.0.0.1:%d\r\n\r\n",
+        origin_port, i, origin_port);
+    ssize_t r, total = 0;
+    if (write(fd, req, len) != len) { close(fd); return -1; }
+    while ((r = read(fd, buf, sizeof(buf))) > 0) total += r;
+    close(fd);
+    if (r < 0 || total == 0) return -1;
+    return now_ms() - t0;
+}
+
+typedef struct {
+    double *lat;
+    int n_ok;
+    int n_err;
+} probe_result_t;
+
+static void *probe_main ( void *arg )
+{
+    probe_result_t *res = arg;
+    /* spread the probes evenly over the first half of the hold period. */
+    int gap_us = n_probes > 0 ? (hold_secs * 500000) / n_probes : 0;
+    for (int i = 0; i < n_probes; i++) {
+        double l = probe(i);
+        if (l < 0) res->n_err++;
+        else res->lat[res->n_ok++] = l;
+        usleep(gap_us);
+    }
+    return NULL;
+}
+
+/* closed-loop throughput client; cycles over 64 URLs. */
+typedef struct {
+    double end;
+    int id;
+    long n_ok;
+    long n_err;
+} tput_client_t;
+
+static void *tput_main ( void *arg )
+{
+    tput_client_t *tc = arg;
+    for (long i = 0; now_ms() < tc->end; i++) {
+        if (probe(1000 + (tc->id * 7 + i) % 64) < 0) tc->n_err++;
+        else tc->n_ok++;
+    }
+    return NULL;
+}
+
+static pid_t start_proxy ( char **cmd )
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execvp(cmd[0], cmd);
+        perror("exec proxy");
+        _exit(127);
+    }
+    /* wait until the proxy accepts connections. */
+    for (int i = 0; i < 100; i++) {
+        int fd = connect_proxy(-1, 0, 0);
+        if (fd >= 0) { close(fd); return pid; }
+        usleep(50000);
+    }
+    fprintf(stderr, "proxy did not come up on port %d\n", proxy_port);
+    kill(pid, SIGKILL);
+    exit(1);
+}
+
+static void usage ( char *prog )
+{
+    fprintf(stderr, "usage: %s [-n conns] [-x proxy_port] [-o origin_port] [-i tick_ms] "
+            "[-H hold_secs] [-P probes] [-b big_bytes] [-T tput_secs] [-C tput_clients] [-v] "
+            "[-- proxy command...]\n", prog);
+    exit(1);
+}
+
+int main ( int argc, char **argv )
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:x:o:i:H:P:b:T:C:v")) != -1) {
+        switch (opt) {
+        case 'n': n_conns = atoi(optarg); break;
+        case 'x': proxy_port = atoi(optarg); break;
+        case 'o': origin_port = atoi(optarg); break;
+        case 'i': tick_ms = atoi(optarg); break;
+        case 'H': hold_secs = atoi(optarg); break;
+        case 'P': n_probes = atoi(optarg); break;
+        case 'b': big_size = strtoul(optarg, NULL, 10); break;
+        case 'T': tput_secs = atoi(optarg); break;
+        case 'C': tput_clients = atoi(optarg); break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", proxy_port);
+    char *default_cmd[] = { "./proxy", port_str, NULL };
+    char **cmd = optind < argc ? &argv[optind] : default_cmd;
+
+    /* each slow connection costs us one fd, and the proxy two. */
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((rlim_t)n_conns + 64 > rl.rlim_cur) {
+        n_conns = rl.rlim_cur - 64;
+        fprintf(stderr, "fd limit: capping slow connections at %d\n", n_conns);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    big_body = malloc(big_size);
+    memset(big_body, 'x', big_size);
+    int origin_fd = listen_local(origin_port);
+    pthread_t origin_tid;
+    pthread_create(&origin_tid, NULL, origin_main, &origin_fd);
+
+    pid_t pid = start_proxy(cmd);
+    sleep(1);
+    long rss0 = proc_status_field(pid, "VmRSS:");
+    long thr0 = proc_status_field(pid, "Threads:");
+
+    /* open the slow connections; connect latency is the time until the
+       handshake completes, which grows once the accept queue overflows. */
+    slow_conn_t *conns = calloc(n_conns, sizeof(slow_conn_t));
+    double *conn_lat = calloc(n_conns, sizeof(double));
+    int n_open = 0, n_failed = 0;
+    int epfd = epoll_create1(0);
+    for (int base = 0; base < n_conns; base += 256) {
+        int batch = n_conns - base < 256 ? n_conns - base : 256;
+        double t0 = now_ms();
+        int pending = 0;
+        for (int i = base; i < base + batch; i++) {
+            conns[i].kind = i % 2 ? SLOW_READER : SLOW_HEADERS;
+            conns[i].fd = connect_proxy(i, 1, conns[i].kind == SLOW_READER ? 4096 : 0);
+            if (conns[i].fd < 0) { n_failed++; continue; }
+            struct epoll_event ev = { .events = EPOLLOUT, .data.u32 = i };
+            epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+            pending++;
+        }
+        struct epoll_event events[256];
+        while (pending > 0) {
+            int n = epoll_wait(epfd, events, 256, 5000);
+            if (n <= 0) break;
+            for (int k = 0; k < n; k++) {
+                slow_conn_t *c = &conns[events[k].data.u32];
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                pending--;
+                if (err) { close(c->fd); c->fd = -1; n_failed++; continue; }
+                c->open = 1;
+                conn_lat[n_open++] = now_ms() - t0;
+            }
+        }
+        for (int i = base; i < base + batch; i++) {
+            if (conns[i].fd >= 0 && !conns[i].open) {
+                close(conns[i].fd);
+                conns[i].fd = -1;
+                n_failed++;
+            }
+        }
+    }
+    close(epfd);
+
+    probe_result_t pres = { .lat = calloc(n_probes + 1, sizeof(double)) };
+    pthread_t probe_tid;
+    pthread_create(&probe_tid, NULL, probe_main, &pres);
+
+    /* hold: every tick, header-tricklers send one more byte and slow readers
+       drain at most one small read. */
+    char req[256], sink[512];
+    int req_len = snprintf(req, sizeof(req),
+        "GET http://127.0.0.1:%d/big HTTP/1.0\r\nHost: 127.0.0.1:%d\r\n", origin_port, origin_port);
+    long rss1 = rss0, thr1 = thr0;
+    double end = now_ms() + hold_secs * 1000.0;
+    int ticks = 0;
+    while (now_ms() < end) {
+        for (int i = 0; i < n_conns; i++) {
+            slow_conn_t *c = &conns[i];
+            if (!c->open) continue;
+            ssize_t r;
+            if (c->kind == SLOW_HEADERS || c->sent < (size_t)req_len + 2) {
+                if (c->kind == SLOW_HEADERS) {
+                    /* never finish the header: pad it after the request line. */
+                    const char *b = c->sent < (size_t)req_len ? &req[c->sent] : "X";
+                    r = write(c->fd, b, 1);
+                } else {
+                    const char *full = c->sent < (size_t)req_len ? &req[c->sent] : &"\r\n"[c->sent - req_len];
+                    size_t left = c->sent < (size_t)req_len ? req_len - c->sent : req_len + 2 - c->sent;
+                    r = write(c->fd, full, left);
+                }
+                if (r > 0) c->sent += r;
+            } else {
+                r = read(c->fd, sink, sizeof(sink));
+            }
+            if (r == 0 || (r < 0 && errno != EAGAIN)) {
+                close(c->fd);
+                c->open = 0;
+            }
+        }
+        /* sample the proxy once everything has been sent at least once. */
+        if (++ticks == 2) {
+            rss1 = proc_status_field(pid, "VmRSS:");
+            thr1 = proc_status_field(pid, "Threads:");
+        }
+        usleep(tick_ms * 1000);
+    }
+    pthread_join(probe_tid, NULL);
+    int n_alive = 0;
+    for (int i = 0; i < n_conns; i++) {
+        if (conns[i].open) { n_alive++; close(conns[i].fd); }
+    }
+
+    long tput_ok = 0, tput_err = 0;
+    if (tput_secs > 0) {
+        pthread_t *tids = calloc(tput_clients, sizeof(pthread_t));
+        tput_client_t *tcs = calloc(tput_clients, sizeof(tput_client_t));
+        for (int i = 0; i < tput_clients; i++) {
+            tcs[i].end = now_ms() + tput_secs * 1000.0;
+            tcs[i].id = i;
+            pthread_create(&tids[i], NULL, tput_main, &tcs[i]);
+        }
+        for (int i = 0; i < tput_clients; i++) {
+            pthread_join(tids[i], NULL);
+            tput_ok += tcs[i].n_ok;
+            tput_err += tcs[i].n_err;
+        }
+        free(tids);
+        free(tcs);
+    }
+
+    /* give the proxy a chance to exit cleanly (e.g. to write PGO profiles). */
+    kill(pid, SIGTERM);
+    int reaped = 0;
+    for (int i = 0; i < 50 && !(reaped = waitpid(pid, NULL, WNOHANG) == pid); i++) usleep(100000);
+    if (!reaped) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    stop_origin = 1;
+    pthread_join(origin_tid, NULL);
+
+    qsort(conn_lat, n_open, sizeof(double), cmp_double);
+    qsort(pres.lat, pres.n_ok, sizeof(double), cmp_double);
+    printf("proxy command        :");
+    for (char **a = cmd; *a; a++) printf(" %s", *a);
+    printf("\n");
+    printf("slow connections     : %d requested, %d opened, %d failed, %d alive at end\n",
+           n_conns, n_open, n_failed, n_alive);
+    printf("proxy RSS            : %ld KiB idle, %ld KiB loaded, %.2f KiB/conn\n",
+           rss0, rss1, n_open ? (double)(rss1 - rss0) / n_open : 0.0);
+    printf("proxy threads        : %ld idle, %ld loaded\n", thr0, thr1);
+    printf("connect latency (ms) : p50 %.2f  p99 %.2f  max %.2f\n",
+           percentile(conn_lat, n_open, 50), percentile(conn_lat, n_open, 99),
+           percentile(conn_lat, n_open, 100));
+    printf("probe latency (ms)   : p50 %.2f  p99 %.2f  max %.2f  (%d ok, %d failed)\n",
+           percentile(pres.lat, pres.n_ok, 50), percentile(pres.lat, pres.n_ok, 99),
+           percentile(pres.lat, pres.n_ok, 100), pres.n_ok, pres.n_err);
+    if (tput_secs > 0)
+        printf("throughput (req/s)   : %.1f  (%ld ok, %ld failed, %d clients)\n",
+               (double)tput_ok / tput_secs, tput_ok, tput_err, tput_clients);
+
+    free(conns);
+    free(conn_lat);
+    free(pres.lat);
+    free(big_body);
+    return 0;
+}
@@ -0,0 +1,772 @@
+/**
+ * Response cache: a list in recency (LRU) or insertion (FIFO) order, bounded
+ * by total size. Entries are reference counted, so a hit can be written to the
+ * client straight from cache storage without holding the cache lock; an entry
+ * evicted meanwhile is freed when its last reader releases it.
+ *
+ * Entries are found through a hash index on the URL. A response with `Vary`
+ * is one of possibly several variants of its URL, told apart by the request
+ * header values it varies on; the variants of a URL hang off its first one.
+ * A URL without variants is found with a single probe.
+ *
+ * Keys are canonical URLs (see url.c) with a 64-bit hash computed once per
+ * request. The cache is split into shards, each with its own list, index,
+ * lock and an equal share of the size limit; the high bits of the hash pick
+ * the shard and the low bits the bucket. Recency is kept per shard.
+ *
+ * Bodies of the types listed in `cache-compress-types` are stored compressed
+ * (lz.c) when that saves enough; the header stays as is. No client can accept
+ * this private coding, so a hit on such an entry inflates a copy to send.
+ * Bodies of the types in `cache-gzip-types` also get a gzip copy of the
+ * whole response (gzip.c), sent as is to clients that accept gzip.
+ *
+ * Bodies are stored apart from headers and content-addressed: each shard
+ * keeps an index of its bodies by a hash of their bytes, and an entry whose
+ * body is already there (the same object under another URL: mirrors,
+ * cache-busting queries) points at it, costing only its header. A body
+ * counts against the shard's size once, while any indexed entry uses it.
+ */
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "proxy.h"  // compile-time defaults
+#include "cache.h"
+#include "config.h" // cache policies
+#include "http.h"   // http_get_field, http_header_length
+#include "io.h"
+#include "url.h"    // url_key_t, url_hash
+#include "hash.h"   // hash64, for bodies
+#include "lz.h"     // body compression
+#include "gzip.h"   // gzip variants
+
+// Entries evicted per write-lock acquisition when the cache shrinks on reload
+#define CACHE_EVICT_BATCH 16
+// Initial number of index buckets (a power of two); doubled as entries are added
+#define CACHE_BUCKETS_MIN 1024
+// Tokens of a Vary list (or of a request header value) we normalize; more: not cached
+#define VARY_TOKENS_MAX 32
+// Marks a request header that is absent (as opposed to empty) in a variant key
+#define VARY_ABSENT "\001"
+// Smallest body worth compressing
+#define CACHE_COMPRESS_MIN_BODY 512
+// A compressed body is kept only if it saves at least 1/n of the body
+#define CACHE_COMPRESS_MIN_SAVING 8
+// Seeds the body hash, so it differs from URL hashes of the same bytes
+#define CACHE_BODY_SEED 0x626f6479 // "body"
+// Leads a cache snapshot, so a snapshot in another format is not misread
+#define CACHE_SNAPSHOT_MAGIC 0x32435850 // "PXC2"
+
+// Cache shard struct
+typedef struct {
+    cache_entry_t* head; // Latest cache item
+    cache_entry_t* tail; // Oldest cache item (next to be evicted)
+    size_t total_size; // Shard size
+    size_t max_size; // Shard size limit (its share of the cache size limit)
+    size_t max_object_size; // Largest cacheable response
+    int policy; // CACHE_POLICY_LRU or CACHE_POLICY_FIFO
+    cache_entry_t** buckets; // Index: chains of each URL's first variant
+    size_t bucket_count; // Power of two
+    size_t count; // Entries (all variants)
+    cache_body_t** bodies; // Body index: chains of bodies by content hash
+    size_t body_bucket_count; // Power of two
+    size_t body_count; // Bodies in the index
+    pthread_rwlock_t lock; // read-write lock
+} cache_shard_t;
+
+static struct {
+    cache_shard_t* shards;
+    int shard_count;
+    char compress_types[1024]; // `cache-compress-types`; "" = none
+    char gzip_types[1024]; // `cache-gzip-types`; "" = none
+    pthread_mutex_t types_lock; // guards compress_types and gzip_types
+} cache = {NULL, 0, "", "", PTHREAD_MUTEX_INITIALIZER};
+
+void cache_init(int shards) {
+    cache.shards = calloc(shards, sizeof(cache_shard_t));
+    cache.shard_count = shards;
+    for (int i = 0; i < shards; i++) {
+        cache_shard_t* shard = &cache.shards[i];
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->max_size = MAX_CACHE_SIZE / shards;
+        shard->max_object_size = MAX_OBJECT_SIZE;
+        shard->policy = CACHE_POLICY_LRU;
+        shard->buckets = calloc(CACHE_BUCKETS_MIN, sizeof(cache_entry_t*));
+        shard->bucket_count = CACHE_BUCKETS_MIN;
+        shard->bodies = calloc(CACHE_BUCKETS_MIN, sizeof(cache_body_t*));
+        shard->body_bucket_count = CACHE_BUCKETS_MIN;
+    }
+}
+
+// The shard a URL hash belongs to (the bucket uses the low bits)
+static cache_shard_t* cache_shard(uint64_t hash) {
+    return &cache.shards[(hash >> 32) % cache.shard_count];
+}
+
+// Drop a reference to a body; the last one frees it
+static void cache_body_release(cache_body_t* body) {
+    if (__atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(body->data);
+        free(body);
+    }
+}
+
+// Drop a reference; the last one frees the entry
+void cache_release(cache_entry_t* entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(entry->url);
+        free(entry->vary);
+        free(entry->variant_key);
+        free(entry->header);
+        cache_body_release(entry->body);
+        free(entry->gzip_data);
+        free(entry->identity_header);
+        free(entry);
+    }
+}
+
+// Free every entry. Callers must have released all their references.
+void cache_cleanup() {
+    for (int i = 0; i < cache.shard_count; i++) {
+        cache_shard_t* shard = &cache.shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+
+        cache_entry_t* current = shard->head;
+        while (current != NULL) {
+            cache_entry_t* next = current->next;
+            cache_release(current);
+            current = next;
+        }
+
+        shard->head = NULL;
+        shard->tail = NULL;
+        shard->total_size = 0;
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->bucket_count = 0;
+        shard->count = 0;
+        free(shard->bodies);
+        shard->bodies = NULL;
+        shard->body_bucket_count = 0;
+        shard->body_count = 0;
+
+        pthread_rwlock_unlock(&shard->lock);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+    free(cache.shards);
+    cache.shards = NULL;
+    cache.shard_count = 0;
+}
+
+// The index slot holding (or that would hold) the first variant of a URL.
+// The hash is compared first, so a different URL in the chain rarely costs a strcmp.
+static cache_entry_t** cache_slot(cache_shard_t* shard, const char* url, uint64_t hash) {
+    cache_entry_t** slot = &shard->buckets[hash & (shard->bucket_count - 1)];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->url, url) != 0)) {
+        slot = &(*slot)->bucket_next;
+    }
+    return slot;
+}
+
+// Double the index once it holds more entries than buckets (caller holds the write lock)
+static void cache_grow_index(cache_shard_t* shard) {
+    if (shard->count <= shard->bucket_count) return;
+    size_t count = shard->bucket_count * 2;
+    cache_entry_t** buckets = calloc(count, sizeof(cache_entry_t*));
+    if (buckets == NULL) return; // keep the longer chains
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        cache_entry_t* entry = shard->buckets[i];
+        while (entry) {
+            cache_entry_t* next = entry->bucket_next;
+            entry->bucket_next = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+}
+
+// The body index slot holding a body with these bytes (as stored), or the empty one ending its chain
+static cache_body_t** cache_body_slot(cache_shard_t* shard, const cache_body_t* body) {
+    cache_body_t** slot = &shard->bodies[body->hash & (shard->body_bucket_count - 1)];
+    while (*slot && ((*slot)->hash != body->hash || (*slot)->codec != body->codec ||
+                     (*slot)->size != body->size || (*slot)->raw_size != body->raw_size ||
+                     memcmp((*slot)->data, body->data, body->size) != 0)) {
+        slot = &(*slot)->bucket_next;
+    }
+    return slot;
+}
+
+// Double the body index once it holds more bodies than buckets (caller holds the write lock)
+static void cache_grow_bodies(cache_shard_t* shard) {
+    if (shard->body_count <= shard->body_bucket_count) return;
+    size_t count = shard->body_bucket_count * 2;
+    cache_body_t** bodies = calloc(count, sizeof(cache_body_t*));
+    if (bodies == NULL) return;
+    for (size_t i = 0; i < shard->body_bucket_count; i++) {
+        cache_body_t* body = shard->bodies[i];
+        while (body) {
+            cache_body_t* next = body->bucket_next;
+            body->bucket_next = bodies[body->hash & (count - 1)];
+            bodies[body->hash & (count - 1)] = body;
+            body = next;
+        }
+    }
+    free(shard->bodies);
+    shard->bodies = bodies;
+    shard->body_bucket_count = count;
+}
+
+// An indexed entry now points at body; the first one indexes the body and
+// counts its size (caller holds the write lock)
+static void cache_body_link(cache_shard_t* shard, cache_body_t* body) {
+    if (body->entries++ > 0) return;
+    cache_body_t** slot = &shard->bodies[body->hash & (shard->body_bucket_count - 1)];
+    body->bucket_next = *slot;
+    *slot = body;
+    shard->body_count++;
+    shard->total_size += body->size;
+    cache_grow_bodies(shard);
+}
+
+// An entry pointing at body leaves the index; the last one takes the body out
+// too (entries being read keep it in memory) (caller holds the write lock)
+static void cache_body_unlink(cache_shard_t* shard, cache_body_t* body) {
+    if (--body->entries > 0) return;
+    cache_body_t** slot = &shard->bodies[body->hash & (shard->body_bucket_count - 1)];
+    while (*slot != body) slot = &(*slot)->bucket_next;
+    *slot = body->bucket_next;
+    shard->body_count--;
+    shard->total_size -= body->size;
+}
+
+// Unlink an entry from the list (caller holds the write lock)
+static void cache_unlink(cache_shard_t* shard, cache_entry_t* entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else shard->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else shard->tail = entry->prev;
+}
+
+// Add an entry to the front of the list (caller holds the write lock)
+static void cache_push_front(cache_shard_t* shard, cache_entry_t* entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head) shard->head->prev = entry;
+    else shard->tail = entry;
+    shard->head = entry;
+}
+
+// Remove an entry from the list and the index, and drop the cache's reference
+// (caller holds the write lock)
+static void cache_remove(cache_shard_t* shard, cache_entry_t* entry) {
+    cache_unlink(shard, entry);
+
+    cache_entry_t** slot = cache_slot(shard, entry->url, entry->hash);
+    if (*slot == entry) {
+        // The next variant (if any) takes its place in the chain
+        cache_entry_t* next = entry->variant_next;
+        if (next) {
+            next->bucket_next = entry->bucket_next;
+            *slot = next;
+        } else {
+            *slot = entry->bucket_next;
+        }
+    } else {
+        cache_entry_t* variant = *slot;
+        while (variant->variant_next != entry) variant = variant->variant_next;
+        variant->variant_next = entry->variant_next;
+    }
+
+    cache_body_unlink(shard, entry->body);
+    shard->total_size -= entry->size;
+    shard->count--;
+    cache_release(entry);
+}
+
+// Remove the oldest entry (caller holds the write lock)
+static void cache_evict_tail(cache_shard_t* shard) {
+    cache_remove(shard, shard->tail);
+}
+
+// Apply new limits. A smaller cache is reached by evicting a few entries at a
+// time, so lookups and inserts keep running while it shrinks.
+void cache_configure(size_t max_size, size_t max_object_size, int policy,
+                     const char* compress_types, const char* gzip_types) {
+    pthread_mutex_lock(&cache.types_lock);
+    strncpy(cache.compress_types, compress_types, sizeof(cache.compress_types) - 1);
+    strncpy(cache.gzip_types, gzip_types, sizeof(cache.gzip_types) - 1);
+    pthread_mutex_unlock(&cache.types_lock);
+
+    for (int s = 0; s < cache.shard_count; s++) {
+        cache_shard_t* shard = &cache.shards[s];
+        pthread_rwlock_wrlock(&shard->lock);
+        shard->max_size = max_size / cache.shard_count;
+        shard->max_object_size = max_object_size;
+        shard->policy = policy;
+        pthread_rwlock_unlock(&shard->lock);
+
+        int shrinking = 1;
+        while (shrinking) {
+            pthread_rwlock_wrlock(&shard->lock);
+            for (int i = 0; i < CACHE_EVICT_BATCH && shard->tail && shard->total_size > shard->max_size; i++) {
+                cache_evict_tail(shard);
+            }
+            shrinking = shard->tail && shard->total_size > shard->max_size;
+            pthread_rwlock_unlock(&shard->lock);
+        }
+    }
+}
+
+static int token_cmp(const void* a, const void* b) {
+    const char* const* x = a;
+    const char* const* y = b;
+    return strcmp(*x, *y);
+}
+
+// Normalize a comma-separated list: tokens trimmed, lowercased, sorted (and
+// without duplicates), joined by ','. `gzip, Deflate` and `deflate,gzip` are
+// the same. Appends to out (of capacity cap, holding *len bytes); 0 if it does not fit.
+static int normalize_list(char* out, size_t* len, size_t cap, const char* in, size_t in_len) {
+    char copy[MAX_LINE];
+    char* tokens[VARY_TOKENS_MAX];
+    int n = 0;
+    if (in_len >= sizeof(copy)) return 0;
+    for (size_t i = 0; i < in_len; i++) copy[i] = tolower((unsigned char)in[i]);
+    copy[in_len] = '\0';
+
+    for (char* t = copy; *t; ) {
+        while (*t == ' ' || *t == '\t' || *t == ',') t++;
+        if (*t == '\0') break;
+        char* end = t;
+        while (*end && *end != ',') end++;
+        char* next = *end ? end + 1 : end;
+        while (end > t && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        *end = '\0';
+        if (n == VARY_TOKENS_MAX) return 0;
+        tokens[n++] = t;
+        t = next;
+    }
+    qsort(tokens, n, sizeof(tokens[0]), token_cmp);
+
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && strcmp(tokens[i], tokens[i - 1]) == 0) continue;
+        size_t t_len = strlen(tokens[i]);
+        if (*len + t_len + 2 > cap) return 0;
+        if (i > 0) out[(*len)++] = ',';
+        memcpy(out + *len, tokens[i], t_len);
+        *len += t_len;
+    }
+    out[*len] = '\0';
+    return 1;
+}
+
+// The header names a stored response varies on, normalized, into names.
+// Returns 1, 0 if it does not vary, -1 if it cannot be stored (`Vary: *`, too long).
+static int vary_names(char* names, size_t cap, const char* data, size_t size) {
+    char value[MAX_LINE];
+    size_t len = 0;
+    size_t header_size = http_header_length(data, size);
+    if (!http_get_field(data, header_size, "Vary", value, sizeof(value))) return 0;
+    if (!normalize_list(names, &len, cap, value, strlen(value))) return -1;
+    if (len == 0) return 0;
+    if (strchr(names, '*')) return -1;
+    return 1;
+}
+
+// The secondary key of a request: the normalized value of each header in
+// `names`, one per line. Returns 0 if it does not fit.
+static int variant_key(char* key, size_t cap, const char* names, const char* fields, size_t fields_len) {
+    char name[MAX_LINE];
+    char value[MAX_LINE];
+    size_t len = 0;
+    key[0] = '\0';
+    for (const char* n = names; *n; ) {
+        const char* end = strchr(n, ',');
+        if (end == NULL) end = n + strlen(n);
+        if ((size_t)(end - n) >= sizeof(name)) return 0;
+        memcpy(name, n, end - n);
+        name[end - n] = '\0';
+        n = *end ? end + 1 : end;
+
+        if (http_get_field(fields, fields_len, name, value, sizeof(value))) {
+            if (!normalize_list(key, &len, cap, value, strlen(value))) return 0;
+        } else {
+            if (len + sizeof(VARY_ABSENT) + 1 > cap) return 0;
+            memcpy(key + len, VARY_ABSENT, sizeof(VARY_ABSENT) - 1);
+            len += sizeof(VARY_ABSENT) - 1;
+        }
+        if (len + 2 > cap) return 0;
+        key[len++] = '\n';
+        key[len] = '\0';
+    }
+    return 1;
+}
+
+// Look up a URL in the cache, for a request with the given header fields
+// (they select among the variants of a Vary response). A hit is returned with
+// a reference held; the caller reads the body between `cache_entry_open` and
+// `cache_entry_close`, then calls `cache_release`.
+cache_entry_t* cache_lookup(const url_key_t* url, const char* fields, size_t fields_len) {
+    cache_shard_t* shard = cache_shard(url->hash);
+
+    // LRU moves hits to the front, which modifies the list. The policy is
+    // read unlocked: a reload racing with this lookup takes either lock.
+    int lru = __atomic_load_n(&shard->policy, __ATOMIC_RELAXED) == CACHE_POLICY_LRU;
+    if (lru) pthread_rwlock_wrlock(&shard->lock);
+    else pthread_rwlock_rdlock(&shard->lock);
+    lru = lru && shard->policy == CACHE_POLICY_LRU;
+
+    cache_entry_t* hit = *cache_slot(shard, url->url, url->hash);
+    if (hit && hit->vary) {
+        // All variants of a URL vary on the same headers: one key to match
+        char key[MAX_LINE];
+        cache_entry_t* variant = hit;
+        hit = NULL;
+        if (variant_key(key, sizeof(key), variant->vary, fields, fields_len)) {
+            for (; variant; variant = variant->variant_next) {
+                if (strcmp(variant->variant_key, key) == 0) { hit = variant; break; }
+            }
+        }
+    }
+
+    if (hit) {
+        __atomic_add_fetch(&hit->refs, 1, __ATOMIC_RELAXED);
+
+        // Move cache hit to head of cache
+        if (lru && hit != shard->head) {
+            cache_unlink(shard, hit);
+            cache_push_front(shard, hit);
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+    return hit;
+}
+
+// Is a media type in a list of them (`text/` matches every text type)?
+static int type_listed(const char* types, const char* type) {
+    for (const char* t = types; *t; ) {
+        while (*t == ' ' || *t == ',') t++;
+        size_t n = strcspn(t, ", ");
+        const int prefix = n > 0 && t[n - 1] == '/';
+        if (n > 0 && (prefix || strlen(type) == n) && strncasecmp(type, t, n) == 0) return 1;
+        t += n;
+    }
+    return 0;
+}
+
+// How the body of a response (header of header_size bytes) is to be stored:
+// compressed if its Content-Type is in `cache-compress-types`, with a gzip
+// copy if it is in `cache-gzip-types`. Neither if it has a content coding already.
+static void cache_codings(const char* data, size_t header_size, int* compress, int* gzip) {
+    char compress_types[sizeof(cache.compress_types)];
+    char gzip_types[sizeof(cache.gzip_types)];
+    char value[MAX_LINE];
+    *compress = *gzip = 0;
+    pthread_mutex_lock(&cache.types_lock);
+    memcpy(compress_types, cache.compress_types, sizeof(compress_types));
+    memcpy(gzip_types, cache.gzip_types, sizeof(gzip_types));
+    pthread_mutex_unlock(&cache.types_lock);
+
+    if (compress_types[0] == '\0' && gzip_types[0] == '\0') return;
+    if (http_get_field(data, header_size, "Content-Encoding", value, sizeof(value)) &&
+        strcasecmp(value, "identity") != 0) return;
+    if (!http_get_field(data, header_size, "Content-Type", value, sizeof(value))) return;
+    value[strcspn(value, "; \t")] = '\0';
+
+    *compress = type_listed(compress_types, value);
+    *gzip = type_listed(gzip_types, value);
+}
+
+// The body to store for a response (of size bytes, header_size of them the
+// header): a copy, compressed if it qualifies and shrinks by at least
+// 1/CACHE_COMPRESS_MIN_SAVING; and a gzip copy of the response (*gzip_data,
+// or NULL) on the same terms. NULL if out of memory.
+static cache_body_t* cache_pack(const char* data, size_t size, size_t header_size,
+                                char** gzip_data, size_t* gzip_size) {
+    int compress = 0, gzip = 0;
+    *gzip_data = NULL;
+    *gzip_size = 0;
+
+    const char* raw = data + header_size;
+    const size_t body_len = size - header_size;
+    const size_t cap = body_len - body_len / CACHE_COMPRESS_MIN_SAVING;
+    if (header_size > 0 && body_len >= CACHE_COMPRESS_MIN_BODY) {
+        cache_codings(data, header_size, &compress, &gzip);
+    }
+    if (gzip) {
+        *gzip_data = gzip_response(data, size, header_size, cap, gzip_size);
+    }
+
+    cache_body_t* body = calloc(1, sizeof(cache_body_t));
+    if (body == NULL) return NULL;
+    body->raw_size = body_len;
+    body->hash = hash64(raw, body_len, CACHE_BODY_SEED);
+    body->refs = 1;
+    if (compress) {
+        size_t n = 0;
+        body->data = malloc(cap);
+        if (body->data && (n = lz_compress(raw, body_len, body->data, cap)) > 0) {
+            char* shrunk = realloc(body->data, n);
+            if (shrunk) body->data = shrunk;
+            body->size = n;
+            body->codec = CACHE_CODEC_LZ;
+            return body;
+        }
+        free(body->data);
+    }
+
+    body->data = malloc(body_len ? body_len : 1);
+    if (body->data == NULL) {
+        free(body);
+        return NULL;
+    }
+    memcpy(body->data, raw, body_len);
+    body->size = body_len;
+    return body;
+}
+
+// Open the response of a hit for sending: its gzip copy if the request accepts
+// gzip and there is one, else the response (with the header that says it
+// varies on Accept-Encoding, if there is a gzip copy), with its body inflated
+// into a copy if it is stored compressed. Only as much of the body as the answer to
+// req reads is inflated (none for HEAD or a 304, up to the last byte of a
+// Range); body_size is still the whole body's. With no req, the whole
+// response is opened. Returns 0, or -1 if it cannot be inflated.
+int cache_entry_open(const cache_entry_t* entry, http_request_t* req, cache_view_t* view) {
+    view->copy = NULL;
+    if (req && entry->gzip_data && http_accepts_encoding(req->fields, req->fields_len, "gzip")) {
+        view->header_size = http_header_length(entry->gzip_data, entry->gzip_size);
+        view->header = entry->gzip_data;
+        view->body = entry->gzip_data + view->header_size;
+        view->body_size = entry->gzip_size - view->header_size;
+        return 0;
+    }
+
+    const cache_body_t* body = entry->body;
+    view->header = req && entry->identity_header ? entry->identity_header : entry->header;
+    view->header_size = req && entry->identity_header ? entry->identity_header_size : entry->header_size;
+    view->body = body->data;
+    view->body_size = body->raw_size;
+    if (body->codec == CACHE_CODEC_NONE) return 0;
+
+    const size_t need = req ? http_cached_extent(req, entry->header, entry->header_size, body->raw_size)
+                            : body->raw_size;
+    view->body = NULL;
+    if (need == 0) return 0;
+    view->copy = malloc(need);
+    if (view->copy == NULL || lz_decompress_prefix(body->data, body->size, view->copy, need) < 0) {
+        free(view->copy);
+        view->copy = NULL;
+        return -1;
+    }
+    view->body = view->copy;
+    return 0;
+}
+
+void cache_entry_close(cache_view_t* view) {
+    free(view->copy);
+    view->copy = NULL;
+}
+
+// Store a response under a URL and (for a Vary response) a variant key
+static void cache_insert_variant(const char* url, uint64_t hash, const char* key, const char* data, size_t size) {
+    char names[MAX_LINE];
+    const int varies = vary_names(names, sizeof(names), data, size);
+    if (varies < 0) return;
+    cache_shard_t* shard = cache_shard(hash);
+
+    // Copy (and compress) outside the lock
+    const size_t header_size = http_header_length(data, size);
+    size_t gzip_size, identity_size = 0;
+    char* gzip_data;
+    char* identity_header = NULL;
+    char* header = malloc(header_size ? header_size : 1);
+    cache_body_t* body = header ? cache_pack(data, size, header_size, &gzip_data, &gzip_size) : NULL;
+    if (body == NULL) {
+        free(header);
+        return;
+    }
+    memcpy(header, data, header_size);
+    // With a gzip copy, clients are told the response varies on Accept-Encoding
+    // whichever they get (the stored header stays the origin's, for peers and snapshots)
+    if (gzip_data && (identity_header = gzip_identity_header(data, header_size, &identity_size)) == NULL) {
+        free(gzip_data);
+        gzip_data = NULL;
+        gzip_size = 0;
+    }
+    const size_t entry_size = header_size + gzip_size + identity_size;
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    if (size > shard->max_object_size || entry_size + body->size > shard->max_size || shard->buckets == NULL) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(header);
+        free(gzip_data);
+        free(identity_header);
+        cache_body_release(body);
+        return;
+    }
+
+    // The same bytes already stored (for any URL): share them
+    cache_body_t* duplicate = NULL;
+    cache_body_t* shared = *cache_body_slot(shard, body);
+    if (shared) {
+        __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+        duplicate = body;
+        body = shared;
+    }
+
+    // Drop what this response replaces: the same variant, or every variant if
+    // the origin now varies on other headers (or not at all)
+    cache_entry_t* variant = *cache_slot(shard, url, hash);
+    while (variant) {
+        cache_entry_t* next = variant->variant_next;
+        if (!varies || !variant->vary || strcmp(variant->vary, names) != 0 ||
+            strcmp(variant->variant_key, key) == 0) {
+            cache_remove(shard, variant);
+        }
+        variant = next;
+    }
+
+    // Make space by removing older entries (a shared body costs nothing
+    // more, unless they were its last users)
+    while (shard->total_size + entry_size + (body->entries ? 0 : body->size) > shard->max_size &&
+           shard->tail != NULL) {
+        cache_evict_tail(shard);
+    }
+
+    // Create new entry
+    cache_entry_t* new_entry = calloc(1, sizeof(cache_entry_t));
+    new_entry->url = strdup(url);
+    new_entry->vary = varies ? strdup(names) : NULL;
+    new_entry->variant_key = varies ? strdup(key) : NULL;
+    new_entry->hash = hash;
+    new_entry->header = header;
+    new_entry->header_size = header_size;
+    new_entry->body = body;
+    new_entry->gzip_data = gzip_data;
+    new_entry->gzip_size = gzip_size;
+    new_entry->identity_header = identity_header;
+    new_entry->identity_header_size = identity_size;
+    new_entry->size = entry_size;
+    new_entry->refs = 1;
+
+    // Index it: as the URL's first variant, or next to the first one
+    cache_entry_t** slot = cache_slot(shard, url, hash);
+    if (*slot) {
+        new_entry->variant_next = (*slot)->variant_next;
+        (*slot)->variant_next = new_entry;
+    } else {
+        *slot = new_entry;
+    }
+    shard->count++;
+    cache_grow_index(shard);
+
+    // Add to front of list
+    cache_push_front(shard, new_entry);
+
+    shard->total_size += entry_size;
+    cache_body_link(shard, body);
+
+    pthread_rwlock_unlock(&shard->lock);
+    if (duplicate) cache_body_release(duplicate);
+}
+
+// Store the response to a request (url and header fields)
+void cache_insert(const url_key_t* url, const char* fields, size_t fields_len, const char* data, size_t size) {
+    char names[MAX_LINE];
+    char key[MAX_LINE];
+    key[0] = '\0';
+    const int varies = vary_names(names, sizeof(names), data, size);
+    if (varies < 0) return;
+    if (varies && !variant_key(key, sizeof(key), names, fields, fields_len)) return;
+    cache_insert_variant(url->url, url->hash, key, data, size);
+}
+
+// Drop every variant of a URL (a POST, PUT, PATCH or DELETE changed it)
+void cache_invalidate(const url_key_t* url) {
+    cache_shard_t* shard = cache_shard(url->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    cache_entry_t** slot;
+    while (shard->buckets && *(slot = cache_slot(shard, url->url, url->hash))) {
+        cache_remove(shard, *slot);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+// Write every entry, shard by shard and oldest first, as
+// [url length][key length][size][url][key][data] (header and body, uncompressed;
+// shared bodies and gzip copies are made again when read), after a magic number. A zero
+// url length ends the snapshot. Reading it back in order restores recency
+// (within each shard; the hash, and so the shard, is recomputed from the url).
+int cache_snapshot_write(int fd) {
+    int return_cd = 0;
+    uint32_t magic = CACHE_SNAPSHOT_MAGIC;
+    if (write_all(fd, &magic, sizeof(magic)) < 0) return -1;
+
+    for (int s = 0; s < cache.shard_count && return_cd == 0; s++) {
+        cache_shard_t* shard = &cache.shards[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        for (cache_entry_t* entry = shard->tail; entry && return_cd == 0; entry = entry->prev) {
+            uint32_t url_len = strlen(entry->url);
+            uint32_t key_len = entry->variant_key ? strlen(entry->variant_key) : 0;
+            cache_view_t view;
+            if (cache_entry_open(entry, NULL, &view) < 0) continue;
+            uint64_t size = view.header_size + view.body_size;
+            if (write_all(fd, &url_len, sizeof(url_len)) < 0 ||
+                write_all(fd, &key_len, sizeof(key_len)) < 0 ||
+                write_all(fd, &size, sizeof(size)) < 0 ||
+                write_all(fd, entry->url, url_len) < 0 ||
+                write_all(fd, entry->variant_key, key_len) < 0 ||
+                write_all(fd, (void*)view.header, view.header_size) < 0 ||
+                write_all(fd, (void*)view.body, view.body_size) < 0) {
+                return_cd = -1;
+            }
+            cache_entry_close(&view);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    uint32_t end = 0;
+    if (return_cd == 0 && write_all(fd, &end, sizeof(end)) < 0) { return_cd = -1; }
+    return return_cd;
+}
+
+// Insert the entries of a snapshot written by `cache_snapshot_write`
+int cache_snapshot_read(int fd) {
+    int count = 0;
+    uint32_t magic;
+    if (read_all(fd, &magic, sizeof(magic)) != sizeof(magic) || magic != CACHE_SNAPSHOT_MAGIC) { return -1; }
+    while (1) {
+        uint32_t url_len, key_len;
+        uint64_t size;
+        if (read_all(fd, &url_len, sizeof(url_len)) != sizeof(url_len)) { return -1; }
+        if (url_len == 0) { return count; }
+        if (url_len >= MAX_LINE || read_all(fd, &key_len, sizeof(key_len)) != sizeof(key_len) ||
+            key_len >= MAX_LINE || read_all(fd, &size, sizeof(size)) != sizeof(size)) { return -1; }
+
+        char url[MAX_LINE];
+        char key[MAX_LINE];
+        char* data = malloc(size ? size : 1);
+        if (!data || read_all(fd, url, url_len) != url_len || read_all(fd, key, key_len) != key_len ||
+            read_all(fd, data, size) != (ssize_t)size) {
+            free(data);
+            return -1;
+        }
+        url[url_len] = '\0';
+        key[key_len] = '\0';
+        cache_insert_variant(url, url_hash(url), key, data, size);
+        free(data);
+        count++;
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "url.h"
+
+// How a cached body is stored
+enum { CACHE_CODEC_NONE, CACHE_CODEC_LZ };
+
+// A response body, shared by every entry (of a shard) whose body has the same bytes
+typedef struct cache_body {
+    char* data; // The body as stored (compressed, for CACHE_CODEC_LZ)
+    size_t size; // Stored size
+    size_t raw_size; // Size uncompressed
+    int codec; // CACHE_CODEC_*
+    uint64_t hash; // Of the uncompressed bytes (`hash64`)
+    int refs; // Entries pointing at it, including evicted ones still being read
+    int entries; // Entries in the shard's index pointing at it (under the shard lock)
+    struct cache_body* bucket_next; // Next body in the same body index bucket
+} cache_body_t;
+
+// Cache entry struct
+typedef struct cache_entry {
+    char* url; // Canonical URL as key
+    char* vary; // Normalized header names the response varies on, or NULL
+    char* variant_key; // Normalized values of those headers in the request, or NULL
+    char* header; // Cached response header (status line through blank line)
+    size_t header_size;
+    cache_body_t* body; // Cached response body
+    char* gzip_data; // The response with a gzip body, or NULL
+    size_t gzip_size;
+    char* identity_header; // With a gzip copy: the header sent to clients with the body (Vary: Accept-Encoding added)
+    size_t identity_header_size;
+    size_t size; // What the entry counts against the cache size: headers and gzip copy (a body counts once)
+    int refs; // The cache's own reference, plus one per `cache_lookup` not yet released
+    uint64_t hash; // of the URL (`url_hash`)
+    struct cache_entry* prev; // Previous (more recently used) entry
+    struct cache_entry* next; // Next (less recently used) entry
+    struct cache_entry* bucket_next; // Next URL in the same index bucket (first variants only)
+    struct cache_entry* variant_next; // Next variant of the same URL
+} cache_entry_t;
+
+// A cached response, ready to send: header and body (an inflated copy, if stored compressed)
+typedef struct {
+    const char* header;
+    size_t header_size;
+    const char* body;
+    size_t body_size;
+    char* copy; // Freed by `cache_entry_close`
+} cache_view_t;
+
+void cache_init(int shards);
+void cache_cleanup(void);
+void cache_configure(size_t max_size, size_t max_object_size, int policy,
+                     const char* compress_types, const char* gzip_types);
+cache_entry_t* cache_lookup(const url_key_t* url, const char* fields, size_t fields_len);
+void cache_release(cache_entry_t* entry);
+int cache_entry_open(const cache_entry_t* entry, http_request_t* req, cache_view_t* view);
+void cache_entry_close(cache_view_t* view);
+void cache_insert(const url_key_t* url, const char* fields, size_t fields_len, const char* data, size_t size);
+void cache_invalidate(const url_key_t* url);
+int cache_snapshot_write(int fd);
+int cache_snapshot_read(int fd);
+
+#endif/*CACHE_H*/
@@ -0,0 +1,163 @@
+/**
+ * Chunked transfer coding (RFC 9112, section 7.1), decoded on the fly:
+ *
+ *     chunk-size [; ext] CRLF   chunk-data CRLF   ...   0 CRLF   [trailers] CRLF
+ *
+ * The decoder is a small state machine over whatever bytes have arrived.
+ * Chunk data is moved in whole runs and the lines around it are skipped
+ * with `memchr`; both are vectorized in libc, so the per-byte work is
+ * confined to the few hex digits of each chunk size.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "chunked.h"
+
+enum {
+    CHUNK_SIZE,     // hex digits
+    CHUNK_SIZE_END, // extensions, up to LF
+    CHUNK_DATA,
+    CHUNK_DATA_CR,  // CRLF after the data
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,  // at the start of a trailer line (or the final CRLF)
+    CHUNK_TRAILER_LINE,
+    CHUNK_LAST_LF,
+    CHUNK_DONE,
+    CHUNK_ERROR,
+};
+
+/* value of each hex digit; -1 for other bytes. */
+static const signed char hex_value[256] = {
+    [0 ... 255] = -1,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+void chunked_init ( chunked_t *dec )
+{
+    dec->state = CHUNK_SIZE;
+    dec->digits = 0;
+    dec->remaining = 0;
+}
+
+int chunked_done ( const chunked_t *dec )
+{
+    return dec->state == CHUNK_DONE;
+}
+
+/* decode `len` bytes of chunked body from `in` to `out`. out may equal in
+   (the output never overtakes the input). bytes after the end of the body
+   are ignored. returns the number of bytes written to out, or -1 if the
+   body is malformed. */
+ssize_t chunked_decode ( chunked_t *dec, const char *in, size_t len, char *out )
+{
+    const char *p = in, *end = in + len;
+    char *o = out;
+
+    while ( p < end ) {
+        switch ( dec->state ) {
+        case CHUNK_SIZE: {
+            int v = hex_value[(unsigned char)*p];
+            if ( v < 0 ) {
+                if ( dec->digits == 0 ) { goto malformed; }
+                dec->state = CHUNK_SIZE_END;
+                break;
+            }
+            if ( ++dec->digits > 15 ) { goto malformed; } // no chunk is that large
+            dec->remaining = ( dec->remaining << 4 ) | v;
+            p++;
+            break;
+        }
+        case CHUNK_SIZE_END: {
+            const char *lf = memchr ( p, '\n', end - p );
+            if ( lf == NULL ) { p = end; break; }
+            p = lf + 1;
+            dec->digits = 0;
+            dec->state = dec->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        }
+        case CHUNK_DATA: {
+            size_t n = (size_t)( end - p ) < dec->remaining ? (size_t)( end - p ) : dec->remaining;
+            if ( o != p ) { memmove ( o, p, n ); }
+            o += n;
+            p += n;
+            dec->remaining -= n;
+            if ( dec->remaining == 0 ) { dec->state = CHUNK_DATA_CR; }
+            break;
+        }
+        case CHUNK_DATA_CR:
+            dec->state = CHUNK_DATA_LF;
+            if ( *p == '\r' ) { p++; } // tolerate a bare LF
+            break;
+        case CHUNK_DATA_LF:
+            if ( *p++ != '\n' ) { goto malformed; }
+            dec->state = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER:
+            if ( *p == '\r' ) { p++; dec->state = CHUNK_LAST_LF; }
+            else if ( *p == '\n' ) { p++; dec->state = CHUNK_DONE; }
+            else { dec->state = CHUNK_TRAILER_LINE; }
+            break;
+        case CHUNK_TRAILER_LINE: {
+            /* trailer fields are dropped; we have no use for them. */
+            const char *lf = memchr ( p, '\n', end - p );
+            if ( lf == NULL ) { p = end; break; }
+            p = lf + 1;
+            dec->state = CHUNK_TRAILER;
+            break;
+        }
+        case CHUNK_LAST_LF:
+            if ( *p++ != '\n' ) { goto malformed; }
+            dec->state = CHUNK_DONE;
+            break;
+        case CHUNK_DONE:
+            return o - out;
+        default:
+            goto malformed;
+        }
+    }
+    return o - out;
+
+malformed:
+    dec->state = CHUNK_ERROR;
+    return -1;
+}
+
+/* turn the staged header of a chunked response into that of its decoded
+   body: Transfer-Encoding is dropped, and `Content-Length: body_len` is added
+   (unless body_len < 0: the length is not known yet, the response then ends
+   when the connection closes). buf holds the header at 0 and the body at
+   body_start, at least CHUNKED_HEADER_SLACK bytes after the header's end.
+   the new header is placed right before the body; returns its offset. */
+size_t chunked_finish_header ( char *buf, size_t header_size, size_t body_start, ssize_t body_len )
+{
+    /* cut the Transfer-Encoding line (and a Content-Length, which a chunked
+       response should not have had). */
+    for ( char *line = buf; line < buf + header_size; ) {
+        char *lf = memchr ( line, '\n', buf + header_size - line );
+        if ( lf == NULL ) { break; }
+        if ( strncasecmp ( line, "Transfer-Encoding:", 18 ) == 0 ||
+             strncasecmp ( line, "Content-Length:", 15 ) == 0 ) {
+            memmove ( line, lf + 1, buf + header_size - ( lf + 1 ) );
+            header_size -= lf + 1 - line;
+            continue;
+        }
+        line = lf + 1;
+    }
+
+    /* replace the blank line by Content-Length and a blank line. the line
+       removed above is about as long, so this stays within the slack. */
+    size_t len = header_size - 2;
+    if ( body_len >= 0 ) {
+        len += snprintf ( buf + len, CHUNKED_HEADER_SLACK, "Content-Length: %zd\r\n", body_len );
+    }
+    memcpy ( buf + len, "\r\n", 2 );
+    len += 2;
+
+    memmove ( buf + body_start - len, buf, len );
+    return body_start - len;
+}
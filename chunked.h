@@ -0,0 +1,25 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Streaming decoder for `Transfer-Encoding: chunked` response bodies. It is
+   fed the body as it arrives, in pieces of any size, and needs no memory of
+   its own; the decoded bytes may be written over the input. */
+typedef struct {
+    int state;
+    int digits;          // hex digits of the current chunk size
+    uint64_t remaining;  // bytes left in the current chunk
+} chunked_t;
+
+// Room needed between a staged header and its body for `chunked_finish_header`
+#define CHUNKED_HEADER_SLACK 64
+
+void    chunked_init ( chunked_t *dec );
+ssize_t chunked_decode ( chunked_t *dec, const char *in, size_t len, char *out );
+int     chunked_done ( const chunked_t *dec );
+size_t  chunked_finish_header ( char *buf, size_t header_size, size_t body_start, ssize_t body_len );
+
+#endif/*CHUNKED_H*/
@@ -0,0 +1,360 @@
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "proxy.h"  // compile-time defaults
+#include "config.h"
+#include "error.h"
+
+/* The current configuration. Written by the main thread (at startup and on
+   SIGHUP), read by workers through `config_get`. */
+static struct proxy_config current;
+static pthread_rwlock_t config_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* command line, kept so that a reload can re-apply it on top of the file. */
+static int    saved_argc;
+static char **saved_argv;
+
+static void config_defaults ( struct proxy_config *cfg )
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->port            = -1;
+    cfg->listen_backlog  = LISTENQ;
+    cfg->max_cache_size  = MAX_CACHE_SIZE;
+    cfg->max_object_size = MAX_OBJECT_SIZE;
+    cfg->cache_policy    = CACHE_POLICY_LRU;
+    cfg->max_workers     = 0;
+    cfg->client_timeout  = 0;
+    cfg->server_timeout  = 0;
+    cfg->log_level       = LOG_LEVEL_INFO;
+    cfg->upgrade_cache   = 1;
+    cfg->drain_timeout   = 30;
+    cfg->segment_count   = 4;
+    cfg->segment_min_size = 1 << 20;
+    cfg->segment_max_size = 64 << 20;
+    strcpy(cfg->connect_ports, "443");
+    cfg->tunnel_idle_timeout = 300;
+    cfg->cache_shards    = 1;
+    cfg->negative_dns_ttl = 10;
+    cfg->negative_connect_ttl = 2;
+    cfg->circuit_error_rate = 50;
+    cfg->circuit_min_requests = 20;
+    cfg->circuit_open_time = 10;
+    cfg->circuit_probes  = 1;
+    cfg->fetch_queue_length = 64;
+    cfg->fetch_queue_timeout = 30;
+    cfg->hedge_percentile = 95;
+    cfg->hedge_min_delay = 10;
+    cfg->peer_timeout = 100;
+}
+
+/* parse a non-negative number with an optional k/m/g suffix. */
+static int parse_size ( const char *value, size_t *out )
+{
+    char *end;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (end == value || value[0] == '-') return -1;
+    switch (tolower((unsigned char)*end)) {
+    case 'k': n <<= 10; end++; break;
+    case 'm': n <<= 20; end++; break;
+    case 'g': n <<= 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *out = n;
+    return 0;
+}
+
+static int parse_bool ( const char *value, int *out )
+{
+    if (strcasecmp(value, "yes") == 0 || strcmp(value, "1") == 0) { *out = 1; return 0; }
+    if (strcasecmp(value, "no") == 0  || strcmp(value, "0") == 0) { *out = 0; return 0; }
+    return -1;
+}
+
+static int parse_path ( const char *value, char *out )
+{
+    if (strlen(value) >= PATH_MAX) return -1;
+    strcpy(out, value);
+    return 0;
+}
+
+static int parse_string ( const char *value, char *out, size_t size )
+{
+    if (strlen(value) >= size) return -1;
+    strcpy(out, value);
+    return 0;
+}
+
+static int parse_int ( const char *value, int *out )
+{
+    size_t n;
+    if (parse_size(value, &n) < 0 || n > INT_MAX) return -1;
+    *out = (int)n;
+    return 0;
+}
+
+/* set one tunable. keys are the long option names (without `--`);
+   `_` and `-` are interchangeable. returns -1 on an unknown key or bad value. */
+static int config_set ( struct proxy_config *cfg, const char *key, const char *value )
+{
+    char k[64];
+    size_t i;
+    for (i = 0; key[i] && i < sizeof(k) - 1; i++) k[i] = key[i] == '_' ? '-' : key[i];
+    k[i] = '\0';
+
+    if (strcmp(k, "port") == 0)            return parse_int(value, &cfg->port);
+    if (strcmp(k, "listen-backlog") == 0)  return parse_int(value, &cfg->listen_backlog);
+    if (strcmp(k, "cache-size") == 0)      return parse_size(value, &cfg->max_cache_size);
+    if (strcmp(k, "object-size") == 0)     return parse_size(value, &cfg->max_object_size);
+    if (strcmp(k, "max-workers") == 0)     return parse_int(value, &cfg->max_workers);
+    if (strcmp(k, "client-timeout") == 0)  return parse_int(value, &cfg->client_timeout);
+    if (strcmp(k, "server-timeout") == 0)  return parse_int(value, &cfg->server_timeout);
+    if (strcmp(k, "upgrade-socket") == 0)  return parse_path(value, cfg->upgrade_socket);
+    if (strcmp(k, "upgrade") == 0)         return parse_bool(value, &cfg->upgrade);
+    if (strcmp(k, "upgrade-cache") == 0)   return parse_bool(value, &cfg->upgrade_cache);
+    if (strcmp(k, "drain-timeout") == 0)   return parse_int(value, &cfg->drain_timeout);
+    if (strcmp(k, "segment-hosts") == 0)   return parse_string(value, cfg->segment_hosts, sizeof(cfg->segment_hosts));
+    if (strcmp(k, "segment-count") == 0)   return parse_int(value, &cfg->segment_count);
+    if (strcmp(k, "segment-min-size") == 0) return parse_size(value, &cfg->segment_min_size);
+    if (strcmp(k, "segment-max-size") == 0) return parse_size(value, &cfg->segment_max_size);
+    if (strcmp(k, "connect-ports") == 0)   return parse_string(value, cfg->connect_ports, sizeof(cfg->connect_ports));
+    if (strcmp(k, "tunnel-idle-timeout") == 0) return parse_int(value, &cfg->tunnel_idle_timeout);
+    if (strcmp(k, "cache-shards") == 0)    return parse_int(value, &cfg->cache_shards);
+    if (strcmp(k, "cache-query-sort") == 0) return parse_bool(value, &cfg->cache_query_sort);
+    if (strcmp(k, "cache-query-strip") == 0) return parse_string(value, cfg->cache_query_strip, sizeof(cfg->cache_query_strip));
+    if (strcmp(k, "cache-compress-types") == 0) return parse_string(value, cfg->cache_compress_types, sizeof(cfg->cache_compress_types));
+    if (strcmp(k, "cache-gzip-types") == 0) return parse_string(value, cfg->cache_gzip_types, sizeof(cfg->cache_gzip_types));
+    if (strcmp(k, "negative-dns-ttl") == 0) return parse_int(value, &cfg->negative_dns_ttl);
+    if (strcmp(k, "negative-connect-ttl") == 0) return parse_int(value, &cfg->negative_connect_ttl);
+    if (strcmp(k, "negative-status-ttl") == 0) return parse_int(value, &cfg->negative_status_ttl);
+    if (strcmp(k, "circuit-error-rate") == 0) return parse_int(value, &cfg->circuit_error_rate);
+    if (strcmp(k, "circuit-min-requests") == 0) return parse_int(value, &cfg->circuit_min_requests);
+    if (strcmp(k, "circuit-open-time") == 0) return parse_int(value, &cfg->circuit_open_time);
+    if (strcmp(k, "circuit-probes") == 0)  return parse_int(value, &cfg->circuit_probes);
+    if (strcmp(k, "circuit-slow-time") == 0) return parse_int(value, &cfg->circuit_slow_time);
+    if (strcmp(k, "origin-max-fetches") == 0) return parse_int(value, &cfg->origin_max_fetches);
+    if (strcmp(k, "max-fetches") == 0)     return parse_int(value, &cfg->max_fetches);
+    if (strcmp(k, "fetch-queue-length") == 0) return parse_int(value, &cfg->fetch_queue_length);
+    if (strcmp(k, "fetch-queue-timeout") == 0) return parse_int(value, &cfg->fetch_queue_timeout);
+    if (strcmp(k, "hedge-budget") == 0)   return parse_int(value, &cfg->hedge_budget);
+    if (strcmp(k, "hedge-percentile") == 0) return parse_int(value, &cfg->hedge_percentile);
+    if (strcmp(k, "hedge-min-delay") == 0) return parse_int(value, &cfg->hedge_min_delay);
+    if (strcmp(k, "routes") == 0)          return parse_path(value, cfg->routes);
+    if (strcmp(k, "peers") == 0)           return parse_string(value, cfg->peers, sizeof(cfg->peers));
+    if (strcmp(k, "peer-self") == 0)       return parse_string(value, cfg->peer_self, sizeof(cfg->peer_self));
+    if (strcmp(k, "peer-timeout") == 0)    return parse_int(value, &cfg->peer_timeout);
+    if (strcmp(k, "parents") == 0)         return parse_string(value, cfg->parents, sizeof(cfg->parents));
+    if (strcmp(k, "hosts-file") == 0)      return parse_path(value, cfg->hosts_file);
+    if (strcmp(k, "cache-policy") == 0) {
+        if (strcasecmp(value, "lru") == 0)  { cfg->cache_policy = CACHE_POLICY_LRU;  return 0; }
+        if (strcasecmp(value, "fifo") == 0) { cfg->cache_policy = CACHE_POLICY_FIFO; return 0; }
+        return -1;
+    }
+    if (strcmp(k, "log-level") == 0) {
+        if (strcasecmp(value, "error") == 0) { cfg->log_level = LOG_LEVEL_ERROR; return 0; }
+        if (strcasecmp(value, "info") == 0)  { cfg->log_level = LOG_LEVEL_INFO;  return 0; }
+        if (strcasecmp(value, "debug") == 0) { cfg->log_level = LOG_LEVEL_DEBUG; return 0; }
+        return -1;
+    }
+    if (strcmp(k, "config") == 0)          return parse_path(value, cfg->config_file);
+    return -1;
+}
+
+/* read `key = value` lines; `#` starts a comment. */
+static int config_load_file ( struct proxy_config *cfg, const char *path )
+{
+    char line[1024];
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "\033[31mfailure:\033[0m open config file %s.\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char *key = line;
+        while (isspace((unsigned char)*key)) key++;
+        if (*key == '\0') continue;
+
+        char *eq = strchr(key, '=');
+        if (!eq) goto bad;
+        char *value = eq + 1;
+        do { *eq-- = '\0'; } while (eq >= key && isspace((unsigned char)*eq));
+        while (isspace((unsigned char)*value)) value++;
+        char *end = value + strlen(value);
+        while (end > value && isspace((unsigned char)end[-1])) *--end = '\0';
+
+        if (strcmp(key, "config") == 0 || config_set(cfg, key, value) < 0) goto bad;
+        continue;
+    bad:
+        fprintf(stderr, "\033[31mfailure:\033[0m %s:%d: bad setting.\n", path, lineno);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* flags that take no value. */
+static int is_switch ( const char *key )
+{
+    return strcmp(key, "upgrade") == 0;
+}
+
+/* apply `--key=value` / `--key value` / `--switch` flags and the positional port.
+   only_config: just pick up `--config` (the file is read before the flags). */
+static int config_apply_args ( struct proxy_config *cfg, int argc, char **argv, int only_config )
+{
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            if (!only_config && config_set(cfg, "port", arg) < 0) return -1;
+            continue;
+        }
+        char key[64];
+        const char *value;
+        char *eq = strchr(arg, '=');
+        if (eq) {
+            if (eq - arg - 2 >= (int)sizeof(key)) return -1;
+            memcpy(key, arg + 2, eq - arg - 2);
+            key[eq - arg - 2] = '\0';
+            value = eq + 1;
+        } else {
+            if (strlen(arg + 2) >= sizeof(key)) return -1;
+            strcpy(key, arg + 2);
+            if (is_switch(key)) value = "yes";
+            else if (i + 1 < argc) value = argv[++i];
+            else return -1;
+        }
+        if (only_config != (strcmp(key, "config") == 0)) continue;
+        if (config_set(cfg, key, value) < 0) return -1;
+    }
+    return 0;
+}
+
+/* defaults <- config file <- command line. */
+static int config_build ( struct proxy_config *cfg )
+{
+    config_defaults(cfg);
+    if (config_apply_args(cfg, saved_argc, saved_argv, 1) < 0) return -1;
+    if (cfg->config_file[0] && config_load_file(cfg, cfg->config_file) < 0) return -1;
+    if (config_apply_args(cfg, saved_argc, saved_argv, 0) < 0) return -1;
+    if (cfg->port <= 0 || cfg->port > 65535) return -1;
+    if (cfg->cache_shards < 1 || cfg->cache_shards > CACHE_SHARDS_MAX) return -1;
+    return 0;
+}
+
+int config_init ( int argc, char **argv )
+{
+    saved_argc = argc;
+    saved_argv = argv;
+    if (config_build(&current) < 0) return -1;
+    __atomic_store_n(&log_level, current.log_level, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* re-read the configuration. on error, the old one stays in effect.
+   NOTE: the port cannot change without re-binding, nor the cache shard
+   count without rehashing the cache, so they are kept. */
+int config_reload ( void )
+{
+    struct proxy_config cfg;
+    if (config_build(&cfg) < 0) return -1;
+
+    pthread_rwlock_wrlock(&config_lock);
+    cfg.port = current.port;
+    cfg.cache_shards = current.cache_shards;
+    current = cfg;
+    __atomic_store_n(&log_level, cfg.log_level, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&config_lock);
+    return 0;
+}
+
+/* copy the current configuration (a consistent snapshot). */
+void config_get ( struct proxy_config *cfg )
+{
+    pthread_rwlock_rdlock(&config_lock);
+    *cfg = current;
+    pthread_rwlock_unlock(&config_lock);
+}
+
+void config_usage ( const char *prog )
+{
+    fprintf(stderr,
+        "usage: %s [options] <port>\n"
+        "  --config <file>          read `key = value` settings (keys as below)\n"
+        "  --cache-size <bytes>     total cache size        (default %d)\n"
+        "  --object-size <bytes>    largest cached object   (default %d)\n"
+        "  --cache-policy lru|fifo  replacement policy      (default lru)\n"
+        "  --cache-shards <n>       independently locked cache partitions,\n"
+        "                           each with 1/n of the size (default 1)\n"
+        "  --cache-query-sort yes|no  sort query parameters in cache keys (default no)\n"
+        "  --cache-query-strip <list>  query parameters left out of cache keys\n"
+        "                           (`utm_*,fbclid`; `*` ends a prefix)\n"
+        "  --cache-compress-types <list>  store bodies of these types compressed\n"
+        "                           (`text/,application/json`; default none)\n"
+        "  --cache-gzip-types <list>  keep a gzip copy of these types for clients\n"
+        "                           that accept gzip (default none)\n"
+        "  --listen-backlog <n>     listen queue length     (default %d)\n"
+        "  --max-workers <n>        concurrent connections  (default 0, unlimited)\n"
+        "  --client-timeout <s>     client I/O timeout      (default 0, none)\n"
+        "  --server-timeout <s>     server I/O timeout      (default 0, none)\n"
+        "  --log-level error|info|debug                     (default info)\n"
+        "  --upgrade-socket <path>  accept binary upgrades on this Unix socket\n"
+        "  --upgrade                take over from the proxy on --upgrade-socket\n"
+        "  --upgrade-cache yes|no   take over its cache too (default yes)\n"
+        "  --drain-timeout <s>      grace period for in-flight requests (default 30)\n"
+        "  --segment-hosts <list>   fetch large objects from these hosts (`*` = all)\n"
+        "                           as parallel range requests (default none)\n"
+        "  --segment-count <n>      range requests per object (default 4)\n"
+        "  --segment-min-size <bytes>  smallest object to split (default 1m); split\n"
+        "                           objects are cached only if they fit --object-size\n"
+        "  --segment-max-size <bytes>  largest object to split  (default 64m)\n"
+        "  --connect-ports <list>   ports CONNECT may reach (`*` = any) (default 443)\n"
+        "  --tunnel-idle-timeout <s>  close idle CONNECT tunnels (default 300)\n"
+        "  --negative-dns-ttl <s>   fail requests for an origin whose name did not\n"
+        "                           resolve at once, for this long (default 10)\n"
+        "  --negative-connect-ttl <s>  likewise for one that refused or timed out\n"
+        "                           a connection (default 2)\n"
+        "  --negative-status-ttl <s>  send an error response (>= 400)\n"
+        "                           again for this long (default 0: off)\n"
+        "  --circuit-error-rate <pct>  refuse requests to an origin once this share\n"
+        "                           of them failed in the last 10s (default 50; 0: off)\n"
+        "  --circuit-min-requests <n>  ...out of at least this many (default 20)\n"
+        "  --circuit-open-time <s>  for this long, then try again (default 10)\n"
+        "  --circuit-probes <n>     with this many trial requests (default 1)\n"
+        "  --circuit-slow-time <ms>  a response header this late counts as a\n"
+        "                           failure (default 0: off)\n"
+        "  --origin-max-fetches <n>  concurrent cache-miss fetches per origin\n"
+        "                           (default 0: unlimited)\n"
+        "  --max-fetches <n>        ...and in all; origins waiting for a turn share\n"
+        "                           it fairly (default 0: unlimited)\n"
+        "  --fetch-queue-length <n>  requests that may wait per origin (default 64)\n"
+        "  --fetch-queue-timeout <s>  ...and for how long (default 30)\n"
+        "  --hedge-budget <pct>     send up to this share of cache-miss GETs again\n"
+        "                           on a second connection when the origin is slow\n"
+        "                           to answer (default 0: off)\n"
+        "  --hedge-percentile <pct>  slow: later than this share of its recent\n"
+        "                           answers (default 95)\n"
+        "  --hedge-min-delay <ms>   ...and at least this late (default 10)\n"
+        "  --routes <file>          serve as a reverse proxy, routing requests to\n"
+        "                           the upstreams in this file (see route.c)\n"
+        "  --peers <list>           sibling proxies to share caches with, by their\n"
+        "                           peer addresses: `host:port,...` (see peer.c)\n"
+        "  --peer-self <host:port>  this proxy's entry in --peers; it answers\n"
+        "                           their queries there\n"
+        "  --peer-timeout <ms>      a peer's time to connect and answer (default 100)\n"
+        "  --parents <list>         fetch through these parent proxies, the first\n"
+        "                           one that is up: `host:port,...` (see parent.c)\n"
+        "  --hosts-file <file>      pin hosts to the addresses in this file\n"
+        "                           (/etc/hosts format), bypassing DNS\n"
+        "sizes accept k/m/g suffixes. send SIGHUP to reload.\n",
+        prog, MAX_CACHE_SIZE, MAX_OBJECT_SIZE, LISTENQ);
+}
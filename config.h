@@ -0,0 +1,70 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <limits.h>
+
+/* Cache replacement policies. */
+enum { CACHE_POLICY_LRU, CACHE_POLICY_FIFO };
+
+/* Most cache shards (`cache-shards`). */
+#define CACHE_SHARDS_MAX 64
+
+/* Runtime configuration. Defaults come from proxy.h; they are overridden by
+   the config file (`--config`), which in turn is overridden by the other
+   command line flags. On SIGHUP the whole chain is evaluated again. */
+struct proxy_config {
+    int    port;
+    int    listen_backlog;    // `listen` backlog (was LISTENQ)
+    size_t max_cache_size;    // bytes (was MAX_CACHE_SIZE)
+    size_t max_object_size;   // bytes (was MAX_OBJECT_SIZE)
+    int    cache_policy;      // CACHE_POLICY_*
+    int    max_workers;       // concurrent client connections; 0 = unlimited
+    int    client_timeout;    // seconds a client read/write may block; 0 = forever
+    int    server_timeout;    // seconds a server connect/read/write may block; 0 = forever
+    int    log_level;         // LOG_LEVEL_* (see error.h)
+    char   upgrade_socket[PATH_MAX]; // Unix socket for binary upgrades; "" = disabled
+    int    upgrade;           // take over from the proxy on upgrade_socket (`--upgrade`)
+    int    upgrade_cache;     // ask it for a cache snapshot too
+    int    drain_timeout;     // seconds in-flight requests get after a handover
+    char   config_file[PATH_MAX];
+    char   segment_hosts[1024];   // hosts fetched in parallel segments: `a.com,b.org`, `*` = all
+    int    segment_count;     // parallel range requests per object
+    size_t segment_min_size;  // bytes; smaller objects are fetched in one piece
+    size_t segment_max_size;  // bytes; larger objects are just relayed
+    char   connect_ports[256]; // ports CONNECT may reach: `443,8443`, `*` = any
+    int    tunnel_idle_timeout; // seconds a CONNECT tunnel may sit idle; 0 = forever
+    int    cache_shards;      // independently locked cache partitions (fixed at startup)
+    int    cache_query_sort;  // sort query parameters in cache keys
+    char   cache_query_strip[1024]; // query parameters left out of cache keys: `utm_*,fbclid`
+    char   cache_compress_types[1024]; // content types stored compressed: `text/,application/json`
+    char   cache_gzip_types[1024]; // content types also stored gzipped, for clients that accept it
+    int    negative_dns_ttl;  // seconds an origin name that did not resolve fails at once; 0 = off
+    int    negative_connect_ttl; // seconds an origin that refused/timed out a connect fails at once; 0 = off
+    int    negative_status_ttl; // seconds an error response (>= 400) is sent again; 0 = off
+    int    circuit_error_rate; // percent of failed requests that opens an origin's circuit; 0 = off
+    int    circuit_min_requests; // requests in the window before the rate counts
+    int    circuit_open_time; // seconds an open circuit refuses requests
+    int    circuit_probes;    // concurrent trial requests while half-open
+    int    circuit_slow_time; // milliseconds to a response header that count as a failure; 0 = off
+    int    origin_max_fetches; // concurrent fetches from one origin; 0 = unlimited
+    int    max_fetches;       // concurrent fetches in all; 0 = unlimited
+    int    fetch_queue_length; // requests that may wait per origin; 0 = unlimited
+    int    fetch_queue_timeout; // seconds a request may wait for its turn; 0 = forever
+    int    hedge_budget;      // percent of misses that may be hedged; 0 = off
+    int    hedge_percentile;  // hedge once the origin is slower than this share of its answers
+    int    hedge_min_delay;   // milliseconds; never hedge sooner
+    char   routes[PATH_MAX];  // reverse-proxy route table (see route.c); "" = forward proxy
+    char   peers[1024];       // sibling proxies sharing their caches: `host:port,...` (see peer.c)
+    char   peer_self[256];    // this proxy's entry in peers, where it listens for them (fixed at startup)
+    int    peer_timeout;      // milliseconds a peer has to connect, and to answer
+    char   parents[1024];     // parent proxies to fetch through, in order: `host:port,...` (see parent.c)
+    char   hosts_file[PATH_MAX]; // hosts pinned to fixed addresses, /etc/hosts format (see hosts.c); "" = none
+};
+
+int  config_init ( int argc, char **argv );
+int  config_reload ( void );
+void config_get ( struct proxy_config *cfg );
+void config_usage ( const char *prog );
+
+#endif/*CONFIG_H*/
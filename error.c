@@ -4,12 +4,17 @@
 #include <netdb.h>
 #include <string.h>
 
-int error_args_fatal ( int argc, char **argv )
+#include "error.h"
+#include "config.h"
+
+int log_level = LOG_LEVEL_INFO;
+
+int error_args_fatal ( int return_cd, char **argv )
 {
-    if ( argc != 2 ) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if ( return_cd < 0 ) {
+	config_usage ( argv[0] );
 	return 1;
-    } // assumption: the argument provided, is a valid port number.
+    }
     return 0;
 }
 
@@ -19,7 +24,7 @@ int error_socket_fatal( int returncode )
 	fprintf(stderr, "\033[31mfailure:\033[0m create socket. fatal.\n");
 	return 1;
     }
-    printf("\033[32msuccess:\033[0m create socket.\n");
+    log_info("\033[32msuccess:\033[0m create socket.\n");
     return 0;
 }
 
@@ -29,7 +34,7 @@ int error_socket_option( int returncode )
 	fprintf(stderr, "\033[31mfailure:\033[0m set socket option. let us try and proceed anyway.\n");
 	return 1;
     }
-    printf("\033[32msuccess:\033[0m set socket option.\n");
+    log_info("\033[32msuccess:\033[0m set socket option.\n");
     return 0;
 }
 
@@ -39,7 +44,7 @@ int error_socket_server( int server_fd )
 	fprintf(stderr, "\033[31mfailure:\033[0m create server socket & connect. dropping requets.\n");
 	return 1;
     }
-    printf("\033[32msuccess:\033[0m create server socket & connect.\n");
+    log_info("\033[32msuccess:\033[0m create server socket & connect.\n");
     return 0;
 }
 
@@ -49,7 +54,7 @@ int error_bind_fatal( int returncode )
 	fprintf(stderr, "\033[31mfailure:\033[0m bind socket to address. fatal.\n");
 	return 1;
     }
-    printf("\033[32msuccess:\033[0m bind socket to address.\n");
+    log_info("\033[32msuccess:\033[0m bind socket to address.\n");
     return 0;
 }
 
@@ -59,7 +64,7 @@ int error_listen_fatal( int returncode )
 	fprintf(stderr, "\033[31mfailure:\033[0m listen to socket. fatal.\n");
 	return 1;
     }
-    printf("\033[32msuccess:\033[0m listen to socket.\n");
+    log_info("\033[32msuccess:\033[0m listen to socket.\n");
     return 0;
 }
 
@@ -69,7 +74,8 @@ int error_accept_fatal ( int returncode ) {
 	// error occurred. was it a bad one?
 	if ( ! ( errno == ENETDOWN   || errno == EPROTO || errno == ENOPROTOOPT  ||
 		 errno == EHOSTDOWN  || errno == ENONET || errno == EHOSTUNREACH ||
-		 errno == EOPNOTSUPP || errno == ENETUNREACH ) ) {
+		 errno == EOPNOTSUPP || errno == ENETUNREACH || errno == EINTR ||
+		 errno == EAGAIN     || errno == EWOULDBLOCK ) ) {
 	    // it's a bad one; terminate.
 	    fprintf(stderr, "\033[31mfailure\033[0m to accept connection. fatal.\n");
 	    return 1;
@@ -83,7 +89,7 @@ int error_accept ( int client_fd ) {
 	fprintf(stderr, "\033[31mfailure\033[0m to accept connection. retrying.\n");
 	return 1;
     }
-    printf("\033[32maccepted\033[0m connection request.\n");
+    log_info("\033[32maccepted\033[0m connection request.\n");
     /* From whom? We don't need to know; we have a socket to reply to them.
        while you /should/ log client hostname & port in a production system,
        I left that out for brevity (finding out: `getnameinfo`, >= 20 LoC) */
@@ -95,7 +101,7 @@ int error_close ( int returncode ) {
 	fprintf(stderr, "\033[31mfailure:\033[0m close client connection. ignoring that.\n");
 	return 1;
     }
-    printf("\033[32msuccess:\033[0m close client connection.\n");
+    log_info("\033[32msuccess:\033[0m close client connection.\n");
     return 0;
 }
 
@@ -104,7 +110,7 @@ int error_close_server ( int returncode ) {
 	fprintf(stderr, "\033[31mfailure:\033[0m close server connection. ignoring that.\n");
 	return 1;
     }
-    printf("\033[32msuccess:\033[0m close server connection.\n");
+    log_info("\033[32msuccess:\033[0m close server connection.\n");
     return 0;
 }
 
@@ -126,7 +132,7 @@ int error_read ( int n ) {
 	fprintf(stderr, "\033[31mfailure:\033[0m error reading client fd. dropping request.\n");
 	return 1;
     }
-    printf("read  %*d bytes from client.\n", 4, n );
+    log_info("read  %*d bytes from client.\n", 4, n );
     return 0;
 }
 
@@ -138,10 +144,10 @@ int error_read_server ( int server_fd, int n ) {
 	return 1;
     }
     if ( n == 0 ) {
-	printf("reached end of server fd (EOF).\n");
+	log_info("reached end of server fd (EOF).\n");
 	return 0;
     }
-    printf("read  %*d bytes from server.\n", 4, n );
+    log_info("read  %*d bytes from server.\n", 4, n );
     return 0;
 }
 
@@ -152,7 +158,7 @@ int error_write_server ( int server_fd, int n ) {
 	if ( error_close_server ( n ) ) { /* ignored */}
 	return 1;
     }
-    printf("wrote %*d bytes to server.\n", 4, n );
+    log_info("wrote %*d bytes to server.\n", 4, n );
     return 0;
 }
 
@@ -163,7 +169,7 @@ int error_write_client ( int client_fd, int n ) {
 	if ( error_close ( n ) ) { /* ignored */}
 	return 1;
     }
-    printf("wrote %*d bytes to client.\n", 4, n );
+    log_info("wrote %*d bytes to client.\n", 4, n );
     return 0;
 }
 
@@ -172,17 +178,20 @@ int error_header ( int return_cd ) {
 	fprintf(stderr, "\033[31mfailure:\033[0m client request header was malformed.\n");
 	return 1;
     } 
-    printf("\033[32msuccess:\033[0m set request header.\n");
+    log_info("\033[32msuccess:\033[0m set request header.\n");
     return 0;
 }
 
-int error_non_get ( char *method ) {
-    if (strcasecmp(method, "GET")) {
-	fprintf(stderr, "\033[31mfailure:\033[0m not a GET-request. dropping request.\n");
-        return 1;
+int error_method ( char *method ) {
+    static const char *methods[] = { "GET", "HEAD", "POST", "PUT", "PATCH", "DELETE", "CONNECT" };
+    for ( size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++ ) {
+        if ( strcasecmp(method, methods[i]) == 0 ) {
+            log_info("\033[32msuccess:\033[0m it is a %s request.\n", method);
+            return 0;
+        }
     }
-    printf("\033[32msuccess:\033[0m it is a GET request.\n");
-    return 0;
+    fprintf(stderr, "\033[31mfailure:\033[0m unsupported method %s. dropping request.\n", method);
+    return 1;
 }
 
 int error_address_server ( int return_cd ) {
@@ -190,6 +199,6 @@ int error_address_server ( int return_cd ) {
         fprintf(stderr, "\033[31mfailure:\033[0m %s\n", gai_strerror(return_cd));
         return 1;
     }
-    printf("\033[32msuccess:\033[0m generate server addresses.\n");
+    log_info("\033[32msuccess:\033[0m generate server addresses.\n");
     return 0;
 }
@@ -1,5 +1,14 @@
+/* Log levels. failures are always reported (to stderr); successes and
+   progress are reported (to stdout) at LOG_LEVEL_INFO and up. */
+enum { LOG_LEVEL_ERROR, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG };
+extern int log_level; // set from the configuration (see config.c); atomic, as a reload changes it
+
+#define LOG_LEVEL() __atomic_load_n ( &log_level, __ATOMIC_RELAXED )
+#define log_info(...)  do { if ( LOG_LEVEL() >= LOG_LEVEL_INFO )  printf(__VA_ARGS__); } while (0)
+#define log_debug(...) do { if ( LOG_LEVEL() >= LOG_LEVEL_DEBUG ) printf(__VA_ARGS__); } while (0)
+
 /* Error reporting */
-int error_args_fatal ( int argc, char **argv );
+int error_args_fatal ( int return_cd, char **argv );
 int error_socket_fatal ( int returncode );
 int error_socket_option( int returncode );
 int error_socket_server( int server_fd );
@@ -10,7 +19,7 @@ int error_accept ( int returncode );
 int error_close ( int returncode );
 int error_read ( int returncode );
 int error_header ( int return_cd );
-int error_non_get ( char *method );
+int error_method ( char *method );
 int error_write_server ( int server_fd, int return_cd );
 int error_write_client ( int client_fd, int n ); 
 int error_read_server ( int server_fd, int n );
@@ -0,0 +1,311 @@
+/**
+ * Per-origin limits on concurrent fetches, with fair queuing.
+ *
+ * At most `origin-max-fetches` fetches from one origin (`host:port`), and
+ * `max-fetches` in all, are in flight at a time (0: no limit). A request
+ * over a limit waits in its origin's queue: up to `fetch-queue-length`
+ * requests per origin (more are refused at once) for up to
+ * `fetch-queue-timeout` seconds (then it is refused).
+ *
+ * As fetches end, the origins with waiting requests are served in deficit
+ * round-robin order, where the cost of a fetch is the time it holds its slot:
+ * an origin whose turn it is starts fetches while its credit covers its
+ * average fetch time (charged up front, and corrected by the time the fetch
+ * really took when it ends), then the turn passes on, and the next origin is
+ * credited FETCH_QUANTUM. So each origin gets a fair share of the proxy's
+ * fetch time, however slow its fetches are, and a slow origin cannot crowd
+ * out the others.
+ *
+ * Origins beyond FETCH_MAX_ORIGINS are not limited.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fetch.h"
+#include "origin.h"
+
+#define FETCH_BUCKETS 256        // a power of two
+#define FETCH_MAX_ORIGINS 4096
+#define FETCH_INITIAL_COST 100   // milliseconds a fetch is assumed to take, until one has
+#define FETCH_QUANTUM 100        // milliseconds of fetch time an origin is credited per turn
+#define FETCH_MAX_DEBT 8         // a deficit is never below this many average fetch times
+
+typedef struct fetch_waiter {
+    pthread_cond_t cond;
+    int granted;                 // 1: its turn; -1: refused (shutting down)
+    long charged;
+    struct fetch_waiter *next;
+} fetch_waiter_t;
+
+typedef struct fetch_origin {
+    origin_entry_t entry;        // its `host:port` key
+    int in_flight;
+    int queued;                  // length of the waiter queue
+    fetch_waiter_t *head, *tail;
+    long deficit;                // milliseconds of fetch time it may still start this round
+    long cost;                   // average milliseconds a fetch takes
+    int active;                  // in the round-robin ring
+    struct fetch_origin *ring_next;
+} fetch_origin_t;
+
+static origin_entry_t *fetch_buckets[FETCH_BUCKETS];
+
+static struct {
+    origin_table_t origins;
+    fetch_origin_t *ring_head, *ring_tail; // origins with waiters, in round-robin order
+    size_t ring_count;
+    int in_flight;
+    int origin_max, max_total, queue_length, queue_timeout;
+    int stopped;
+    pthread_mutex_t lock;
+} fetch = { { fetch_buckets, FETCH_BUCKETS, 0, FETCH_MAX_ORIGINS }, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static long now_ms ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* the state of hostname:port, made if it is new and there is room (caller holds the lock). */
+static fetch_origin_t *origin ( const char *hostname, const char *port )
+{
+    int made;
+    fetch_origin_t *o = origin_get ( &fetch.origins, hostname, port, sizeof(*o), &made );
+    if ( made ) { o->cost = FETCH_INITIAL_COST; }
+    return o;
+}
+
+static int room ( void )
+{
+    return fetch.max_total <= 0 || fetch.in_flight < fetch.max_total;
+}
+
+static int origin_room ( const fetch_origin_t *o )
+{
+    return fetch.origin_max <= 0 || o->in_flight < fetch.origin_max;
+}
+
+static void ring_push ( fetch_origin_t *o )
+{
+    o->ring_next = NULL;
+    if ( fetch.ring_tail ) { fetch.ring_tail->ring_next = o; }
+    else { fetch.ring_head = o; }
+    fetch.ring_tail = o;
+    fetch.ring_count++;
+}
+
+static fetch_origin_t *ring_pop ( void )
+{
+    fetch_origin_t *o = fetch.ring_head;
+    fetch.ring_head = o->ring_next;
+    if ( fetch.ring_head == NULL ) { fetch.ring_tail = NULL; }
+    fetch.ring_count--;
+    return o;
+}
+
+/* give waiting requests their turns while there is room: deficit round-robin
+   over the origins in the ring, the one at its head having the turn (caller
+   holds the lock). */
+static void dispatch ( void )
+{
+    size_t passed = 0; // origins in a row that could not start a fetch when their turn came
+    while ( fetch.ring_head && room() && passed < fetch.ring_count ) {
+        fetch_origin_t *o = fetch.ring_head;
+        if ( o->head == NULL ) {
+            /* nobody waiting any more (they timed out): it leaves the ring. */
+            ring_pop();
+            o->active = 0;
+            o->deficit = 0;
+            continue;
+        }
+        if ( origin_room ( o ) && o->deficit >= o->cost ) {
+            fetch_waiter_t *w = o->head;
+            o->head = w->next;
+            if ( o->head == NULL ) { o->tail = NULL; }
+            o->queued--;
+            o->deficit -= o->cost;
+            o->in_flight++;
+            fetch.in_flight++;
+            w->charged = o->cost;
+            w->granted = 1;
+            pthread_cond_signal ( &w->cond );
+            passed = 0;
+            continue;
+        }
+
+        /* its credit is used up (or it is at its own limit): the turn passes on,
+           and the next origin is credited a quantum if it can use it. */
+        ring_pop();
+        ring_push ( o );
+        fetch_origin_t *next = fetch.ring_head;
+        if ( next->head && origin_room ( next ) ) {
+            next->deficit += FETCH_QUANTUM;
+            passed = 0;
+        } else {
+            passed++;
+        }
+    }
+}
+
+void fetch_configure ( int origin_max, int max_total, int queue_length, int queue_timeout )
+{
+    pthread_mutex_lock ( &fetch.lock );
+    fetch.origin_max = origin_max;
+    fetch.max_total = max_total;
+    fetch.queue_length = queue_length;
+    fetch.queue_timeout = queue_timeout;
+    dispatch();                  // the limits may have grown
+    pthread_mutex_unlock ( &fetch.lock );
+}
+
+/* refuse every waiting (and later) request: the proxy is shutting down. */
+void fetch_interrupt ( void )
+{
+    pthread_mutex_lock ( &fetch.lock );
+    fetch.stopped = 1;
+    for ( fetch_origin_t *o = fetch.ring_head; o; o = o->ring_next ) {
+        for ( fetch_waiter_t *w = o->head; w; w = w->next ) {
+            w->granted = -1;
+            pthread_cond_signal ( &w->cond );
+        }
+        o->head = o->tail = NULL;
+        o->queued = 0;
+    }
+    pthread_mutex_unlock ( &fetch.lock );
+}
+
+void fetch_cleanup ( void )
+{
+    pthread_mutex_lock ( &fetch.lock );
+    origin_clear ( &fetch.origins );
+    fetch.ring_head = fetch.ring_tail = NULL;
+    fetch.ring_count = 0;
+    pthread_mutex_unlock ( &fetch.lock );
+}
+
+/* wait for a turn to fetch from hostname:port. returns 0 (give it back with
+   fetch_release), or -1 if the request is refused: its origin's queue is
+   full, or it waited too long. */
+int fetch_acquire ( const char *hostname, const char *port, fetch_slot_t *slot )
+{
+    slot->origin = NULL;
+    slot->started = now_ms();
+    slot->charged = 0;
+
+    pthread_mutex_lock ( &fetch.lock );
+    if ( fetch.stopped ) {
+        pthread_mutex_unlock ( &fetch.lock );
+        return -1;
+    }
+    fetch_origin_t *o = fetch.origin_max > 0 || fetch.max_total > 0 ? origin ( hostname, port ) : NULL;
+    if ( o == NULL ) {
+        pthread_mutex_unlock ( &fetch.lock );
+        return 0;
+    }
+
+    /* nobody ahead of it: go. (once a fetch ends, waiters are given any room at once,
+       so while there is room overall, the origins still waiting are all at their own limit.) */
+    if ( o->head == NULL && room() && origin_room ( o ) ) {
+        o->in_flight++;
+        fetch.in_flight++;
+        slot->origin = o;
+        pthread_mutex_unlock ( &fetch.lock );
+        return 0;
+    }
+    if ( fetch.queue_length > 0 && o->queued >= fetch.queue_length ) {
+        pthread_mutex_unlock ( &fetch.lock );
+        return -1;
+    }
+
+    fetch_waiter_t w;
+    pthread_cond_init ( &w.cond, NULL );
+    w.granted = 0;
+    w.charged = 0;
+    w.next = NULL;
+    if ( o->tail ) { o->tail->next = &w; }
+    else { o->head = &w; }
+    o->tail = &w;
+    o->queued++;
+    if ( ! o->active ) {
+        o->active = 1;
+        if ( fetch.ring_head == NULL ) { o->deficit = FETCH_QUANTUM; } // the turn is its at once
+        ring_push ( o );
+    }
+
+    struct timespec deadline;
+    clock_gettime ( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += fetch.queue_timeout;
+    while ( w.granted == 0 ) {
+        const int rc = fetch.queue_timeout > 0
+                     ? pthread_cond_timedwait ( &w.cond, &fetch.lock, &deadline )
+                     : pthread_cond_wait ( &w.cond, &fetch.lock );
+        if ( rc == ETIMEDOUT && w.granted == 0 ) {
+            /* give up its place (its origin leaves the ring when dispatch finds it empty). */
+            fetch_waiter_t **link = &o->head, *prev = NULL;
+            while ( *link != &w ) { prev = *link; link = &(*link)->next; }
+            *link = w.next;
+            if ( o->tail == &w ) { o->tail = prev; }
+            o->queued--;
+            break;
+        }
+    }
+    if ( w.granted == 1 ) {
+        slot->origin = o;
+        slot->charged = w.charged;
+        slot->started = now_ms();
+    }
+    const int granted = w.granted == 1;
+    pthread_mutex_unlock ( &fetch.lock );
+    pthread_cond_destroy ( &w.cond );
+    return granted ? 0 : -1;
+}
+
+/* a turn at hostname:port only if one is free right now: no waiting, and
+   no place in its queue. returns 0 (give it back with fetch_release), or -1. */
+int fetch_try_acquire ( const char *hostname, const char *port, fetch_slot_t *slot )
+{
+    slot->origin = NULL;
+    slot->started = now_ms();
+    slot->charged = 0;
+
+    pthread_mutex_lock ( &fetch.lock );
+    fetch_origin_t *o = fetch.origin_max > 0 || fetch.max_total > 0 ? origin ( hostname, port ) : NULL;
+    int granted = ! fetch.stopped && ( o == NULL || ( o->head == NULL && room() && origin_room ( o ) ) );
+    if ( granted && o ) {
+        o->in_flight++;
+        fetch.in_flight++;
+        slot->origin = o;
+    }
+    pthread_mutex_unlock ( &fetch.lock );
+    return granted ? 0 : -1;
+}
+
+/* the fetch is over: give its turn to whoever is next. */
+void fetch_release ( fetch_slot_t *slot )
+{
+    fetch_origin_t *o = slot->origin;
+    if ( o == NULL ) { return; }
+    long elapsed = now_ms() - slot->started;
+    if ( elapsed < 1 ) { elapsed = 1; }
+
+    pthread_mutex_lock ( &fetch.lock );
+    o->in_flight--;
+    fetch.in_flight--;
+    o->cost = ( o->cost * 7 + elapsed ) / 8;
+    if ( o->cost < 1 ) { o->cost = 1; }
+    if ( o->active ) {
+        /* charge what the fetch really took, not the estimate. */
+        o->deficit -= elapsed - slot->charged;
+        if ( o->deficit < -FETCH_MAX_DEBT * o->cost ) { o->deficit = -FETCH_MAX_DEBT * o->cost; }
+    }
+    dispatch();
+    pthread_mutex_unlock ( &fetch.lock );
+    slot->origin = NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+/* Per-origin limits on concurrent fetches, with fair (deficit round-robin)
+   queuing for a turn; see fetch.c. */
+
+/* A turn at an origin, from fetch_acquire to fetch_release. */
+typedef struct {
+    struct fetch_origin *origin; // NULL: not limited
+    long started;   // CLOCK_MONOTONIC milliseconds
+    long charged;   // milliseconds charged to the origin's deficit up front
+} fetch_slot_t;
+
+void fetch_configure ( int origin_max, int max_total, int queue_length, int queue_timeout );
+void fetch_interrupt ( void );
+void fetch_cleanup ( void );
+int  fetch_acquire ( const char *hostname, const char *port, fetch_slot_t *slot );
+int  fetch_try_acquire ( const char *hostname, const char *port, fetch_slot_t *slot );
+void fetch_release ( fetch_slot_t *slot );
+
+#endif/*FETCH_H*/
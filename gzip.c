@@ -0,0 +1,148 @@
+/**
+ * gzip variants of cached responses (RFC 9110, section 8.4.1.3), made with
+ * the system zlib once, when the response is stored; every hit from a
+ * client that accepts gzip then sends the smaller copy as is.
+ *
+ * The header of the copy is that of the response, with a new Content-Length,
+ * `Content-Encoding: gzip`, `Accept-Encoding` added to Vary (so that shared
+ * caches downstream keep the two apart), and a strong ETag made weak (the
+ * bytes differ from the identity response's). The identity response is sent
+ * with `Accept-Encoding` added to its Vary too (gzip_identity_header).
+ */
+
+#define _GNU_SOURCE // strcasestr
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "gzip.h"
+#include "io.h" // MAX_LINE
+
+#define GZIP_LEVEL 6           // zlib's default: most of level 9's ratio at a fraction of its time
+#define GZIP_WINDOW_BITS (15 + 16) // the largest window, with a gzip wrapper (not zlib's)
+#define GZIP_HEADER_SLACK 256  // room for the fields added to the header
+
+/* does `line` start with header field `name` (followed by a colon)? */
+static int field_is ( const char *line, const char *name )
+{
+    size_t n = strlen(name);
+    return strncasecmp ( line, name, n ) == 0 && line[n] == ':';
+}
+
+/* the value of the header line at line (up to eol), trimmed, into value. */
+static void field_value ( const char *line, const char *eol, char *value, size_t cap )
+{
+    const char *v = memchr ( line, ':', eol - line ) + 1;
+    while ( v < eol && ( *v == ' ' || *v == '\t' ) ) { v++; }
+    while ( eol > v && ( eol[-1] == '\r' || eol[-1] == '\n' || eol[-1] == ' ' ) ) { eol--; }
+    size_t n = (size_t)( eol - v ) < cap ? (size_t)( eol - v ) : cap - 1;
+    memcpy ( value, v, n );
+    value[n] = '\0';
+}
+
+/* the header of the response, with `Accept-Encoding` added to its Vary,
+   into out (of capacity cap): for the gzip copy (gzip), with a body of
+   body_len bytes, else for the identity response. returns its length, or 0
+   if it does not fit. */
+static size_t gzip_header ( char *out, size_t cap, const char *data, size_t header_size, int gzip, size_t body_len )
+{
+    char vary[MAX_LINE] = "", etag[MAX_LINE] = "";
+    size_t len = 0;
+    const char *end = data + header_size - 2; // exclude the blank line
+
+    for ( const char *line = data; line < end; ) {
+        const char *eol = memchr ( line, '\n', end - line );
+        eol = eol ? eol + 1 : end;
+        if ( line != data && field_is ( line, "Vary" ) ) {
+            field_value ( line, eol, vary, sizeof(vary) );
+        } else if ( gzip && line != data && field_is ( line, "ETag" ) ) {
+            field_value ( line, eol, etag, sizeof(etag) );
+        } else if ( line == data || ! gzip || ! field_is ( line, "Content-Length" ) ) {
+            if ( len + ( eol - line ) >= cap ) { return 0; }
+            memcpy ( out + len, line, eol - line );
+            len += eol - line;
+        }
+        line = eol;
+    }
+
+    int n = 0;
+    if ( gzip ) { n = snprintf ( out + len, cap - len, "Content-Encoding: gzip\r\nContent-Length: %zu\r\n", body_len ); }
+    if ( n < 0 || (size_t)n >= cap - len ) { return 0; }
+    len += n;
+    /* (a response stored from such a header, e.g. a peer's, lists it already.) */
+    const int listed = strcasestr ( vary, "Accept-Encoding" ) != NULL;
+    n = snprintf ( out + len, cap - len, "Vary: %s%s%s\r\n", vary, vary[0] && ! listed ? ", " : "",
+                   listed ? "" : "Accept-Encoding" );
+    if ( n < 0 || (size_t)n >= cap - len ) { return 0; }
+    len += n;
+    if ( etag[0] ) {
+        n = snprintf ( out + len, cap - len, "ETag: %s%s\r\n", strncmp ( etag, "W/", 2 ) == 0 ? "" : "W/", etag );
+        if ( n < 0 || (size_t)n >= cap - len ) { return 0; }
+        len += n;
+    }
+    if ( len + 2 >= cap ) { return 0; }
+    memcpy ( out + len, "\r\n", 2 );
+    return len + 2;
+}
+
+/* gzip the body of a stored response (of size bytes, header_size of them
+   the header) into a complete response. returns it (malloc'd) and its size,
+   or NULL if the gzip body would be larger than max_body. */
+char *gzip_response ( const char *data, size_t size, size_t header_size, size_t max_body, size_t *out_size )
+{
+    const size_t body_len = size - header_size;
+    char *body = malloc ( max_body ? max_body : 1 );
+    if ( body == NULL ) { return NULL; }
+
+    z_stream zs;
+    memset ( &zs, 0, sizeof(zs) );
+    if ( deflateInit2 ( &zs, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+        free ( body );
+        return NULL;
+    }
+    /* zlib counts in uInt; cached objects are far below 4GB, but do not wrap. */
+    int done = 0;
+    zs.next_in = (Bytef *)( data + header_size );
+    zs.next_out = (Bytef *)body;
+    zs.avail_out = max_body > UINT32_MAX ? UINT32_MAX : max_body;
+    if ( body_len <= UINT32_MAX ) {
+        zs.avail_in = body_len;
+        done = deflate ( &zs, Z_FINISH ) == Z_STREAM_END;
+    }
+    const size_t gz_len = zs.total_out;
+    deflateEnd ( &zs );
+    if ( ! done ) {
+        free ( body );
+        return NULL;
+    }
+
+    const size_t cap = header_size + GZIP_HEADER_SLACK;
+    char *out = malloc ( cap + gz_len );
+    size_t hlen;
+    if ( out == NULL || ( hlen = gzip_header ( out, cap, data, header_size, 1, gz_len ) ) == 0 ) {
+        free ( out );
+        free ( body );
+        return NULL;
+    }
+    memcpy ( out + hlen, body, gz_len );
+    free ( body );
+    *out_size = hlen + gz_len;
+    return out;
+}
+
+/* the header (header_size bytes at data) of a stored response that has a
+   gzip copy, as sent with the identity body: with `Accept-Encoding` added
+   to Vary. returns it (malloc'd) and its size, or NULL. */
+char *gzip_identity_header ( const char *data, size_t header_size, size_t *out_size )
+{
+    const size_t cap = header_size + GZIP_HEADER_SLACK;
+    char *out = malloc ( cap );
+    if ( out == NULL || ( *out_size = gzip_header ( out, cap, data, header_size, 0, 0 ) ) == 0 ) {
+        free ( out );
+        return NULL;
+    }
+    return out;
+}
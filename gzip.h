@@ -0,0 +1,11 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+/* A gzip-encoded copy of a stored response (with `Content-Encoding: gzip`),
+   for clients that accept it; see gzip.c. */
+char *gzip_response ( const char *data, size_t size, size_t header_size, size_t max_body, size_t *out_size );
+char *gzip_identity_header ( const char *data, size_t header_size, size_t *out_size );
+
+#endif/*GZIP_H*/
@@ -0,0 +1,250 @@
+/**
+ * Per-origin health tracking and circuit breaking.
+ *
+ * Every request to an origin (`host:port`) is counted in a rolling window of
+ * HEALTH_WINDOW one-second buckets: requests, errors (no connection, no
+ * response header, a 5xx, or a header slower than `circuit-slow-time`), and
+ * time to the header. The origin's circuit is
+ *
+ *  - closed: requests go through. Once the window holds at least
+ *    `circuit-min-requests` requests and `circuit-error-rate` percent of them
+ *    failed, it opens;
+ *  - open: requests are refused at once, for `circuit-open-time` seconds,
+ *    rather than each one tying up a worker on a failing or slow origin.
+ *    Then it is half-open;
+ *  - half-open: at most `circuit-probes` requests at a time go through as
+ *    trials. One failing opens the circuit again; that many succeeding
+ *    close it, with a clean window.
+ *
+ * A `circuit-error-rate` of 0 turns this off.
+ *
+ * The time to the header of each answered request is also counted in a
+ * histogram of HEALTH_LATENCY_BUCKETS buckets, each half again as wide as the
+ * one before, halved whenever it holds HEALTH_LATENCY_SAMPLES, so that it
+ * follows what the origin does now. health_percentile reads it (for hedged
+ * requests, see hedge.c).
+ *
+ * Origins beyond HEALTH_MAX_ORIGINS are not tracked (their requests always
+ * go through).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "health.h"
+#include "origin.h"
+#include "error.h" // log_info
+
+#define HEALTH_BUCKETS 256       // a power of two
+#define HEALTH_MAX_ORIGINS 4096
+#define HEALTH_WINDOW 10         // seconds of history behind the error rate
+#define HEALTH_LATENCY_BUCKETS 40 // the last is everything from about two hours on
+#define HEALTH_LATENCY_SAMPLES 1024
+#define HEALTH_LATENCY_MIN_SAMPLES 20 // fewer say nothing about percentiles
+
+enum { CIRCUIT_CLOSED, CIRCUIT_OPEN, CIRCUIT_HALF_OPEN };
+
+typedef struct {
+    time_t second;               // which second (see now) these counts are for
+    unsigned requests, errors;
+    unsigned long latency_ms;    // summed over requests
+} health_bucket_t;
+
+typedef struct {
+    origin_entry_t entry;        // its `host:port` key
+    int state;                   // CIRCUIT_*
+    time_t opened;               // when it last opened
+    int probes;                  // half-open trials in flight
+    int passed;                  // half-open trials that succeeded
+    health_bucket_t window[HEALTH_WINDOW];
+    unsigned latency[HEALTH_LATENCY_BUCKETS]; // answered requests by time to the header
+    unsigned latency_samples;
+} health_origin_t;
+
+static origin_entry_t *health_buckets[HEALTH_BUCKETS];
+
+static struct {
+    origin_table_t origins;
+    int error_rate, min_requests, open_time, probes, slow_ms;
+    pthread_mutex_t lock;
+} health = { { health_buckets, HEALTH_BUCKETS, 0, HEALTH_MAX_ORIGINS }, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* seconds on the monotonic clock (not set back or forward with the date). */
+static time_t now ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec;
+}
+
+static long now_ms ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void health_configure ( int error_rate, int min_requests, int open_time, int probes, int slow_ms )
+{
+    pthread_mutex_lock ( &health.lock );
+    health.error_rate = error_rate;
+    health.min_requests = min_requests > 0 ? min_requests : 1;
+    health.open_time = open_time;
+    health.probes = probes > 0 ? probes : 1;
+    health.slow_ms = slow_ms;
+    pthread_mutex_unlock ( &health.lock );
+}
+
+void health_cleanup ( void )
+{
+    pthread_mutex_lock ( &health.lock );
+    origin_clear ( &health.origins );
+    pthread_mutex_unlock ( &health.lock );
+}
+
+/* the state of hostname:port, made if it is new and there is room (caller holds the lock). */
+static health_origin_t *origin ( const char *hostname, const char *port )
+{
+    int made;
+    return origin_get ( &health.origins, hostname, port, sizeof(health_origin_t), &made );
+}
+
+/* the upper bound, in milliseconds, of latency histogram bucket b. */
+static long latency_bound ( int b )
+{
+    long bound = 1;
+    while ( b-- > 0 ) { bound = bound * 3 / 2 + 1; }
+    return bound;
+}
+
+static void latency_count ( health_origin_t *o, long ms )
+{
+    int b = 0;
+    for ( long bound = 1; ms >= bound && b < HEALTH_LATENCY_BUCKETS - 1; bound = bound * 3 / 2 + 1 ) { b++; }
+    o->latency[b]++;
+    if ( ++o->latency_samples >= HEALTH_LATENCY_SAMPLES ) {
+        o->latency_samples = 0;
+        for ( int i = 0; i < HEALTH_LATENCY_BUCKETS; i++ ) {
+            o->latency[i] /= 2;
+            o->latency_samples += o->latency[i];
+        }
+    }
+}
+
+/* the time to the header (in milliseconds) that pct percent of recent answers
+   from hostname:port came within, or -1 if there are too few to tell. */
+long health_percentile ( const char *hostname, const char *port, int pct )
+{
+    long ms = -1;
+    pthread_mutex_lock ( &health.lock );
+    health_origin_t *o = origin ( hostname, port );
+    if ( o && o->latency_samples >= HEALTH_LATENCY_MIN_SAMPLES ) {
+        const unsigned long want = ( (unsigned long)o->latency_samples * pct + 99 ) / 100;
+        unsigned long seen = 0;
+        int b = 0;
+        while ( b < HEALTH_LATENCY_BUCKETS - 1 && ( seen += o->latency[b] ) < want ) { b++; }
+        ms = latency_bound ( b );
+    }
+    pthread_mutex_unlock ( &health.lock );
+    return ms;
+}
+
+/* may a request go to hostname:port now? HEALTH_ALLOW, HEALTH_PROBE (a
+   half-open trial), or HEALTH_REJECT. Unless rejected, the outcome must be
+   given to health_report (or health_cancel) with the same ticket. */
+int health_acquire ( const char *hostname, const char *port, health_ticket_t *ticket )
+{
+    ticket->admitted = HEALTH_ALLOW;
+    ticket->started = now_ms();
+
+    pthread_mutex_lock ( &health.lock );
+    health_origin_t *o = health.error_rate > 0 ? origin ( hostname, port ) : NULL;
+    if ( o && o->state == CIRCUIT_OPEN && now() - o->opened >= health.open_time ) {
+        o->state = CIRCUIT_HALF_OPEN;
+        o->probes = o->passed = 0;
+    }
+    if ( o && o->state == CIRCUIT_OPEN ) { ticket->admitted = HEALTH_REJECT; }
+    if ( o && o->state == CIRCUIT_HALF_OPEN ) {
+        ticket->admitted = o->probes < health.probes ? HEALTH_PROBE : HEALTH_REJECT;
+        if ( ticket->admitted == HEALTH_PROBE ) { o->probes++; }
+    }
+    pthread_mutex_unlock ( &health.lock );
+    return ticket->admitted;
+}
+
+/* a request admitted by health_acquire was not made after all (or failed
+   for reasons that say nothing of the origin): its ticket is given back
+   uncounted. */
+void health_cancel ( const char *hostname, const char *port, const health_ticket_t *ticket )
+{
+    if ( ticket->admitted != HEALTH_PROBE ) { return; }
+    pthread_mutex_lock ( &health.lock );
+    health_origin_t *o = origin ( hostname, port );
+    if ( o && o->probes > 0 ) { o->probes--; }
+    pthread_mutex_unlock ( &health.lock );
+}
+
+static void circuit_open ( health_origin_t *o, const char *why )
+{
+    o->state = CIRCUIT_OPEN;
+    o->opened = now();
+    log_info ( "\033[31mcircuit open:\033[0m %s (%s). refusing requests for %ds.\n", o->entry.key, why, health.open_time );
+}
+
+/* the outcome of a request admitted by health_acquire: ok, or an error. */
+void health_report ( const char *hostname, const char *port, const health_ticket_t *ticket, int ok )
+{
+    if ( ticket->admitted == HEALTH_REJECT ) { return; }
+    const long latency = now_ms() - ticket->started;
+
+    pthread_mutex_lock ( &health.lock );
+    health_origin_t *o = origin ( hostname, port );
+    if ( o == NULL ) {
+        pthread_mutex_unlock ( &health.lock );
+        return;
+    }
+    if ( ok ) { latency_count ( o, latency ); }
+    if ( ok && health.slow_ms > 0 && latency > health.slow_ms ) { ok = 0; }
+
+    /* count it in this second's bucket (clearing what it held HEALTH_WINDOW seconds ago). */
+    const time_t t = now();
+    health_bucket_t *b = &o->window[t % HEALTH_WINDOW];
+    if ( b->second != t ) { memset ( b, 0, sizeof(*b) ); b->second = t; }
+    b->requests++;
+    b->errors += ! ok;
+    b->latency_ms += latency;
+
+    if ( ticket->admitted == HEALTH_PROBE ) {
+        o->probes--;
+        if ( o->state != CIRCUIT_HALF_OPEN ) {
+            /* another trial already decided. */
+        } else if ( ! ok ) {
+            circuit_open ( o, "trial request failed" );
+        } else if ( ++o->passed >= health.probes ) {
+            o->state = CIRCUIT_CLOSED;
+            memset ( o->window, 0, sizeof(o->window) );
+            log_info ( "\033[32mcircuit closed:\033[0m %s recovered.\n", o->entry.key );
+        }
+    } else if ( health.error_rate > 0 && o->state == CIRCUIT_CLOSED && ! ok ) {
+        unsigned requests = 0, errors = 0;
+        unsigned long latency_ms = 0;
+        for ( int i = 0; i < HEALTH_WINDOW; i++ ) {
+            if ( t - o->window[i].second >= HEALTH_WINDOW ) { continue; }
+            requests += o->window[i].requests;
+            errors += o->window[i].errors;
+            latency_ms += o->window[i].latency_ms;
+        }
+        if ( requests >= (unsigned)health.min_requests &&
+             errors * 100 >= (unsigned)health.error_rate * requests ) {
+            char why[96];
+            snprintf ( why, sizeof(why), "%u of %u requests failed, %lums on average",
+                       errors, requests, latency_ms / requests );
+            circuit_open ( o, why );
+        }
+    }
+    pthread_mutex_unlock ( &health.lock );
+}
@@ -0,0 +1,22 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+/* Per-origin health: rolling error and latency counts and a circuit breaker
+   (closed, open, half-open) for each `host:port`; see health.c. */
+
+enum { HEALTH_REJECT, HEALTH_ALLOW, HEALTH_PROBE };
+
+/* One request to an origin, from health_acquire to health_report. */
+typedef struct {
+    int admitted;   // HEALTH_*
+    long started;   // CLOCK_MONOTONIC milliseconds
+} health_ticket_t;
+
+void health_configure ( int error_rate, int min_requests, int open_time, int probes, int slow_ms );
+void health_cleanup ( void );
+int  health_acquire ( const char *hostname, const char *port, health_ticket_t *ticket );
+void health_report ( const char *hostname, const char *port, const health_ticket_t *ticket, int ok );
+void health_cancel ( const char *hostname, const char *port, const health_ticket_t *ticket );
+long health_percentile ( const char *hostname, const char *port, int pct );
+
+#endif/*HEALTH_H*/
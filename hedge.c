@@ -0,0 +1,63 @@
+/**
+ * Hedged origin requests, to cut the tail latency of cache misses.
+ *
+ * A GET miss that has had no answer from its origin after `hedge-percentile`
+ * of that origin's recent answers came (see health_percentile), and at least
+ * `hedge-min-delay` milliseconds, is sent again on a second connection,
+ * preferably to another of the origin's addresses. Whichever connection
+ * answers first is kept; the other is closed.
+ *
+ * Hedges are budgeted: each miss that could be hedged earns `hedge-budget`
+ * percent of a hedge, up to HEDGE_BURST, and each hedge spends a whole one.
+ * So they add at most that share of requests to the origins, however slow.
+ * A budget of 0 turns hedging off.
+ */
+
+#include <pthread.h>
+
+#include "hedge.h"
+#include "health.h"
+
+#define HEDGE_BURST 10           // hedges that may be saved up
+
+static struct {
+    int percentile, budget, min_delay;
+    long credit;                 // in hundredths of a hedge
+    pthread_mutex_t lock;
+} hedge = { 95, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+void hedge_configure ( int percentile, int budget, int min_delay )
+{
+    pthread_mutex_lock ( &hedge.lock );
+    hedge.percentile = percentile > 0 && percentile <= 100 ? percentile : 95;
+    hedge.budget = budget;
+    hedge.min_delay = min_delay;
+    pthread_mutex_unlock ( &hedge.lock );
+}
+
+/* how long (milliseconds) to wait for hostname:port to answer a GET before
+   hedging it, or -1 for not at all (off, or too little known about the origin).
+   Called once per miss: it also earns the budget its share. */
+long hedge_delay ( const char *hostname, const char *port )
+{
+    pthread_mutex_lock ( &hedge.lock );
+    const int budget = hedge.budget, percentile = hedge.percentile, min_delay = hedge.min_delay;
+    hedge.credit += budget;
+    if ( hedge.credit > HEDGE_BURST * 100 ) { hedge.credit = HEDGE_BURST * 100; }
+    pthread_mutex_unlock ( &hedge.lock );
+    if ( budget <= 0 ) { return -1; }
+
+    long delay = health_percentile ( hostname, port, percentile );
+    if ( delay < 0 ) { return -1; }
+    return delay < min_delay ? min_delay : delay;
+}
+
+/* spend a hedge from the budget, if there is one. */
+int hedge_take ( void )
+{
+    pthread_mutex_lock ( &hedge.lock );
+    const int ok = hedge.credit >= 100;
+    if ( ok ) { hedge.credit -= 100; }
+    pthread_mutex_unlock ( &hedge.lock );
+    return ok;
+}
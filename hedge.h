@@ -0,0 +1,11 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+/* Hedged origin requests: a GET miss whose origin is slow to answer is sent
+   again on a second connection, within a budget; see hedge.c. */
+
+void hedge_configure ( int percentile, int budget, int min_delay );
+long hedge_delay ( const char *hostname, const char *port );
+int  hedge_take ( void );
+
+#endif/*HEDGE_H*/
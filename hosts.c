@@ -0,0 +1,242 @@
+/**
+ * Pinned host addresses.
+ *
+ * A hosts file (`hosts-file`), in the format of /etc/hosts:
+ *
+ *     <address> <host> [<host> ...]
+ *
+ * with `#` comments, gives internal origins fixed addresses (IPv4 or IPv6;
+ * up to HOSTS_MAX_ADDRS per host, tried in the order listed). Their names
+ * are never resolved: a connection to one takes its candidate addresses
+ * from this table, built into storage on the caller's stack, instead of
+ * from getaddrinfo.
+ *
+ * The file is compiled into an open-addressing hash table that is never
+ * changed once built. Reloading builds a new one and publishes it with an
+ * atomic store, so lookups take no lock. A replaced table is kept (they are
+ * small, and reloads rare) until hosts_cleanup, since a lookup may still be
+ * reading it.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "hosts.h"
+#include "hash.h"
+
+#define HOSTS_LINE_MAX 4096
+#define HOSTS_NAME_MAX 256
+
+typedef struct {
+    char *host;                  // lowercase
+    uint64_t hash;
+    int n_addrs;
+    struct sockaddr_storage addr[HOSTS_MAX_ADDRS]; // port 0
+    socklen_t addr_len[HOSTS_MAX_ADDRS];
+} hosts_entry_t;
+
+typedef struct hosts_table {
+    hosts_entry_t **slots;       // open addressing, at most half full
+    size_t mask;
+    hosts_entry_t **entries;     // in the order first listed
+    size_t n_entries;
+    struct hosts_table *retired_next;
+} hosts_table_t;
+
+static struct {
+    hosts_table_t *current;      // read without the lock (atomic)
+    hosts_table_t *retired;      // replaced tables, freed by hosts_cleanup
+    pthread_mutex_t lock;        // serializes loads
+} hosts = { NULL, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+static void table_free ( hosts_table_t *table )
+{
+    for ( size_t i = 0; i < table->n_entries; i++ ) {
+        free ( table->entries[i]->host );
+        free ( table->entries[i] );
+    }
+    free ( table->entries );
+    free ( table->slots );
+    free ( table );
+}
+
+/* the lowercase copy of host (at most HOSTS_NAME_MAX bytes), or -1. */
+static int lower ( const char *host, char *out )
+{
+    size_t n = 0;
+    for ( ; host[n]; n++ ) {
+        if ( n == HOSTS_NAME_MAX - 1 ) { return -1; }
+        out[n] = tolower ( (unsigned char)host[n] );
+    }
+    out[n] = '\0';
+    return (int)n;
+}
+
+/* the slot of host in table: its entry's, or the empty one it would go in. */
+static hosts_entry_t **slot ( const hosts_table_t *table, const char *host, uint64_t hash )
+{
+    for ( size_t i = hash & table->mask; ; i = ( i + 1 ) & table->mask ) {
+        hosts_entry_t **s = &table->slots[i];
+        if ( *s == NULL || ( ( *s )->hash == hash && strcmp ( ( *s )->host, host ) == 0 ) ) { return s; }
+    }
+}
+
+/* add the address to host's entry (while building: entries only). */
+static int add ( hosts_table_t *table, const char *name, const struct sockaddr_storage *addr, socklen_t len )
+{
+    char host[HOSTS_NAME_MAX];
+    if ( lower ( name, host ) <= 0 ) { return -1; }
+    hosts_entry_t *entry = NULL;
+    for ( size_t i = 0; i < table->n_entries && entry == NULL; i++ ) {
+        if ( strcmp ( table->entries[i]->host, host ) == 0 ) { entry = table->entries[i]; }
+    }
+    if ( entry == NULL ) {
+        hosts_entry_t **entries = realloc ( table->entries, ( table->n_entries + 1 ) * sizeof(*entries) );
+        if ( entries == NULL ) { return -1; }
+        table->entries = entries;
+        if ( ( entry = calloc ( 1, sizeof(*entry) ) ) == NULL ) { return -1; }
+        if ( ( entry->host = strdup ( host ) ) == NULL ) {
+            free ( entry );
+            return -1;
+        }
+        entry->hash = hash64 ( host, strlen ( host ), 0 );
+        table->entries[table->n_entries++] = entry;
+    }
+    if ( entry->n_addrs == HOSTS_MAX_ADDRS ) { return 0; } // more are ignored
+    entry->addr[entry->n_addrs] = *addr;
+    entry->addr_len[entry->n_addrs++] = len;
+    return 0;
+}
+
+/* one line: an address, and the hosts it is pinned for. */
+static int parse_line ( hosts_table_t *table, char *line )
+{
+    char *save, *address = strtok_r ( line, " \t\r\n", &save );
+    if ( address == NULL ) { return 0; }
+
+    struct sockaddr_storage addr;
+    socklen_t len;
+    memset ( &addr, 0, sizeof(addr) );
+    struct sockaddr_in *v4 = (struct sockaddr_in *)&addr;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)&addr;
+    if ( inet_pton ( AF_INET, address, &v4->sin_addr ) == 1 ) {
+        v4->sin_family = AF_INET;
+        len = sizeof(*v4);
+    } else if ( inet_pton ( AF_INET6, address, &v6->sin6_addr ) == 1 ) {
+        v6->sin6_family = AF_INET6;
+        len = sizeof(*v6);
+    } else {
+        return -1;
+    }
+
+    int hosts_on_line = 0;
+    for ( char *name; ( name = strtok_r ( NULL, " \t\r\n", &save ) ) != NULL; hosts_on_line++ ) {
+        if ( add ( table, name, &addr, len ) < 0 ) { return -1; }
+    }
+    return hosts_on_line > 0 ? 0 : -1;
+}
+
+/* index the entries (once all are in). */
+static int build_index ( hosts_table_t *table )
+{
+    size_t size = 16;
+    while ( size < 2 * table->n_entries ) { size *= 2; }
+    if ( ( table->slots = calloc ( size, sizeof(*table->slots) ) ) == NULL ) { return -1; }
+    table->mask = size - 1;
+    for ( size_t i = 0; i < table->n_entries; i++ ) {
+        *slot ( table, table->entries[i]->host, table->entries[i]->hash ) = table->entries[i];
+    }
+    return 0;
+}
+
+/* (re)load the hosts file at path, replacing the current table. "" unpins
+   every host. returns 0, or -1 (the current table is kept). */
+int hosts_load ( const char *path )
+{
+    hosts_table_t *table = NULL;
+    if ( path[0] ) {
+        FILE *f = fopen ( path, "r" );
+        if ( f == NULL ) {
+            fprintf ( stderr, "\033[31mfailure:\033[0m open hosts file %s.\n", path );
+            return -1;
+        }
+        table = calloc ( 1, sizeof(*table) );
+        char line[HOSTS_LINE_MAX];
+        int lineno = 0, ok = table != NULL;
+        while ( ok && fgets ( line, sizeof(line), f ) ) {
+            lineno++;
+            char *hash = strchr ( line, '#' );
+            if ( hash ) { *hash = '\0'; }
+            ok = parse_line ( table, line ) == 0;
+            if ( ! ok ) { fprintf ( stderr, "\033[31mfailure:\033[0m %s:%d: bad host entry.\n", path, lineno ); }
+        }
+        fclose ( f );
+        if ( ok ) { ok = build_index ( table ) == 0; }
+        if ( ! ok ) {
+            if ( table ) { table_free ( table ); }
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock ( &hosts.lock );
+    hosts_table_t *old = hosts.current;
+    __atomic_store_n ( &hosts.current, table, __ATOMIC_RELEASE );
+    if ( old ) {
+        old->retired_next = hosts.retired;
+        hosts.retired = old;
+    }
+    pthread_mutex_unlock ( &hosts.lock );
+    return 0;
+}
+
+/* free every table (no lookups may be running). */
+void hosts_cleanup ( void )
+{
+    hosts_load ( "" );
+    pthread_mutex_lock ( &hosts.lock );
+    while ( hosts.retired ) {
+        hosts_table_t *next = hosts.retired->retired_next;
+        table_free ( hosts.retired );
+        hosts.retired = next;
+    }
+    pthread_mutex_unlock ( &hosts.lock );
+}
+
+/* the candidate addresses of host, if it is pinned, at port (numeric):
+   a list built in out. NULL if it is not pinned (or port is not a number). */
+struct addrinfo *hosts_lookup ( const char *host, const char *port, hosts_candidates_t *out )
+{
+    const hosts_table_t *table = __atomic_load_n ( &hosts.current, __ATOMIC_ACQUIRE );
+    if ( table == NULL ) { return NULL; }
+
+    char name[HOSTS_NAME_MAX];
+    const int n = lower ( host, name );
+    if ( n <= 0 ) { return NULL; }
+    const hosts_entry_t *entry = *slot ( table, name, hash64 ( name, (size_t)n, 0 ) );
+    if ( entry == NULL ) { return NULL; }
+
+    char *end;
+    const long p = strtol ( port, &end, 10 );
+    if ( *port == '\0' || *end != '\0' || p < 0 || p > 65535 ) { return NULL; }
+
+    for ( int i = 0; i < entry->n_addrs; i++ ) {
+        struct addrinfo *ai = &out->ai[i];
+        memcpy ( &out->addr[i], &entry->addr[i], entry->addr_len[i] );
+        if ( out->addr[i].ss_family == AF_INET ) { ( (struct sockaddr_in *)&out->addr[i] )->sin_port = htons ( (uint16_t)p ); }
+        else { ( (struct sockaddr_in6 *)&out->addr[i] )->sin6_port = htons ( (uint16_t)p ); }
+        memset ( ai, 0, sizeof(*ai) );
+        ai->ai_family = out->addr[i].ss_family;
+        ai->ai_socktype = SOCK_STREAM;
+        ai->ai_protocol = IPPROTO_TCP;
+        ai->ai_addr = (struct sockaddr *)&out->addr[i];
+        ai->ai_addrlen = entry->addr_len[i];
+        ai->ai_next = i + 1 < entry->n_addrs ? &out->ai[i + 1] : NULL;
+    }
+    return &out->ai[0];
+}
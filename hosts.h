@@ -0,0 +1,22 @@
+#ifndef HOSTS_H
+#define HOSTS_H
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* Pinned host addresses, looked up before DNS; see hosts.c. */
+
+#define HOSTS_MAX_ADDRS 8        // addresses kept per host
+
+/* Room for the candidate addresses of a pinned host, built by hosts_lookup
+   (on the caller's stack: no allocation, nothing to free). */
+typedef struct hosts_candidates {
+    struct addrinfo ai[HOSTS_MAX_ADDRS];
+    struct sockaddr_storage addr[HOSTS_MAX_ADDRS];
+} hosts_candidates_t;
+
+int  hosts_load ( const char *path );
+void hosts_cleanup ( void );
+struct addrinfo *hosts_lookup ( const char *host, const char *port, hosts_candidates_t *out );
+
+#endif/*HOSTS_H*/
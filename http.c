@@ -1,100 +1,244 @@
+#define _GNU_SOURCE // memmem, strcasestr, strptime, timegm
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"  // http-related things for ^
+#include "io.h"
+#include "error.h"
+
+/* HTTP-related helper functions. You are not expected to know HTTP in
+   detail, and you are not expected to modify this! However, you are
+   expected to understand what is going on here.*/
+
 /* String constants */
 static const char *REQUEST_LINE_FMT =
-    "GET %s HTTP/1.0\r\n";
+    "%s %s HTTP/1.0\r\n";
 static const char *USER_AGENT_FLD =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *HOST_FLD_FMT =
-    "Host: %s：%s\r\n";
+    "Host: %s:%s\r\n";
 static const char *CONNECTION_FLD =
     "Connection: close\r\n";
 static const char *PROXY_CONNECTION_FLD =
     "Proxy-Connection: close\r\n";
+static const char *KEEP_ALIVE_FLD =
+    "Connection: keep-alive\r\n";
+static const char *PROXY_KEEP_ALIVE_FLD =
+    "Proxy-Connection: keep-alive\r\n";
 static const char *BLANK_LINE =
     "\r\n";
 
-#include <string.h>
-#include <stdio.h>
+#define MAX_RANGES 16 // more ranges than this in one request: serve the whole object
+#define BOUNDARY "PROXY_BYTERANGES_BOUNDARY"
 
-#include "http.h"  // http-related things for ^
-#include "io.h"
-#include "error.h"
+/* does `line` start with header field `name` (followed by a colon)? */
+static int field_is ( const char *line, const char *name )
+{
+    size_t n = strlen(name);
+    return strncasecmp ( line, name, n ) == 0 && line[n] == ':';
+}
 
-/* HTTP-related helper functions. You are not expected to know HTTP in
-   detail, and you are not expected to modify this! However, you are
-   expected to understand what is going on here.*/
+/* append n bytes of src to dst (of capacity cap, holding *len bytes). */
+static int append ( char *dst, size_t *len, size_t cap, const char *src, size_t n )
+{
+    if ( *len + n + 1 > cap ) { return 0; }
+    memcpy ( dst + *len, src, n );
+    *len += n;
+    dst[*len] = '\0';
+    return 1;
+}
 
-/* compile a request header from fields provided by the client, as well as 
- * hostname, path and port. write the resulting header to request_hdr. */
-int set_request_header ( char* request_hdr, char* hostname, char* path, char* port, int client_fd )
+/* read a request line and the header fields after it (up to the blank line). */
+int read_request ( int fd, http_request_t *req )
+{
+    char line[MAX_LINE + 1];
+    int return_cd;
+
+    /* read HTTP Request-line */
+    return_cd = read_line ( fd, line );
+    if ( error_read ( return_cd ) ) { return 0; }
+    line[return_cd] = '\0';
+    if ( sscanf ( line, "%31s %8191s %31s", req->method, req->uri, req->version ) != 3 ) { return 0; }
+
+    /* read header fields. */
+    req->fields_len = 0;
+    req->fields[0] = '\0';
+    while ( 1 ) {
+	return_cd = read_line ( fd, line );
+	if ( error_read ( return_cd ) ) { return 0; }
+	line[return_cd] = '\0';
+	if ( strcmp ( line, BLANK_LINE ) == 0 || strcmp ( line, "\n" ) == 0 ) { return 1; }
+	if ( ! append ( req->fields, &req->fields_len, sizeof(req->fields), line, return_cd ) ) { return 0; }
+    }
+}
+
+/* the request header for `target` (a path, or an absolute URI); see below. */
+static int compile_request_header ( char* request_hdr, size_t hdr_size, http_request_t *req,
+                                    char* hostname, char* target, char* port, int strip_validators,
+                                    int keep_alive )
 {
     /* an HTTP request header consists of a request line, followed by header fields.
        each header field is a key-value pair of the form `k: v\r\n`. */
     char request_line[MAX_LINE];// request line (first line of a request header)
     char host_fld[MAX_LINE];    // host field
-    char other_flds[MAX_LINE];  // other fields
-    
-    char line[MAX_LINE];        // a buffer for storing lines read from client_fd
-    int return_cd;              // return code for reads from client_fd
-    
-    /* Proxy sets request line (We only handle GET requests, in HTTP/1.0.) */
-    sprintf(request_line, REQUEST_LINE_FMT, path);
+    size_t len = 0;             // length of request_hdr so far
+
+    /* Proxy sets request line (in HTTP/1.0.) */
+    snprintf(request_line, sizeof(request_line), REQUEST_LINE_FMT, req->method, target);
 
     /* Proxy sets `User-Agent`, `Connection`, and `Proxy-Connection` fields;
-       see proxy.h for their values. */
-    
+       see http.h for their values. */
+
     /* Default host field, in case client request does not contain one. */
-    sprintf(host_fld, HOST_FLD_FMT, hostname, port);
-
-    /* Get any other fields from client_fd */
-    return_cd = 1;
-    while ( return_cd > 0 )
-    {
-	/* read the next line. */
-	return_cd = read_line ( client_fd, line );
-	if ( error_read ( return_cd ) ) { return 0; /*error*/ }
-
-	/* null-terminate the string read from client_fd.
-	   NOTE: by doing this, we are ignoring an edge case where
-	   the line read has length MAX_LEN */
-	line[return_cd] = '\0';
-	
-	/* if we reached end-of-client-request, then stop reading from client_fd. */
-        if ( strncasecmp ( line, BLANK_LINE, strlen(BLANK_LINE) ) == 0  ) break;
-
-	/* if client provided a host field, then we use client's host field. */
-        if ( strncasecmp ( line, "Host:", strlen("Host:") ) == 0 )
-	{
-            strcpy ( host_fld, line );
-            continue;
+    snprintf(host_fld, sizeof(host_fld), HOST_FLD_FMT, hostname, port);
+
+    /* if client provided a host field, then we use client's host field. */
+    for ( char *line = req->fields; *line; line = strchr ( line, '\n' ) + 1 ) {
+        if ( field_is ( line, "Host" ) ) {
+            size_t n = strchr ( line, '\n' ) - line + 1;
+            if ( n < sizeof(host_fld) ) { memcpy ( host_fld, line, n ); host_fld[n] = '\0'; }
         }
+    }
+
+    request_hdr[0] = '\0';
+    if ( ! append ( request_hdr, &len, hdr_size, request_line, strlen(request_line) ) ||
+         ! append ( request_hdr, &len, hdr_size, host_fld, strlen(host_fld) ) ||
+         ! append ( request_hdr, &len, hdr_size, USER_AGENT_FLD, strlen(USER_AGENT_FLD) ) ) {
+        return 0;
+    }
 
-	/* if client provides `User-Agent`, `Connection`, and `Proxy-Connection` 
+    for ( char *line = req->fields; *line; line = strchr ( line, '\n' ) + 1 ) {
+	/* if client provides `Host`, `User-Agent`, `Connection`, and `Proxy-Connection`
 	   fields, then we ignore them. (we use our own hard-coded such fields). */
-        if( strncasecmp ( line, "User-Agent:", strlen("User-Agent:") ) == 0 ||
-	    strncasecmp ( line, "Connection:", strlen("Connection:") ) == 0 ||
-	    strncasecmp ( line, "Proxy-Connection:", strlen("Proxy-Connection:") ) == 0 )
-	{
-	    continue;
+        if ( field_is ( line, "Host" ) || field_is ( line, "User-Agent" ) ||
+             field_is ( line, "Connection" ) || field_is ( line, "Proxy-Connection" ) ) {
+            continue;
+        }
+        /* an HTTP/1.0 origin would never answer `100 Continue`; we answer it
+           ourselves (see `http_relay_body`). */
+        if ( field_is ( line, "Expect" ) ) {
+            continue;
+        }
+        if ( strip_validators &&
+             ( field_is ( line, "Range" ) || field_is ( line, "If-Range" ) ||
+               field_is ( line, "If-None-Match" ) || field_is ( line, "If-Modified-Since" ) ) ) {
+            continue;
         }
-
 	/* otherwise, this field is a keeper. */
-	strcat( other_flds, line );
+        if ( ! append ( request_hdr, &len, hdr_size, line, strchr ( line, '\n' ) - line + 1 ) ) { return 0; }
     }
-    
+
     /* set the request header. */
-    request_hdr[0] = '\0';
-    strcat ( request_hdr, request_line );
-    strcat ( request_hdr, host_fld );
-    strcat ( request_hdr, USER_AGENT_FLD );
-    strcat ( request_hdr, other_flds );
-    strcat ( request_hdr, CONNECTION_FLD );
-    strcat ( request_hdr, PROXY_CONNECTION_FLD );
-    strcat ( request_hdr, BLANK_LINE );
+    const char *connection = keep_alive ? KEEP_ALIVE_FLD : CONNECTION_FLD;
+    const char *proxy_connection = keep_alive ? PROXY_KEEP_ALIVE_FLD : PROXY_CONNECTION_FLD;
+    if ( ! append ( request_hdr, &len, hdr_size, connection, strlen(connection) ) ||
+         ! append ( request_hdr, &len, hdr_size, proxy_connection, strlen(proxy_connection) ) ||
+         ! append ( request_hdr, &len, hdr_size, BLANK_LINE, strlen(BLANK_LINE) ) ) {
+        return 0;
+    }
 
     /* success. */
     return 1;
 }
 
+/* compile a request header from fields provided by the client, as well as
+ * hostname, path and port. write the resulting header to request_hdr.
+ * strip_validators: drop Range and conditional fields (we fetch the whole
+ * object for the cache, and answer those from it). */
+int set_request_header ( char* request_hdr, size_t hdr_size, http_request_t *req,
+                         char* hostname, char* path, char* port, int strip_validators )
+{
+    return compile_request_header ( request_hdr, hdr_size, req, hostname, path, port, strip_validators, 0 );
+}
+
+/* the same, for a parent proxy: the request line has the absolute URI, and
+ * keep_alive asks it to keep the connection open after its answer. */
+int set_parent_request_header ( char* request_hdr, size_t hdr_size, http_request_t *req,
+                                char* hostname, char* path, char* port, int strip_validators, int keep_alive )
+{
+    char uri[MAX_LINE];
+    const char *fmt = strchr ( hostname, ':' ) ? "http://[%s]:%s%s" : "http://%s:%s%s";
+    if ( snprintf ( uri, sizeof(uri), fmt, hostname, port, path ) >= (int)sizeof(uri) ) { return 0; }
+    return compile_request_header ( request_hdr, hdr_size, req, hostname, uri, port, strip_validators, keep_alive );
+}
+
+/* relay one line (a chunk-size line, CRLF or trailer field) from in_fd to out_fd.
+   returns its length, 0 if it cannot be read, or -1 if it cannot be written. */
+static int relay_line ( int in_fd, int out_fd, char *line )
+{
+    int n = read_line ( in_fd, line );
+    if ( n <= 0 ) { return 0; }
+    if ( write_all ( out_fd, line, n ) < 0 ) { return -1; }
+    line[n] = '\0';
+    return n;
+}
+
+/* forward the body of request `req` (whose header has been read from
+   client_fd) to server_fd, as it arrives: `Content-Length` bytes, or chunks
+   up to the last one (framing passed on as is). the body is never held in
+   memory; its bytes are spliced from socket to socket.
+   returns 1 on success (or if there is no body), 0 on a failure on the
+   client's side (it went away, or sent a malformed body), or -1 if the body
+   could not be written to server_fd. */
+int http_relay_body ( int client_fd, int server_fd, http_request_t *req )
+{
+    char value[MAX_LINE];
+    char line[MAX_LINE + 1];
+    int pipe_fds[2];
+    int chunked = http_get_field ( req->fields, req->fields_len, "Transfer-Encoding", value, sizeof(value) ) &&
+                  strcasestr ( value, "chunked" ) != NULL;
+    size_t length = 0;
+    if ( ! chunked ) {
+        if ( ! http_get_field ( req->fields, req->fields_len, "Content-Length", value, sizeof(value) ) ) { return 1; }
+        length = strtoull ( value, NULL, 10 );
+        if ( length == 0 ) { return 1; }
+    }
+
+    /* the client holds the body back until told to go ahead. */
+    if ( http_get_field ( req->fields, req->fields_len, "Expect", value, sizeof(value) ) &&
+         strcasecmp ( value, "100-continue" ) == 0 ) {
+        static const char *CONTINUE = "HTTP/1.1 100 Continue\r\n\r\n";
+        if ( write_all ( client_fd, (char *)CONTINUE, strlen(CONTINUE) ) < 0 ) { return 0; }
+    }
+
+    if ( pipe ( pipe_fds ) < 0 ) { return 0; }
+    /* splice_all's -1 is the client's side, -2 the server's. */
+    int ok = 1, n;
+    if ( ! chunked ) {
+        n = splice_all ( client_fd, server_fd, pipe_fds, length );
+        ok = n >= 0 ? 1 : n == -2 ? -1 : 0;
+    }
+    while ( chunked && ok == 1 ) {
+        /* chunk-size [; extensions] CRLF, chunk data, CRLF. */
+        char *end;
+        if ( ( n = relay_line ( client_fd, server_fd, line ) ) <= 0 ) { ok = n; break; }
+        size_t size = strtoull ( line, &end, 16 );
+        if ( end == line ) { ok = 0; break; }
+        if ( size == 0 ) {
+            /* last chunk: trailer fields, up to the blank line. */
+            while ( ( n = relay_line ( client_fd, server_fd, line ) ) > 0 &&
+                    strcmp ( line, BLANK_LINE ) != 0 && strcmp ( line, "\n" ) != 0 ) { }
+            ok = n > 0 ? 1 : n;
+            break;
+        }
+        if ( ( n = splice_all ( client_fd, server_fd, pipe_fds, size ) ) < 0 ) { ok = n == -2 ? -1 : 0; break; }
+        n = relay_line ( client_fd, server_fd, line );
+        ok = n > 0 ? 1 : n;
+    }
+    close ( pipe_fds[0] );
+    close ( pipe_fds[1] );
+    if ( ok < 0 ) {
+        fprintf(stderr, "\033[31mfailure:\033[0m relaying request body to the server. dropping request.\n");
+    } else if ( ! ok ) {
+        fprintf(stderr, "\033[31mfailure:\033[0m relaying request body from the client. dropping request.\n");
+    }
+    return ok;
+}
+
 /* parse the uri into hostname, path, and port. */
 void parse_uri(char* uri, char* hostname, char* path, char* port)
 {
@@ -104,7 +248,8 @@ void parse_uri(char* uri, char* hostname, char* path, char* port)
 
     strcpy(buf, uri);
 
-    pstart = strstr(buf, "//") + 2;
+    pstart = strstr(buf, "//");
+    pstart = pstart ? pstart + 2 : buf;
     ppath = strchr(pstart, '/');
     if(!ppath){
         strcpy(path, "/");
@@ -113,13 +258,377 @@ void parse_uri(char* uri, char* hostname, char* path, char* port)
         *ppath = 0;
     }
 
+    /* no port, or an empty one (`host:`): the default. */
     pport = strchr(pstart, ':');
-    if ( ! pport ) {
-        strcpy(port, "80");
-        strcpy(hostname, pstart);
+    if ( pport ) { *pport = 0; }
+    strcpy(port, pport && pport[1] ? pport + 1 : "80");
+    strcpy(hostname, pstart);
+}
+
+/* find header field `name` among `len` bytes of header fields (a response
+   header's status line is skipped naturally), and copy its trimmed value. */
+int http_get_field ( const char *fields, size_t len, const char *name, char *value, size_t value_len )
+{
+    const char *end = fields + len;
+    size_t n = strlen(name);
+    for ( const char *line = fields; line < end; ) {
+        const char *eol = memchr ( line, '\n', end - line );
+        if ( eol == NULL ) { eol = end; }
+        if ( (size_t)(eol - line) > n && strncasecmp ( line, name, n ) == 0 && line[n] == ':' ) {
+            const char *v = line + n + 1;
+            const char *v_end = eol;
+            while ( v < v_end && ( *v == ' ' || *v == '\t' ) ) { v++; }
+            while ( v_end > v && ( v_end[-1] == '\r' || v_end[-1] == ' ' || v_end[-1] == '\t' ) ) { v_end--; }
+            if ( (size_t)(v_end - v) >= value_len ) { return 0; }
+            memcpy ( value, v, v_end - v );
+            value[v_end - v] = '\0';
+            return 1;
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/* does the request accept content coding `coding` (Accept-Encoding, RFC 9110
+   section 12.5.3)? it must be listed, or matched by `*`, with a q-value above 0. */
+int http_accepts_encoding ( const char *fields, size_t len, const char *coding )
+{
+    char value[MAX_LINE];
+    int star = 0;
+    if ( ! http_get_field ( fields, len, "Accept-Encoding", value, sizeof(value) ) ) { return 0; }
+
+    const size_t n = strlen(coding);
+    for ( char *p = value; *p; ) {
+        while ( *p == ' ' || *p == ',' ) { p++; }
+        char *end = p + strcspn ( p, "," );
+        char *name_end = p + strcspn ( p, " ;," );
+        double q = 1;
+        char *qp = strstr ( p, "q=" );
+        if ( qp && qp < end ) { q = atof ( qp + 2 ); }
+
+        if ( (size_t)( name_end - p ) == n && strncasecmp ( p, coding, n ) == 0 ) { return q > 0; }
+        if ( name_end - p == 1 && *p == '*' ) { star = q > 0; }
+        p = end;
+    }
+    return star;
+}
+
+/* length of the header (status line through blank line) of a stored response,
+   or 0 if it has none. */
+size_t http_header_length ( const char *data, size_t size )
+{
+    const char *blank = memmem ( data, size, "\r\n\r\n", 4 );
+    return blank ? (size_t)(blank - data) + 4 : 0;
+}
+
+/* drop the hop-by-hop fields (Connection, Keep-Alive, Proxy-Connection)
+   from the header (hlen bytes) of the response in data, which holds *len
+   bytes (room for cap), and say `Connection: close` instead (if it fits):
+   a parent keeps its connection to us open, but the client's is closed.
+   body bytes after the header move along. returns the new header length. */
+size_t http_strip_hop_fields ( char *data, size_t hlen, size_t *len, size_t cap )
+{
+    char *line = memchr ( data, '\n', hlen );
+    for ( line = line ? line + 1 : data + hlen; line < data + hlen - 2; ) {
+        char *eol = memchr ( line, '\n', data + hlen - line );
+        if ( eol == NULL ) { break; }
+        const size_t n = eol + 1 - line;
+        if ( field_is ( line, "Connection" ) || field_is ( line, "Keep-Alive" ) ||
+             field_is ( line, "Proxy-Connection" ) ) {
+            memmove ( line, eol + 1, data + *len - ( eol + 1 ) );
+            hlen -= n;
+            *len -= n;
+        } else {
+            line = eol + 1;
+        }
+    }
+    const size_t n = strlen ( CONNECTION_FLD );
+    if ( *len + n <= cap ) {
+        memmove ( data + hlen - 2 + n, data + hlen - 2, *len - ( hlen - 2 ) );
+        memcpy ( data + hlen - 2, CONNECTION_FLD, n );
+        hlen += n;
+        *len += n;
+    }
+    return hlen;
+}
+
+/* the status code of a stored response, or 0. */
+int http_response_status ( const char *data, size_t hlen )
+{
+    if ( hlen < 13 || strncmp ( data, "HTTP/", 5 ) != 0 ) { return 0; }
+    const char *sp = memchr ( data, ' ', hlen );
+    if ( sp == NULL || sp + 4 > data + hlen ) { return 0; }
+    return atoi ( sp + 1 );
+}
+
+/* an HTTP-date (RFC 9110 IMF-fixdate) as seconds since the epoch, or -1. */
+static time_t parse_http_date ( const char *s )
+{
+    struct tm tm;
+    memset ( &tm, 0, sizeof(tm) );
+    if ( strptime ( s, "%a, %d %b %Y %H:%M:%S GMT", &tm ) == NULL ) { return -1; }
+    return timegm ( &tm );
+}
+
+/* does entity-tag `etag` match one in the comma-separated `list`?
+   weak comparison (for If-None-Match): a W/ prefix is ignored. */
+static int etag_matches ( const char *list, const char *etag )
+{
+    if ( strncmp ( etag, "W/", 2 ) == 0 ) { etag += 2; }
+    size_t n = strlen(etag);
+    for ( const char *p = list; *p; ) {
+        while ( *p == ' ' || *p == ',' ) { p++; }
+        if ( *p == '*' ) { return 1; }
+        if ( strncmp ( p, "W/", 2 ) == 0 ) { p += 2; }
+        if ( strncmp ( p, etag, n ) == 0 && ( p[n] == '\0' || p[n] == ',' || p[n] == ' ' ) ) { return 1; }
+        while ( *p && *p != ',' ) { p++; }
+    }
+    return 0;
+}
+
+/* copy the header fields (not the status line) of a stored response into
+   dst, leaving out the fields named in `drop` (NULL-terminated). */
+static int copy_fields ( char *dst, size_t *len, size_t cap, const char *data, size_t hlen,
+                         const char **drop, int keep_only )
+{
+    const char *end = data + hlen - 2; // exclude the blank line
+    const char *line = memchr ( data, '\n', hlen );
+    for ( line = line ? line + 1 : end; line < end; ) {
+        const char *eol = memchr ( line, '\n', end - line );
+        eol = eol ? eol + 1 : end;
+        int listed = 0;
+        for ( const char **d = drop; *d; d++ ) {
+            if ( field_is ( line, *d ) ) { listed = 1; break; }
+        }
+        if ( listed == keep_only && ! append ( dst, len, cap, line, eol - line ) ) { return 0; }
+        line = eol;
+    }
+    return 1;
+}
+
+/* the version of a stored response's status line, e.g. "HTTP/1.0". */
+static void response_version ( const char *data, size_t hlen, char *version, size_t cap )
+{
+    const char *sp = memchr ( data, ' ', hlen );
+    size_t n = sp ? (size_t)(sp - data) : 0;
+    if ( n == 0 || n >= cap ) { strcpy ( version, "HTTP/1.0" ); return; }
+    memcpy ( version, data, n );
+    version[n] = '\0';
+}
+
+/* is the stored response unchanged according to the request's validators? */
+static int not_modified ( http_request_t *req, const char *data, size_t hlen )
+{
+    char req_val[MAX_LINE], resp_val[MAX_LINE];
+
+    if ( http_get_field ( req->fields, req->fields_len, "If-None-Match", req_val, sizeof(req_val) ) ) {
+        return http_get_field ( data, hlen, "ETag", resp_val, sizeof(resp_val) ) &&
+               etag_matches ( req_val, resp_val );
+    }
+    if ( http_get_field ( req->fields, req->fields_len, "If-Modified-Since", req_val, sizeof(req_val) ) &&
+         http_get_field ( data, hlen, "Last-Modified", resp_val, sizeof(resp_val) ) ) {
+        time_t since = parse_http_date ( req_val );
+        time_t modified = parse_http_date ( resp_val );
+        return since >= 0 && modified >= 0 && modified <= since;
+    }
+    return 0;
+}
+
+/* does If-Range (if any) allow a partial response? (strong comparison only) */
+static int if_range_holds ( http_request_t *req, const char *data, size_t hlen )
+{
+    char req_val[MAX_LINE], resp_val[MAX_LINE];
+    if ( ! http_get_field ( req->fields, req->fields_len, "If-Range", req_val, sizeof(req_val) ) ) { return 1; }
+    if ( req_val[0] == '"' ) {
+        return http_get_field ( data, hlen, "ETag", resp_val, sizeof(resp_val) ) &&
+               strcmp ( req_val, resp_val ) == 0;
+    }
+    return http_get_field ( data, hlen, "Last-Modified", resp_val, sizeof(resp_val) ) &&
+           strcmp ( req_val, resp_val ) == 0;
+}
+
+/* parse `bytes=a-b, c-, -n` against a body of blen bytes into satisfiable
+   [first, last] pairs. returns the number of them, or -1 if the field is
+   malformed or has too many ranges (then it is ignored). */
+static int parse_ranges ( const char *spec, size_t blen, size_t *first, size_t *last )
+{
+    int n = 0, listed = 0;
+    if ( strncasecmp ( spec, "bytes=", 6 ) != 0 ) { return -1; }
+    for ( const char *p = spec + 6; *p; ) {
+        while ( *p == ' ' || *p == ',' ) { p++; }
+        if ( *p == '\0' ) { break; }
+        if ( ++listed > MAX_RANGES ) { return -1; }
+
+        char *end;
+        size_t a, b;
+        if ( *p == '-' ) {
+            /* suffix range: the last b bytes. */
+            b = strtoull ( p + 1, &end, 10 );
+            if ( end == p + 1 ) { return -1; }
+            if ( b == 0 || blen == 0 ) { p = end; continue; }
+            a = b < blen ? blen - b : 0;
+            b = blen - 1;
+        } else {
+            a = strtoull ( p, &end, 10 );
+            if ( end == p || *end != '-' ) { return -1; }
+            p = end + 1;
+            if ( *p >= '0' && *p <= '9' ) {
+                b = strtoull ( p, &end, 10 );
+                if ( b < a ) { return -1; }
+            } else {
+                end = (char *)p;
+                b = blen ? blen - 1 : 0;
+            }
+            if ( b >= blen ) { b = blen - 1; }
+            if ( a >= blen ) { p = end; continue; } // unsatisfiable
+        }
+        first[n] = a;
+        last[n] = b;
+        n++;
+        p = end;
+        while ( *p == ' ' ) { p++; }
+        if ( *p && *p != ',' ) { return -1; }
+    }
+    return listed ? n : -1;
+}
+
+/* how much of a stored response's body (blen bytes, under the header `data`
+   of hlen bytes) http_respond_cached reads to answer req, from its start:
+   none for HEAD, a 304 or a 416, up to the last byte asked for by a Range,
+   else all of it. */
+size_t http_cached_extent ( http_request_t *req, const char *data, size_t hlen, size_t blen )
+{
+    char range[MAX_LINE];
+    size_t first[MAX_RANGES], last[MAX_RANGES], end = 0;
+
+    if ( hlen == 0 ) { return blen; }
+    if ( strcasecmp ( req->method, "HEAD" ) == 0 ) { return 0; }
+    if ( http_response_status ( data, hlen ) != 200 ) { return blen; }
+    if ( not_modified ( req, data, hlen ) ) { return 0; }
+    if ( ! http_get_field ( req->fields, req->fields_len, "Range", range, sizeof(range) ) ||
+         ! if_range_holds ( req, data, hlen ) ) { return blen; }
+
+    const int n = parse_ranges ( range, blen, first, last );
+    if ( n < 0 ) { return blen; }
+    for ( int i = 0; i < n; i++ ) {
+        if ( last[i] + 1 > end ) { end = last[i] + 1; }
+    }
+    return end;
+}
+
+/* answer a request from a stored (cached) response, writing straight from
+   its header (`data`, hlen bytes) and body. handles HEAD (header only), If-None-Match / If-Modified-Since (304)
+   and Range (206, one range or multipart/byteranges). returns write_all's result. */
+int http_respond_cached ( int fd, http_request_t *req, const char *data, size_t hlen,
+                          const char *body, size_t blen )
+{
+    const int is_head = strcasecmp ( req->method, "HEAD" ) == 0;
+
+    /* not a parsable response: send it as stored. */
+    if ( hlen == 0 ) { return write_all ( fd, (void *)body, blen ) < 0 ? -1 : 0; }
+
+    const int status = http_response_status ( data, hlen );
+    char version[32], range[MAX_LINE];
+    response_version ( data, hlen, version, sizeof(version) );
+
+    const size_t cap = hlen + 512;
+    char *hdr = malloc ( cap );
+    size_t len = 0;
+    int return_cd;
+    if ( hdr == NULL ) { return -1; }
+    hdr[0] = '\0';
+
+    if ( status == 200 && not_modified ( req, data, hlen ) ) {
+        /* 304: the validators and caching metadata, no body. */
+        static const char *keep[] = { "ETag", "Last-Modified", "Cache-Control", "Expires", "Vary",
+                                      "Content-Location", "Date", NULL };
+        len = snprintf ( hdr, cap, "%s 304 Not Modified\r\n", version );
+        copy_fields ( hdr, &len, cap, data, hlen, keep, 1 );
+        append ( hdr, &len, cap, BLANK_LINE, 2 );
+        return_cd = write_all ( fd, hdr, len );
+        free ( hdr );
+        return return_cd < 0 ? -1 : 0;
+    }
+
+    size_t first[MAX_RANGES], last[MAX_RANGES];
+    int n_ranges = -1;
+    if ( status == 200 &&
+         http_get_field ( req->fields, req->fields_len, "Range", range, sizeof(range) ) &&
+         if_range_holds ( req, data, hlen ) ) {
+        n_ranges = parse_ranges ( range, blen, first, last );
+    }
+
+    if ( n_ranges == 0 ) {
+        /* 416: none of the ranges overlaps the body. */
+        len = snprintf ( hdr, cap, "%s 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\n"
+                         "Content-Length: 0\r\n\r\n", version, blen );
+        return_cd = write_all ( fd, hdr, len );
+        free ( hdr );
+        return return_cd < 0 ? -1 : 0;
+    }
+
+    if ( n_ranges < 0 ) {
+        /* the whole response (or just its header, for HEAD). */
+        struct iovec whole[2] = { { (void *)data, hlen }, { (void *)body, blen } };
+        free ( hdr );
+        return writev_all ( fd, whole, is_head ? 1 : 2 ) < 0 ? -1 : 0;
+    }
+
+    char content_type[MAX_LINE] = "";
+    http_get_field ( data, hlen, "Content-Type", content_type, sizeof(content_type) );
+
+    static const char *single_drop[] = { "Content-Length", "Content-Range", NULL };
+    static const char *multi_drop[] = { "Content-Length", "Content-Range", "Content-Type", NULL };
+    len = snprintf ( hdr, cap, "%s 206 Partial Content\r\n", version );
+    copy_fields ( hdr, &len, cap, data, hlen, n_ranges == 1 ? single_drop : multi_drop, 0 );
+
+    /* one iovec for the header, two per part (part header, slice of the
+       cached body), one for the closing boundary. part headers hold the
+       whole Content-Type, so their room is sized from it. */
+    struct iovec iov[2 + 2 * MAX_RANGES];
+    const size_t part_size = strlen ( content_type ) + 160;
+    char *parts = NULL;
+    char closing[64];
+    int iovcnt = 1;
+    size_t content_length = 0;
+    char fld[256];
+
+    if ( n_ranges == 1 ) {
+        content_length = last[0] - first[0] + 1;
+        snprintf ( fld, sizeof(fld), "Content-Range: bytes %zu-%zu/%zu\r\n", first[0], last[0], blen );
+        append ( hdr, &len, cap, fld, strlen(fld) );
+        iov[iovcnt].iov_base = (void *)(body + first[0]);
+        iov[iovcnt++].iov_len = content_length;
     } else {
-        strcpy(port, pport+1);
-        *pport = 0;
-        strcpy(hostname, pstart);
+        if ( ( parts = malloc ( n_ranges * part_size ) ) == NULL ) {
+            free ( hdr );
+            return -1;
+        }
+        for ( int i = 0; i < n_ranges; i++ ) {
+            char *part = parts + i * part_size;
+            int n = snprintf ( part, part_size, "\r\n--" BOUNDARY "\r\n%s%s%sContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                               content_type[0] ? "Content-Type: " : "", content_type,
+                               content_type[0] ? "\r\n" : "", first[i], last[i], blen );
+            iov[iovcnt].iov_base = part;
+            iov[iovcnt++].iov_len = n;
+            iov[iovcnt].iov_base = (void *)(body + first[i]);
+            iov[iovcnt++].iov_len = last[i] - first[i] + 1;
+            content_length += n + last[i] - first[i] + 1;
+        }
+        int n = snprintf ( closing, sizeof(closing), "\r\n--" BOUNDARY "--\r\n" );
+        iov[iovcnt].iov_base = closing;
+        iov[iovcnt++].iov_len = n;
+        content_length += n;
+        snprintf ( fld, sizeof(fld), "Content-Type: multipart/byteranges; boundary=" BOUNDARY "\r\n" );
+        append ( hdr, &len, cap, fld, strlen(fld) );
     }
+    snprintf ( fld, sizeof(fld), "Content-Length: %zu\r\n\r\n", content_length );
+    append ( hdr, &len, cap, fld, strlen(fld) );
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = len;
+
+    return_cd = writev_all ( fd, iov, is_head ? 1 : iovcnt ) < 0 ? -1 : 0;
+    free ( parts );
+    free ( hdr );
+    return return_cd;
 }
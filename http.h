@@ -1,3 +1,32 @@
-void parse_uri ( char* uri, char* hostname, char* path, char* port );
-int  set_request_header ( char* request_hdr, char* hostname, char* path, char* port, int fd );
+#ifndef HTTP_H
+#define HTTP_H
 
+#include "io.h" // MAX_LINE
+
+/* A client request: the request line, and the raw header fields after it. */
+typedef struct {
+    char method[32];
+    char uri[MAX_LINE];
+    char version[32];
+    char fields[MAX_LINE]; // header fields, each `k: v\r\n`; without the blank line
+    size_t fields_len;
+} http_request_t;
+
+int    read_request ( int fd, http_request_t *req );
+void   parse_uri ( char* uri, char* hostname, char* path, char* port );
+int    set_request_header ( char* request_hdr, size_t hdr_size, http_request_t *req,
+                            char* hostname, char* path, char* port, int strip_validators );
+int    set_parent_request_header ( char* request_hdr, size_t hdr_size, http_request_t *req,
+                                   char* hostname, char* path, char* port, int strip_validators,
+                                   int keep_alive );
+int    http_relay_body ( int client_fd, int server_fd, http_request_t *req );
+int    http_get_field ( const char *fields, size_t len, const char *name, char *value, size_t value_len );
+int    http_accepts_encoding ( const char *fields, size_t len, const char *coding );
+size_t http_header_length ( const char *data, size_t size );
+int    http_response_status ( const char *data, size_t hlen );
+size_t http_strip_hop_fields ( char *data, size_t hlen, size_t *len, size_t cap );
+size_t http_cached_extent ( http_request_t *req, const char *data, size_t hlen, size_t blen );
+int    http_respond_cached ( int fd, http_request_t *req, const char *data, size_t hlen,
+                             const char *body, size_t blen );
+
+#endif/*HTTP_H*/
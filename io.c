@@ -1,7 +1,13 @@
+#define _GNU_SOURCE // splice
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "io.h"
 
+#define WRITEV_MAX 1024 // Linux IOV_MAX
+
 /* keeps calling `write` while there are bytes remaining to be written, until
    all bytes are written, or an error occurs. */
 ssize_t write_all ( int fd, void *bf, size_t n) 
@@ -33,6 +39,80 @@ ssize_t write_all ( int fd, void *bf, size_t n)
     return w_tot; // success (w_tot = n)
 }
 
+/* like `write_all`, but gathers the bytes from several buffers (one system call
+   per partial write, instead of one per buffer). NOTE: modifies iov. */
+ssize_t writev_all ( int fd, struct iovec *iov, int iovcnt )
+{
+    ssize_t w_tot = 0;
+    while ( iovcnt > 0 ) {
+	/* skip buffers that are fully written (or empty). */
+	if ( iov->iov_len == 0 ) { iov++; iovcnt--; continue; }
+	/* https://man7.org/linux/man-pages/man2/writev.2.html (a system call) */
+	ssize_t w_cur = writev ( fd, iov, iovcnt > WRITEV_MAX ? WRITEV_MAX : iovcnt );
+	if ( w_cur <= 0 ) {
+	    if ( errno == EINTR ) { continue; }
+	    return -1;
+	}
+	w_tot += w_cur;
+	/* advance past what was written. */
+	while ( w_cur > 0 ) {
+	    size_t n = (size_t)w_cur < iov->iov_len ? (size_t)w_cur : iov->iov_len;
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	    w_cur -= n;
+	    if ( iov->iov_len == 0 ) { iov++; iovcnt--; }
+	}
+    }
+    return w_tot;
+}
+
+/* keeps calling `read` until `n` bytes are read, EOF, or an error occurs.
+   returns the number of bytes read (< n on EOF), or -1. */
+ssize_t read_all ( int fd, void *bf, size_t n )
+{
+    size_t r_tot = 0;
+    while ( r_tot < n ) {
+	ssize_t r_cur = read ( fd, (char *)bf + r_tot, n - r_tot );
+	if ( r_cur == 0 ) { break; }
+	if ( r_cur < 0 ) {
+	    if ( errno == EINTR ) { continue; }
+	    return -1;
+	}
+	r_tot += r_cur;
+    }
+    return r_tot;
+}
+
+/* move exactly `n` bytes from in_fd to out_fd without copying them through
+   user space: socket -> pipe -> socket. pipe_fds is a pipe of the caller's
+   (reused across calls); it is empty again on success.
+   returns n, -1 (an error, or EOF on in_fd before n bytes), or -2 (an error
+   on out_fd).
+   https://man7.org/linux/man-pages/man2/splice.2.html (a system call) */
+ssize_t splice_all ( int in_fd, int out_fd, int pipe_fds[2], size_t n )
+{
+    size_t moved = 0;
+    while ( moved < n ) {
+	ssize_t in = splice ( in_fd, NULL, pipe_fds[1], NULL, n - moved, SPLICE_F_MOVE | SPLICE_F_MORE );
+	if ( in == 0 ) { return -1; }
+	if ( in < 0 ) {
+	    if ( errno == EINTR ) { continue; }
+	    return -1;
+	}
+	/* drain what entered the pipe. */
+	while ( in > 0 ) {
+	    ssize_t out = splice ( pipe_fds[0], NULL, out_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE );
+	    if ( out <= 0 ) {
+		if ( out < 0 && errno == EINTR ) { continue; }
+		return -2;
+	    }
+	    in    -= out;
+	    moved += out;
+	}
+    }
+    return moved;
+}
+
 int read_line ( int fd, char* bf )
 {
     int n = 0;     // number of characters read, in total
@@ -57,3 +137,12 @@ int read_line ( int fd, char* bf )
     } while ( n < MAX_LINE );
     return 0; // no newline found.
 }
+
+/* bound how long `read`/`write` (and, on Linux, `connect`) on fd may block.
+   a blocked call then fails with EAGAIN (resp. EINPROGRESS). secs = 0: forever. */
+int set_socket_timeout ( int fd, int secs )
+{
+    struct timeval tv = { .tv_sec = secs, .tv_usec = 0 };
+    if ( setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) ) < 0 ) { return -1; }
+    return setsockopt ( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+}
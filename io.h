@@ -1,6 +1,17 @@
+#ifndef IO_H
+#define IO_H
+
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define MAX_LINE 8192 // HTTP Semantics (RFC 9110) recommends >= 8000 characters.
 
 int read_line ( int fd, char* bf );
 ssize_t write_all ( int fd, void *bf, size_t n) ;
+ssize_t writev_all ( int fd, struct iovec *iov, int iovcnt );
+ssize_t read_all ( int fd, void *bf, size_t n );
+ssize_t splice_all ( int in_fd, int out_fd, int pipe_fds[2], size_t n );
+int set_socket_timeout ( int fd, int secs );
+
+#endif/*IO_H*/
@@ -0,0 +1,172 @@
+/**
+ * LZ77 block compression, in the format of LZ4 blocks: a sequence of
+ *
+ *     token   [literal length bytes]   literals   offset   [match length bytes]
+ *
+ * The token holds the literal length (high nibble) and the match length
+ * minus 4 (low nibble); a nibble of 15 continues in bytes of 255 and a final
+ * smaller one. The offset is 2 bytes, little-endian, back from the current
+ * output position. The last sequence has literals only.
+ *
+ * The compressor keeps the last position of each hashed 4-byte string and
+ * extends a match greedily; positions without a match are skipped faster
+ * the longer no match is found, so incompressible input costs little.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 13
+
+static inline uint32_t read32 ( const unsigned char *p )
+{
+    uint32_t v;
+    memcpy ( &v, p, sizeof(v) );
+    return v;
+}
+
+static inline uint32_t lz_hash ( uint32_t v )
+{
+    return ( v * 2654435761u ) >> ( 32 - LZ_HASH_BITS );
+}
+
+/* a length nibble's continuation: 255s and a final byte. */
+static int put_length ( unsigned char *out, size_t *op, size_t cap, size_t n )
+{
+    for ( ; n >= 255; n -= 255 ) {
+        if ( *op >= cap ) { return -1; }
+        out[(*op)++] = 255;
+    }
+    if ( *op >= cap ) { return -1; }
+    out[(*op)++] = n;
+    return 0;
+}
+
+/* one sequence; match_len 0 is the last one (literals only). */
+static int put_sequence ( unsigned char *out, size_t *op, size_t cap, const unsigned char *lit,
+                          size_t lit_len, size_t offset, size_t match_len )
+{
+    const size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if ( *op >= cap ) { return -1; }
+    out[(*op)++] = ( ( lit_len < 15 ? lit_len : 15 ) << 4 ) | ( m < 15 ? m : 15 );
+    if ( lit_len >= 15 && put_length ( out, op, cap, lit_len - 15 ) < 0 ) { return -1; }
+    if ( lit_len > cap - *op ) { return -1; }
+    memcpy ( out + *op, lit, lit_len );
+    *op += lit_len;
+    if ( match_len == 0 ) { return 0; }
+
+    if ( cap - *op < 2 ) { return -1; }
+    out[(*op)++] = offset & 0xFF;
+    out[(*op)++] = offset >> 8;
+    if ( m >= 15 && put_length ( out, op, cap, m - 15 ) < 0 ) { return -1; }
+    return 0;
+}
+
+/* compress in[0..len) into out (of capacity cap). returns the compressed
+   size, or 0 if it does not fit (the input is not compressible enough). */
+size_t lz_compress ( const char *src, size_t len, char *dst, size_t cap )
+{
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    uint32_t table[1 << LZ_HASH_BITS];
+    size_t anchor = 0, i = 0, op = 0;
+
+    memset ( table, 0, sizeof(table) );
+    while ( i + LZ_MIN_MATCH <= len ) {
+        const uint32_t seq = read32 ( in + i );
+        const uint32_t h = lz_hash ( seq );
+        const size_t ref = table[h];
+        table[h] = i;
+
+        if ( ref < i && i - ref <= LZ_MAX_OFFSET && read32 ( in + ref ) == seq ) {
+            size_t match_len = LZ_MIN_MATCH;
+            while ( i + match_len < len && in[ref + match_len] == in[i + match_len] ) { match_len++; }
+            if ( put_sequence ( out, &op, cap, in + anchor, i - anchor, i - ref, match_len ) < 0 ) { return 0; }
+            i += match_len;
+            anchor = i;
+        } else {
+            i += 1 + ( ( i - anchor ) >> 6 );
+        }
+    }
+    if ( put_sequence ( out, &op, cap, in + anchor, len - anchor, 0, 0 ) < 0 ) { return 0; }
+    return op;
+}
+
+/* a length nibble's continuation, added to *n. */
+static int get_length ( const unsigned char *in, size_t *ip, size_t len, size_t *n )
+{
+    unsigned char b;
+    do {
+        if ( *ip >= len ) { return -1; }
+        b = in[(*ip)++];
+        *n += b;
+    } while ( b == 255 );
+    return 0;
+}
+
+/* decompress in[0..len) into out: exactly out_len bytes if whole, else
+   the first out_len bytes (decoding stops there). returns 0, or -1 if the
+   input is corrupt or does not decode to that many bytes. */
+static int decode ( const char *src, size_t len, char *dst, size_t out_len, int whole )
+{
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    size_t ip = 0, op = 0;
+
+    while ( ip < len && ( whole || op < out_len ) ) {
+        const unsigned char token = in[ip++];
+
+        size_t lit_len = token >> 4;
+        if ( lit_len == 15 && get_length ( in, &ip, len, &lit_len ) < 0 ) { return -1; }
+        if ( lit_len > len - ip ) { return -1; }
+        if ( lit_len > out_len - op ) {
+            if ( whole ) { return -1; }
+            memcpy ( out + op, in + ip, out_len - op );
+            return 0;
+        }
+        memcpy ( out + op, in + ip, lit_len );
+        ip += lit_len;
+        op += lit_len;
+        if ( ip == len ) { break; } // the last sequence
+
+        if ( len - ip < 2 ) { return -1; }
+        const size_t offset = in[ip] | ( in[ip + 1] << 8 );
+        ip += 2;
+        size_t match_len = token & 15;
+        if ( match_len == 15 && get_length ( in, &ip, len, &match_len ) < 0 ) { return -1; }
+        match_len += LZ_MIN_MATCH;
+        if ( offset == 0 || offset > op ) { return -1; }
+        if ( match_len > out_len - op ) {
+            if ( whole ) { return -1; }
+            match_len = out_len - op;
+        }
+
+        const unsigned char *ref = out + op - offset;
+        if ( offset >= match_len ) {
+            memcpy ( out + op, ref, match_len );
+        } else {
+            for ( size_t k = 0; k < match_len; k++ ) { out[op + k] = ref[k]; } // overlapping: a run
+        }
+        op += match_len;
+    }
+    return op == out_len ? 0 : -1;
+}
+
+/* decompress in[0..len) into exactly out_len bytes at out. returns 0, or -1
+   if the input is corrupt or does not decode to out_len bytes. */
+int lz_decompress ( const char *src, size_t len, char *dst, size_t out_len )
+{
+    return decode ( src, len, dst, out_len, 1 );
+}
+
+/* decompress only the first out_len bytes of what in[0..len) decodes to
+   (matches refer back, never ahead, so the rest is not needed for them).
+   returns 0, or -1 if the input is corrupt or decodes to fewer bytes. */
+int lz_decompress_prefix ( const char *src, size_t len, char *dst, size_t out_len )
+{
+    return decode ( src, len, dst, out_len, 0 );
+}
@@ -0,0 +1,14 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/* A byte-oriented LZ77 block codec for compressing cached bodies in memory.
+   It trades ratio for speed: one hash probe per position when compressing,
+   and only copies (no entropy decoding) when decompressing. */
+
+size_t lz_compress ( const char *in, size_t len, char *out, size_t cap );
+int    lz_decompress ( const char *in, size_t len, char *out, size_t out_len );
+int    lz_decompress_prefix ( const char *in, size_t len, char *out, size_t out_len );
+
+#endif/*LZ_H*/
@@ -0,0 +1,211 @@
+/**
+ * Negative cache: recent failures, remembered for a few seconds so that
+ * requests for an origin that is down fail at once instead of each one
+ * waiting out name resolution and connect timeouts in a worker thread.
+ *
+ *  - an origin (`host:port`) whose name did not resolve (`negative-dns-ttl`);
+ *  - an origin that refused or timed out every connection (`negative-connect-ttl`);
+ *  - a URL whose origin answered with an error (status >= 400), which the
+ *    response cache never keeps (`negative-status-ttl`); the response itself
+ *    is kept, and sent again.
+ *
+ * Entries expire by time only; a TTL of 0 turns that kind off. The table is
+ * small and bounded: expired entries are dropped as their chain is walked,
+ * and when it is full, all of them are, or else the entry closest to
+ * expiring makes way for the new failure.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "negative.h"
+#include "origin.h"
+
+#define NEGATIVE_BUCKETS 1024         // a power of two
+#define NEGATIVE_MAX_ENTRIES 4096
+
+typedef struct negative_entry {
+    char *key;                   // `host:port`, or a canonical URL
+    uint64_t hash;
+    int kind;                    // NEGATIVE_*
+    time_t expires;              // CLOCK_MONOTONIC seconds
+    char *response;              // NEGATIVE_STATUS: the error response
+    size_t size;
+    struct negative_entry *next;
+} negative_entry_t;
+
+static struct {
+    negative_entry_t *buckets[NEGATIVE_BUCKETS];
+    size_t count;
+    int ttl[NEGATIVE_STATUS + 1]; // seconds, by kind
+    pthread_mutex_t lock;
+} negative = { { NULL }, 0, { 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+static time_t now ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec;
+}
+
+static void entry_free ( negative_entry_t *entry )
+{
+    free ( entry->key );
+    free ( entry->response );
+    free ( entry );
+}
+
+void negative_cleanup ( void )
+{
+    pthread_mutex_lock ( &negative.lock );
+    for ( int i = 0; i < NEGATIVE_BUCKETS; i++ ) {
+        while ( negative.buckets[i] ) {
+            negative_entry_t *next = negative.buckets[i]->next;
+            entry_free ( negative.buckets[i] );
+            negative.buckets[i] = next;
+        }
+    }
+    negative.count = 0;
+    pthread_mutex_unlock ( &negative.lock );
+}
+
+void negative_configure ( int dns_ttl, int connect_ttl, int status_ttl )
+{
+    pthread_mutex_lock ( &negative.lock );
+    negative.ttl[NEGATIVE_DNS] = dns_ttl;
+    negative.ttl[NEGATIVE_CONNECT] = connect_ttl;
+    negative.ttl[NEGATIVE_STATUS] = status_ttl;
+    pthread_mutex_unlock ( &negative.lock );
+}
+
+/* find the live entry for key among origins (status 0) or URLs (1), dropping
+   expired entries of its chain on the way (caller holds the lock). */
+static negative_entry_t *find ( const char *key, uint64_t hash, int status )
+{
+    const time_t t = now();
+    negative_entry_t **link = &negative.buckets[hash & ( NEGATIVE_BUCKETS - 1 )];
+    while ( *link ) {
+        negative_entry_t *entry = *link;
+        if ( entry->expires <= t ) {
+            *link = entry->next;
+            entry_free ( entry );
+            negative.count--;
+            continue;
+        }
+        if ( entry->hash == hash && ( entry->kind == NEGATIVE_STATUS ) == status &&
+             strcmp ( entry->key, key ) == 0 ) { return entry; }
+        link = &entry->next;
+    }
+    return NULL;
+}
+
+/* make room in the full table: drop the expired entries or, if none has,
+   the one that expires first (caller holds the lock). */
+static void make_room ( void )
+{
+    const time_t t = now();
+    negative_entry_t **first = NULL;
+    for ( int i = 0; i < NEGATIVE_BUCKETS; i++ ) {
+        negative_entry_t **link = &negative.buckets[i];
+        while ( *link ) {
+            negative_entry_t *entry = *link;
+            if ( entry->expires <= t ) {
+                *link = entry->next;
+                entry_free ( entry );
+                negative.count--;
+                continue;
+            }
+            if ( first == NULL || entry->expires < ( *first )->expires ) { first = link; }
+            link = &entry->next;
+        }
+    }
+    if ( negative.count >= NEGATIVE_MAX_ENTRIES && first ) {
+        negative_entry_t *entry = *first;
+        *first = entry->next;
+        entry_free ( entry );
+        negative.count--;
+    }
+}
+
+/* remember a failure under key for its kind's TTL (or update it). */
+static void insert ( const char *key, uint64_t hash, int kind, const char *response, size_t size )
+{
+    pthread_mutex_lock ( &negative.lock );
+    const int ttl = negative.ttl[kind];
+    negative_entry_t *entry = ttl > 0 ? find ( key, hash, kind == NEGATIVE_STATUS ) : NULL;
+    if ( ttl <= 0 ) {
+        pthread_mutex_unlock ( &negative.lock );
+        return;
+    }
+    if ( entry == NULL && negative.count >= NEGATIVE_MAX_ENTRIES ) { make_room(); }
+
+    char *copy = NULL;
+    if ( response && ( copy = malloc ( size ? size : 1 ) ) != NULL ) { memcpy ( copy, response, size ); }
+    if ( response && copy == NULL ) {
+        pthread_mutex_unlock ( &negative.lock );
+        return;
+    }
+    if ( entry == NULL ) {
+        entry = calloc ( 1, sizeof(*entry) );
+        if ( entry == NULL || ( entry->key = strdup ( key ) ) == NULL ) {
+            free ( entry );
+            free ( copy );
+            pthread_mutex_unlock ( &negative.lock );
+            return;
+        }
+        entry->hash = hash;
+        entry->next = negative.buckets[hash & ( NEGATIVE_BUCKETS - 1 )];
+        negative.buckets[hash & ( NEGATIVE_BUCKETS - 1 )] = entry;
+        negative.count++;
+    }
+    free ( entry->response );
+    entry->kind = kind;
+    entry->response = copy;
+    entry->size = size;
+    entry->expires = now() + ttl;
+    pthread_mutex_unlock ( &negative.lock );
+}
+
+/* did this origin fail recently? returns NEGATIVE_DNS, NEGATIVE_CONNECT, or NEGATIVE_NONE. */
+int negative_origin ( const char *hostname, const char *port )
+{
+    char key[ORIGIN_KEY_MAX];
+    const uint64_t hash = origin_key ( key, sizeof(key), hostname, port );
+    pthread_mutex_lock ( &negative.lock );
+    negative_entry_t *entry = find ( key, hash, 0 );
+    const int kind = entry ? entry->kind : NEGATIVE_NONE;
+    pthread_mutex_unlock ( &negative.lock );
+    return kind;
+}
+
+void negative_origin_failed ( const char *hostname, const char *port, int kind )
+{
+    char key[ORIGIN_KEY_MAX];
+    const uint64_t hash = origin_key ( key, sizeof(key), hostname, port );
+    insert ( key, hash, kind, NULL, 0 );
+}
+
+/* a recent error response for url: 1 and a copy (to free) in *response, or 0. */
+int negative_response ( const url_key_t *url, char **response, size_t *size )
+{
+    int found = 0;
+    pthread_mutex_lock ( &negative.lock );
+    negative_entry_t *entry = find ( url->url, url->hash, 1 );
+    if ( entry && ( *response = malloc ( entry->size ? entry->size : 1 ) ) != NULL ) {
+        memcpy ( *response, entry->response, entry->size );
+        *size = entry->size;
+        found = 1;
+    }
+    pthread_mutex_unlock ( &negative.lock );
+    return found;
+}
+
+void negative_response_insert ( const url_key_t *url, const char *response, size_t size )
+{
+    if ( size > NEGATIVE_MAX_RESPONSE ) { return; }
+    insert ( url->url, url->hash, NEGATIVE_STATUS, response, size );
+}
@@ -0,0 +1,21 @@
+#ifndef NEGATIVE_H
+#define NEGATIVE_H
+
+#include <stddef.h>
+#include "url.h"
+
+/* Recently failed origins and error responses, remembered for a few seconds
+   so that requests for them fail at once; see negative.c.
+   Why an origin (or a URL) is in it: */
+enum { NEGATIVE_NONE, NEGATIVE_DNS, NEGATIVE_CONNECT, NEGATIVE_STATUS };
+
+#define NEGATIVE_MAX_RESPONSE (16 * 1024) // larger error responses are not kept
+
+void negative_cleanup ( void );
+void negative_configure ( int dns_ttl, int connect_ttl, int status_ttl );
+int  negative_origin ( const char *hostname, const char *port );
+void negative_origin_failed ( const char *hostname, const char *port, int kind );
+int  negative_response ( const url_key_t *url, char **response, size_t *size );
+void negative_response_insert ( const url_key_t *url, const char *response, size_t size );
+
+#endif/*NEGATIVE_H*/
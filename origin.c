@@ -0,0 +1,67 @@
+/**
+ * Per-origin tables.
+ *
+ * Health tracking (health.c) and fetch limits (fetch.c) keep state for each
+ * origin, found by its `host:port` key in a hash table of chains. Each
+ * keeps its own table (under its own lock); the lookup, and the making of
+ * an entry when an origin is first seen, are here. An entry is the module's
+ * own struct, with an origin_entry_t first. A table holds at most `max`
+ * origins: past that, new ones get no entry (and are not tracked).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "origin.h"
+#include "hash.h"
+
+/* write hostname:port's key (of at most ORIGIN_KEY_MAX bytes) to key;
+   returns its hash. */
+uint64_t origin_key ( char *key, size_t cap, const char *hostname, const char *port )
+{
+    snprintf ( key, cap, "%s:%s", hostname, port );
+    return hash64 ( key, strlen ( key ), 0 );
+}
+
+/* the entry (of size bytes) for hostname:port, made zeroed if it is new
+   (then *made is 1) and there is room. returns NULL if there is none.
+   (caller holds the table's lock.) */
+void *origin_get ( origin_table_t *table, const char *hostname, const char *port, size_t size, int *made )
+{
+    char key[ORIGIN_KEY_MAX];
+    const uint64_t hash = origin_key ( key, sizeof(key), hostname, port );
+    origin_entry_t **slot = &table->buckets[hash & ( table->n_buckets - 1 )];
+    *made = 0;
+    for ( origin_entry_t *e = *slot; e != NULL; e = e->next ) {
+        if ( e->hash == hash && strcmp ( e->key, key ) == 0 ) { return e; }
+    }
+    if ( table->count >= table->max ) { return NULL; }
+
+    origin_entry_t *e = calloc ( 1, size );
+    if ( e == NULL || ( e->key = strdup ( key ) ) == NULL ) {
+        free ( e );
+        return NULL;
+    }
+    e->hash = hash;
+    e->next = *slot;
+    *slot = e;
+    table->count++;
+    *made = 1;
+    return e;
+}
+
+/* free every entry of the table (caller holds its lock). */
+void origin_clear ( origin_table_t *table )
+{
+    for ( size_t i = 0; i < table->n_buckets; i++ ) {
+        while ( table->buckets[i] ) {
+            origin_entry_t *next = table->buckets[i]->next;
+            free ( table->buckets[i]->key );
+            free ( table->buckets[i] );
+            table->buckets[i] = next;
+        }
+    }
+    table->count = 0;
+}
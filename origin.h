@@ -0,0 +1,32 @@
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+/* Per-origin state: tables of it keyed by `host:port` (health.c, fetch.c),
+   and that key (negative.c too); see origin.c. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h" // MAX_LINE
+
+#define ORIGIN_KEY_MAX ( MAX_LINE + 16 )
+
+/* The head of a table's entries: each module's state for an origin starts
+   with one. */
+typedef struct origin_entry {
+    char *key;                   // `host:port`
+    uint64_t hash;
+    struct origin_entry *next;   // hash chain
+} origin_entry_t;
+
+typedef struct {
+    origin_entry_t **buckets;    // n_buckets of them, a power of two
+    size_t n_buckets;
+    size_t count, max;           // no more than max origins
+} origin_table_t;
+
+uint64_t origin_key ( char *key, size_t cap, const char *hostname, const char *port );
+void    *origin_get ( origin_table_t *table, const char *hostname, const char *port, size_t size, int *made );
+void     origin_clear ( origin_table_t *table );
+
+#endif/*ORIGIN_H*/
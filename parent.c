@@ -0,0 +1,191 @@
+/**
+ * Parent-proxy chaining.
+ *
+ * With `parents` (`host:port,...`), requests the cache cannot answer go
+ * through a parent proxy instead of straight to their origins (CONNECT
+ * tunnels too): to the first listed parent that is up, so the others are
+ * fallbacks, in order. A parent that cannot be connected to, or that gives
+ * no answer at all, is down for PARENT_DOWN_TIME seconds; when every parent
+ * is down, they are all tried anyway.
+ *
+ * Connections to parents are kept alive: after an answer whose end the
+ * proxy could tell (it had a Content-Length), from a parent that agreed to
+ * keep the connection (`Connection: keep-alive`), the connection joins a
+ * pool of up to PARENT_IDLE per parent, for the next request. A pooled
+ * connection is taken only if the parent has not closed it meanwhile (it
+ * has nothing to read), and not after PARENT_IDLE_TIME seconds. The parent
+ * may still close it as a request goes out: a GET or HEAD that gets no
+ * answer on a pooled connection is sent again on a new one (see
+ * fetch_origin), and the parent is not passed over for it.
+ */
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "proxy.h" // create_server_fd
+#include "parent.h"
+#include "error.h"
+
+#define PARENT_MAX 16
+#define PARENT_IDLE 16           // idle connections kept per parent
+#define PARENT_IDLE_TIME 30      // seconds an idle connection is kept
+#define PARENT_DOWN_TIME 10      // seconds a failed parent is passed over
+
+typedef struct {
+    char host[256];
+    char port[16];
+    int idle[PARENT_IDLE];       // a stack: the most recently used on top
+    time_t idle_since[PARENT_IDLE];
+    int n_idle;
+    time_t down_until;
+} parent_t;
+
+static struct {
+    parent_t parents[PARENT_MAX];
+    int n_parents;
+    unsigned generation;         // bumped when the parents change: their connections are closed
+    pthread_mutex_t lock;
+} parent = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static time_t now ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec;
+}
+
+static void close_idle ( parent_t *p )
+{
+    while ( p->n_idle > 0 ) { close ( p->idle[--p->n_idle] ); }
+}
+
+/* parents: `host:port,host:port` (or `[v6 address]:port`), in order of preference. */
+void parent_configure ( const char *parents )
+{
+    char list[1024];
+    snprintf ( list, sizeof(list), "%s", parents );
+
+    pthread_mutex_lock ( &parent.lock );
+    for ( int i = 0; i < parent.n_parents; i++ ) { close_idle ( &parent.parents[i] ); }
+    parent.n_parents = 0;
+    parent.generation++;
+    char *save;
+    for ( char *addr = strtok_r ( list, ", \t", &save ); addr; addr = strtok_r ( NULL, ", \t", &save ) ) {
+        parent_t *p = &parent.parents[parent.n_parents];
+        char *colon = strrchr ( addr, ':' ), *host = addr;
+        if ( colon ) { *colon = '\0'; }
+        if ( host[0] == '[' && colon && colon[-1] == ']' ) {
+            host++;
+            colon[-1] = '\0';
+        }
+        if ( parent.n_parents == PARENT_MAX || colon == NULL || *host == '\0' || colon[1] == '\0' ||
+             strlen ( host ) >= sizeof(p->host) || strlen ( colon + 1 ) >= sizeof(p->port) ) {
+            fprintf ( stderr, "\033[31mfailure:\033[0m add parent %s. ignoring it.\n", addr );
+            continue;
+        }
+        strcpy ( p->host, host );
+        strcpy ( p->port, colon + 1 );
+        p->n_idle = 0;
+        p->down_until = 0;
+        parent.n_parents++;
+    }
+    pthread_mutex_unlock ( &parent.lock );
+}
+
+void parent_cleanup ( void )
+{
+    parent_configure ( "" );
+}
+
+int parent_enabled ( void )
+{
+    pthread_mutex_lock ( &parent.lock );
+    const int enabled = parent.n_parents > 0;
+    pthread_mutex_unlock ( &parent.lock );
+    return enabled;
+}
+
+/* a pooled connection to p that is still good, or -1 (caller holds the lock). */
+static int take_idle ( parent_t *p )
+{
+    const time_t t = now();
+    while ( p->n_idle > 0 ) {
+        const int fd = p->idle[--p->n_idle];
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if ( t - p->idle_since[p->n_idle] < PARENT_IDLE_TIME && poll ( &pfd, 1, 0 ) == 0 ) { return fd; }
+        close ( fd );
+    }
+    return -1;
+}
+
+/* a connection to the first parent that is up (a pooled one if it has
+   one, unless fresh), with reads and writes bounded by timeout seconds.
+   returns its fd (also in conn), or -1: no parent could be reached. */
+int parent_connect ( int timeout, int fresh, parent_conn_t *conn )
+{
+    conn->fd = -1;
+    conn->reused = 0;
+    /* first the parents that are up, then (if none was) the others. */
+    for ( int pass = 0; pass < 2; pass++ ) {
+        pthread_mutex_lock ( &parent.lock );
+        const int n = parent.n_parents;
+        pthread_mutex_unlock ( &parent.lock );
+
+        for ( int i = 0; i < n; i++ ) {
+            char host[256], port[16];
+            pthread_mutex_lock ( &parent.lock );
+            if ( i >= parent.n_parents || ( parent.parents[i].down_until > now() ) != pass ) {
+                pthread_mutex_unlock ( &parent.lock );
+                continue;
+            }
+            parent_t *p = &parent.parents[i];
+            conn->index = i;
+            conn->generation = parent.generation;
+            conn->fd = fresh ? -1 : take_idle ( p );
+            strcpy ( host, p->host );
+            strcpy ( port, p->port );
+            pthread_mutex_unlock ( &parent.lock );
+
+            if ( conn->fd >= 0 ) {
+                log_debug ( "reusing connection to parent %s:%s.\n", host, port );
+                conn->reused = 1;
+                return conn->fd;
+            }
+            if ( ( conn->fd = create_server_fd ( host, port, timeout ) ) >= 0 ) { return conn->fd; }
+            parent_release ( conn, PARENT_FAILED );
+        }
+    }
+    return -1;
+}
+
+/* done with a parent connection: how is PARENT_KEEP (pool it: the answer
+   was read to its end, and the parent keeps the connection open),
+   PARENT_CLOSE, or PARENT_FAILED (close it, and pass the parent over). */
+void parent_release ( parent_conn_t *conn, int how )
+{
+    int fd = conn->fd;
+    pthread_mutex_lock ( &parent.lock );
+    if ( conn->generation == parent.generation && conn->index < parent.n_parents ) {
+        parent_t *p = &parent.parents[conn->index];
+        if ( how == PARENT_FAILED ) {
+            if ( p->down_until <= now() ) {
+                fprintf ( stderr, "\033[31mfailure:\033[0m parent %s:%s not answering. passing it over for %d seconds.\n",
+                          p->host, p->port, PARENT_DOWN_TIME );
+            }
+            p->down_until = now() + PARENT_DOWN_TIME;
+        } else if ( how == PARENT_KEEP && fd >= 0 && p->n_idle < PARENT_IDLE ) {
+            p->idle_since[p->n_idle] = now();
+            p->idle[p->n_idle++] = fd;
+            fd = -1;
+        }
+    }
+    pthread_mutex_unlock ( &parent.lock );
+    if ( fd >= 0 ) { close ( fd ); }
+    conn->fd = -1;
+}
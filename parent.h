@@ -0,0 +1,23 @@
+#ifndef PARENT_H
+#define PARENT_H
+
+/* Parent-proxy chaining: origin requests go through the first parent proxy
+   that is up, on pooled keep-alive connections; see parent.c. */
+
+enum { PARENT_CLOSE, PARENT_KEEP, PARENT_FAILED };
+
+/* A connection to a parent, from parent_connect to parent_release. */
+typedef struct {
+    int fd;                      // -1: not through a parent
+    int index;                   // of the parent
+    unsigned generation;         // of the parent list it came from
+    int reused;                  // a pooled connection (the parent may have closed it just now)
+} parent_conn_t;
+
+void parent_configure ( const char *parents );
+void parent_cleanup ( void );
+int  parent_enabled ( void );
+int  parent_connect ( int timeout, int fresh, parent_conn_t *conn );
+void parent_release ( parent_conn_t *conn, int how );
+
+#endif/*PARENT_H*/
@@ -0,0 +1,448 @@
+/**
+ * Sibling cache peering.
+ *
+ * Proxies listed in `peers` (the `host:port` their peer listeners are on;
+ * the same list, written the same way, on every one of them, each naming
+ * itself in `peer-self`) share their caches. Each URL is owned by one of
+ * them, picked by rendezvous hashing of its cache key: the member whose
+ * address hashes highest with it. So every proxy agrees on the owner, and a
+ * member joining or leaving moves only its own share of the URLs.
+ *
+ * On a local miss for a URL another member owns, that member is asked for
+ * its cached copy: only its cache, never its origin, so queries cannot loop.
+ * A hit is served (and stored here too); a miss, or no answer within
+ * `peer-timeout` milliseconds, goes to the origin as usual. A peer that does
+ * not answer is not asked again for PEER_DOWN_TIME seconds.
+ *
+ * The protocol is a query and an answer on a TCP connection, each a 16-byte
+ * head (a tag, and three lengths in network order) and the bytes it counts:
+ *
+ *     PQRY <url> <fields> <most bytes wanted>   url, request header fields
+ *     PHIT <header> <body> 0                    response header, body
+ *     PMIS 0 0 0
+ *
+ * The fields let the peer pick the variant of a response that varies.
+ * Connections stay open for further queries: each proxy keeps up to
+ * PEER_IDLE idle ones per peer, and serves up to PEER_MAX_CONNS.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "proxy.h" // get_server_socket_address_candidates
+#include "peer.h"
+#include "cache.h"
+#include "hosts.h"
+#include "hash.h"
+#include "error.h"
+#include "io.h"
+
+#define PEER_MAX 32              // members of the peer group
+#define PEER_IDLE 8              // idle connections kept per peer
+#define PEER_MAX_CONNS 64        // peer connections served at a time
+#define PEER_DOWN_TIME 5         // seconds a peer that did not answer is left alone
+#define PEER_IDLE_TIMEOUT 60     // seconds a served connection may wait for a query
+#define PEER_HEAD 16
+
+typedef struct {
+    char addr[256];              // as listed: `host:port`
+    char host[256];
+    char port[16];
+    int idle[PEER_IDLE];         // open connections to it, not in use
+    int n_idle;
+    time_t down_until;
+} peer_t;
+
+static struct {
+    peer_t peers[PEER_MAX];
+    int n_peers;
+    int self;                    // this proxy's index in peers, or -1
+    int timeout;                 // milliseconds
+    unsigned generation;         // bumped when peers change: connections to the old ones are closed
+    int listen_fd;
+    pthread_t listener;
+    int conns[PEER_MAX_CONNS];   // connections being served
+    int n_conns;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t done;         // a served connection ended
+} peer = { .self = -1, .timeout = 100, .listen_fd = -1,
+           .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+static time_t now ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec;
+}
+
+/* `host:port` (or `[v6 address]:port`) into host and port. */
+static int split_addr ( const char *addr, char *host, size_t host_size, char *port, size_t port_size )
+{
+    const char *colon = strrchr ( addr, ':' );
+    if ( colon == NULL || colon[1] == '\0' || strlen ( colon + 1 ) >= port_size ) { return -1; }
+    const char *h = addr;
+    size_t n = colon - addr;
+    if ( n >= 2 && h[0] == '[' && h[n - 1] == ']' ) { h++; n -= 2; }
+    if ( n == 0 || n >= host_size ) { return -1; }
+    memcpy ( host, h, n );
+    host[n] = '\0';
+    strcpy ( port, colon + 1 );
+    return 0;
+}
+
+static void close_idle ( peer_t *p )
+{
+    while ( p->n_idle > 0 ) { close ( p->idle[--p->n_idle] ); }
+}
+
+/* peers: the group, `host:port,host:port`; self: this proxy's entry in it;
+   timeout: milliseconds a peer has to connect, and to answer. */
+void peer_configure ( const char *peers, const char *self, int timeout )
+{
+    char list[1024];
+    snprintf ( list, sizeof(list), "%s", peers );
+
+    pthread_mutex_lock ( &peer.lock );
+    for ( int i = 0; i < peer.n_peers; i++ ) { close_idle ( &peer.peers[i] ); }
+    peer.n_peers = 0;
+    peer.self = -1;
+    peer.generation++;
+    peer.timeout = timeout > 0 ? timeout : 100;
+    char *save;
+    for ( char *addr = strtok_r ( list, ", \t", &save ); addr; addr = strtok_r ( NULL, ", \t", &save ) ) {
+        peer_t *p = &peer.peers[peer.n_peers];
+        if ( peer.n_peers == PEER_MAX || strlen ( addr ) >= sizeof(p->addr) ||
+             split_addr ( addr, p->host, sizeof(p->host), p->port, sizeof(p->port) ) < 0 ) {
+            fprintf ( stderr, "\033[31mfailure:\033[0m add peer %s. ignoring it.\n", addr );
+            continue;
+        }
+        strcpy ( p->addr, addr );
+        p->n_idle = 0;
+        p->down_until = 0;
+        if ( strcmp ( addr, self ) == 0 ) { peer.self = peer.n_peers; }
+        peer.n_peers++;
+    }
+    pthread_mutex_unlock ( &peer.lock );
+}
+
+/* the member that owns a URL with cache key hash (caller holds the lock). */
+static int owner ( uint64_t hash )
+{
+    int best = -1;
+    uint64_t best_score = 0;
+    for ( int i = 0; i < peer.n_peers; i++ ) {
+        const uint64_t score = hash64 ( peer.peers[i].addr, strlen ( peer.peers[i].addr ), hash );
+        if ( best < 0 || score > best_score ) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static void set_timeouts ( int fd, int ms )
+{
+    struct timeval tv = { ms / 1000, ( ms % 1000 ) * 1000 };
+    setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+    setsockopt ( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+}
+
+/* queries are small and answered at once: do not hold them back (Nagle). */
+static void set_nodelay ( int fd )
+{
+    const int on = 1;
+    setsockopt ( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+}
+
+/* a connection to host:port, made within timeout milliseconds, or -1. its
+   addresses are found as an origin's are: a pinned host's (see hosts.c)
+   without a name lookup. */
+static int peer_connect ( char *host, char *port, int timeout )
+{
+    struct addrinfo *cand_ai;
+    hosts_candidates_t pinned;
+    if ( get_server_socket_address_candidates ( &cand_ai, host, port, &pinned ) != 0 ) { return -1; }
+
+    int fd = -1;
+    for ( struct addrinfo *ai = cand_ai; ai; ai = ai->ai_next ) {
+        if ( ( fd = socket ( ai->ai_family, ai->ai_socktype, ai->ai_protocol ) ) < 0 ) { continue; }
+        const int flags = fcntl ( fd, F_GETFL );
+        fcntl ( fd, F_SETFL, flags | O_NONBLOCK );
+        int ok = connect ( fd, ai->ai_addr, ai->ai_addrlen ) == 0;
+        if ( ! ok && errno == EINPROGRESS ) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            int err = 0;
+            socklen_t len = sizeof(err);
+            ok = poll ( &pfd, 1, timeout ) == 1 &&
+                 getsockopt ( fd, SOL_SOCKET, SO_ERROR, &err, &len ) == 0 && err == 0;
+        }
+        if ( ok ) {
+            fcntl ( fd, F_SETFL, flags );
+            break;
+        }
+        close ( fd );
+        fd = -1;
+    }
+    free_server_socket_address_candidates ( cand_ai, &pinned );
+    if ( fd >= 0 ) {
+        set_timeouts ( fd, timeout );
+        set_nodelay ( fd );
+    }
+    return fd;
+}
+
+static void pack_head ( unsigned char *head, const char *tag, size_t a, size_t b, size_t c )
+{
+    const uint32_t n[3] = { htonl ( (uint32_t)a ), htonl ( (uint32_t)b ), htonl ( (uint32_t)c ) };
+    memcpy ( head, tag, 4 );
+    memcpy ( head + 4, n, sizeof(n) );
+}
+
+static uint32_t head_field ( const unsigned char *head, int i )
+{
+    uint32_t n;
+    memcpy ( &n, head + 4 + 4 * i, sizeof(n) );
+    return ntohl ( n );
+}
+
+/* one query on fd. returns 1 (a hit, in *object), 0 (a miss), -1 (the
+   connection failed, and is no use any more), or -2 (it turned out closed:
+   the query could not be written, or the peer hung up without answering). */
+static int query ( int fd, const url_key_t *key, const char *fields, size_t fields_len,
+                   size_t max_size, char **object, size_t *size )
+{
+    unsigned char head[PEER_HEAD];
+    const size_t url_len = strlen ( key->url );
+    pack_head ( head, "PQRY", url_len, fields_len, max_size > UINT32_MAX ? UINT32_MAX : max_size );
+    struct iovec iov[3] = { { head, PEER_HEAD }, { (char *)key->url, url_len }, { (char *)fields, fields_len } };
+    if ( writev_all ( fd, iov, 3 ) < 0 ) { return -2; }
+    const ssize_t got = read_all ( fd, head, PEER_HEAD );
+    if ( got == 0 || ( got < 0 && errno == ECONNRESET ) ) { return -2; }
+    if ( got != PEER_HEAD ) { return -1; }
+    if ( memcmp ( head, "PMIS", 4 ) == 0 ) { return 0; }
+
+    const size_t n = (size_t)head_field ( head, 0 ) + head_field ( head, 1 );
+    if ( memcmp ( head, "PHIT", 4 ) != 0 || n > max_size || ( *object = malloc ( n ? n : 1 ) ) == NULL ) { return -1; }
+    if ( read_all ( fd, *object, n ) != (ssize_t)n ) {
+        free ( *object );
+        return -1;
+    }
+    *size = n;
+    return 1;
+}
+
+/* ask the peer that owns key's URL for its cached response (to a request
+   with these header fields), of at most max_size bytes. returns 1 and a
+   malloc'd copy (free it), or 0: this proxy owns it, or the peer has not
+   got it, or did not answer. */
+int peer_lookup ( const url_key_t *key, const char *fields, size_t fields_len, size_t max_size, char **object, size_t *size )
+{
+    pthread_mutex_lock ( &peer.lock );
+    const int i = owner ( key->hash );
+    if ( i < 0 || i == peer.self || peer.peers[i].down_until > now() ) {
+        pthread_mutex_unlock ( &peer.lock );
+        return 0;
+    }
+    peer_t *p = &peer.peers[i];
+    char addr[sizeof(p->addr)], host[sizeof(p->host)], port[sizeof(p->port)];
+    strcpy ( addr, p->addr );
+    strcpy ( host, p->host );
+    strcpy ( port, p->port );
+    const int timeout = peer.timeout;
+    const unsigned generation = peer.generation;
+    int fd = p->n_idle > 0 ? p->idle[--p->n_idle] : -1;
+    pthread_mutex_unlock ( &peer.lock );
+
+    /* an idle connection the peer has closed in the meantime fails as
+       closed: then the query is made again on a new one. not when it times
+       out, though: the peer is slow, and would be as slow again. */
+    int found = -1;
+    const int pooled = fd >= 0;
+    if ( pooled && ( found = query ( fd, key, fields, fields_len, max_size, object, size ) ) < 0 ) {
+        close ( fd );
+    }
+    if ( ( ! pooled || found == -2 ) && ( fd = peer_connect ( host, port, timeout ) ) >= 0 &&
+         ( found = query ( fd, key, fields, fields_len, max_size, object, size ) ) < 0 ) {
+        close ( fd );
+    }
+
+    pthread_mutex_lock ( &peer.lock );
+    const int same = generation == peer.generation;
+    if ( found < 0 && same ) { p->down_until = now() + PEER_DOWN_TIME; }
+    if ( found >= 0 && same && p->n_idle < PEER_IDLE ) {
+        p->idle[p->n_idle++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock ( &peer.lock );
+
+    if ( found < 0 ) {
+        fprintf ( stderr, "\033[31mfailure:\033[0m ask peer %s. not asking it for %d seconds.\n", addr, PEER_DOWN_TIME );
+        return 0;
+    }
+    if ( fd >= 0 ) { close ( fd ); }
+    if ( found ) { log_debug ( "got %s from peer %s.\n", key->url, addr ); }
+    return found;
+}
+
+/* answer one query for key from the cache. returns -1 if the connection
+   failed (a peer that gave up waiting has closed it: the write fails with
+   EPIPE, as SIGPIPE is ignored; see main). */
+static int answer ( int fd, const url_key_t *key, const char *fields, size_t fields_len, size_t max_size )
+{
+    unsigned char head[PEER_HEAD];
+    cache_entry_t *entry = cache_lookup ( key, fields, fields_len );
+    if ( entry ) {
+        cache_view_t view;
+        int sent = 0, r = 0;
+        if ( cache_entry_open ( entry, NULL, &view ) == 0 ) {
+            if ( view.header_size + view.body_size <= max_size ) {
+                pack_head ( head, "PHIT", view.header_size, view.body_size, 0 );
+                struct iovec iov[3] = { { head, PEER_HEAD }, { (char *)view.header, view.header_size },
+                                        { (char *)view.body, view.body_size } };
+                r = writev_all ( fd, iov, 3 ) < 0 ? -1 : 0;
+                sent = 1;
+            }
+            cache_entry_close ( &view );
+        }
+        cache_release ( entry );
+        if ( sent ) { return r; }
+    }
+    pack_head ( head, "PMIS", 0, 0, 0 );
+    return write_all ( fd, head, PEER_HEAD ) < 0 ? -1 : 0;
+}
+
+/* a served connection has ended. */
+static void drop_conn ( int fd )
+{
+    pthread_mutex_lock ( &peer.lock );
+    for ( int i = 0; i < peer.n_conns; i++ ) {
+        if ( peer.conns[i] == fd ) {
+            peer.conns[i] = peer.conns[--peer.n_conns];
+            break;
+        }
+    }
+    close ( fd );
+    pthread_cond_broadcast ( &peer.done );
+    pthread_mutex_unlock ( &peer.lock );
+}
+
+/* answer a peer's queries, until it hangs up (or is idle too long). */
+static void *serve_conn ( void *arg )
+{
+    const int fd = (int)(intptr_t)arg;
+    unsigned char head[PEER_HEAD];
+    char fields[MAX_LINE];
+    url_key_t key;
+    while ( read_all ( fd, head, PEER_HEAD ) == PEER_HEAD && memcmp ( head, "PQRY", 4 ) == 0 ) {
+        const size_t url_len = head_field ( head, 0 ), fields_len = head_field ( head, 1 );
+        if ( url_len == 0 || url_len >= sizeof(key.url) || fields_len > sizeof(fields) ||
+             read_all ( fd, key.url, url_len ) != (ssize_t)url_len ||
+             read_all ( fd, fields, fields_len ) != (ssize_t)fields_len ) { break; }
+        key.url[url_len] = '\0';
+        key.hash = url_hash ( key.url );
+        if ( answer ( fd, &key, fields, fields_len, head_field ( head, 2 ) ) < 0 ) { break; }
+    }
+    drop_conn ( fd );
+    return NULL;
+}
+
+static void *listen_loop ( void *arg )
+{
+    (void)arg;
+    for ( ;; ) {
+        const int fd = accept ( peer.listen_fd, NULL, NULL );
+        if ( fd < 0 ) {
+            if ( errno == EINTR || errno == ECONNABORTED ) { continue; }
+            if ( errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM ) {
+                usleep ( 100000 );
+                continue;
+            }
+            break; // shut down by peer_cleanup
+        }
+        set_socket_timeout ( fd, PEER_IDLE_TIMEOUT );
+        set_nodelay ( fd );
+
+        pthread_mutex_lock ( &peer.lock );
+        const int refused = peer.stopping || peer.n_conns == PEER_MAX_CONNS;
+        if ( ! refused ) { peer.conns[peer.n_conns++] = fd; }
+        pthread_mutex_unlock ( &peer.lock );
+        if ( refused ) {
+            close ( fd );
+            continue;
+        }
+
+        pthread_t thread_id;
+        if ( pthread_create ( &thread_id, NULL, serve_conn, (void *)(intptr_t)fd ) != 0 ) {
+            drop_conn ( fd );
+            continue;
+        }
+        pthread_detach ( thread_id );
+    }
+    return NULL;
+}
+
+/* listen for peers' queries on self (`host:port`). returns 0, or -1. */
+int peer_start ( const char *self )
+{
+    char host[256], port[16];
+    if ( split_addr ( self, host, sizeof(host), port, sizeof(port) ) < 0 ) { return -1; }
+
+    /* found as the other members find it (a pinned host without a lookup). */
+    struct addrinfo *ai;
+    hosts_candidates_t pinned;
+    if ( get_server_socket_address_candidates ( &ai, host, port, &pinned ) != 0 ) { return -1; }
+    int fd = socket ( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    const int on = 1;
+    if ( fd >= 0 && ( setsockopt ( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) ) < 0 ||
+                      bind ( fd, ai->ai_addr, ai->ai_addrlen ) < 0 || listen ( fd, PEER_MAX_CONNS ) < 0 ) ) {
+        close ( fd );
+        fd = -1;
+    }
+    free_server_socket_address_candidates ( ai, &pinned );
+    if ( fd < 0 ) { return -1; }
+
+    peer.listen_fd = fd;
+    if ( pthread_create ( &peer.listener, NULL, listen_loop, NULL ) != 0 ) {
+        close ( fd );
+        peer.listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* stop serving peers (before the cache is freed), and close all connections. */
+void peer_cleanup ( void )
+{
+    pthread_mutex_lock ( &peer.lock );
+    peer.stopping = 1;
+    pthread_mutex_unlock ( &peer.lock );
+    if ( peer.listen_fd >= 0 ) {
+        shutdown ( peer.listen_fd, SHUT_RDWR );
+        pthread_join ( peer.listener, NULL );
+        close ( peer.listen_fd );
+        peer.listen_fd = -1;
+    }
+
+    pthread_mutex_lock ( &peer.lock );
+    for ( int i = 0; i < peer.n_conns; i++ ) { shutdown ( peer.conns[i], SHUT_RDWR ); }
+    while ( peer.n_conns > 0 ) { pthread_cond_wait ( &peer.done, &peer.lock ); }
+    for ( int i = 0; i < peer.n_peers; i++ ) { close_idle ( &peer.peers[i] ); }
+    peer.n_peers = 0;
+    pthread_mutex_unlock ( &peer.lock );
+}
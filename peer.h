@@ -0,0 +1,17 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <stddef.h>
+
+#include "url.h"
+
+/* Sibling cache peering: on a miss, the sibling proxy that owns the URL is
+   asked for its cached copy before the origin is; see peer.c. */
+
+void peer_configure ( const char *peers, const char *self, int timeout );
+int  peer_start ( const char *self );
+void peer_cleanup ( void );
+int  peer_lookup ( const url_key_t *key, const char *fields, size_t fields_len, size_t max_size,
+                   char **object, size_t *size );
+
+#endif/*PEER_H*/
@@ -9,271 +9,1111 @@
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
 
 /* The source code for the proxy is split across three files (including this one). */
 #include "proxy.h" // proxy
 #include "error.h" // error reporting for ^
 #include "http.h"
 #include "io.h"    // io-related things for ^
+#include "config.h" // runtime configuration
+#include "upgrade.h" // listening-socket handover to a new binary
+#include "cache.h" // response cache
+#include "segment.h" // parallel range fetching of large objects
+#include "tunnel.h" // CONNECT relay
+#include "chunked.h" // chunked response bodies
+#include "response.h" // response header classification
+#include "url.h" // cache keys
+#include "negative.h" // recent origin failures
+#include "health.h" // per-origin circuit breakers
+#include "fetch.h" // per-origin fetch limits
+#include "hedge.h" // hedged requests to slow origins
+#include "route.h" // reverse-proxy routing
+#include "peer.h" // sibling cache peering
+#include "parent.h" // parent-proxy chaining
+#include "hosts.h" // pinned host addresses
+
+// What a client gets when the origin cannot be reached (or failed just now)
+static const char* BAD_GATEWAY = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+// ... and when its circuit is open (see health.c), or it is too busy (see fetch.c)
+static const char* UNAVAILABLE = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+// What a client gets in reverse-proxy mode for a request no route matches
+static const char* NOT_FOUND = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+
+// Initial staging buffer for a cacheable response of unknown length (it grows as needed)
+#define FILL_INITIAL_SIZE (64 * 1024)
+
+// Set by SIGTERM/SIGINT; the accept loop exits and main returns normally.
+static volatile sig_atomic_t stop_requested = 0;
+// Set by SIGHUP; the accept loop reloads the configuration.
+static volatile sig_atomic_t reload_requested = 0;
+// Set once the listening socket was handed over to a new proxy.
+static volatile sig_atomic_t handed_over = 0;
+
+// Self-pipe: written by signal handlers (and the upgrade thread) to wake the accept loop
+static int wake_fds[2] = {-1, -1};
+
+// Client connection, tracked so that shutdown can drain, interrupt and join its worker
+typedef struct conn {
+    pthread_t thread_id;
+    int client_fd;
+    int server_fd; // -1 while not talking to a server
+    int busy; // a request is being served (as opposed to waiting for one)
+    struct conn* next;
+} conn_t;
 
-// Cache entry struct
-typedef struct cache_entry {
-    char* url; // URL as key
-    char* data; // Cached response
-    size_t size; // Response size
-    struct cache_entry* next; // Next entry pointer (like linked list)
-} cache_entry_t;
-
-// Cache struct
+// Active client connections, bounded by the `max_workers` setting
 static struct {
-    cache_entry_t* head; // Latest cache item
-    size_t total_size; // Cache size
-    pthread_rwlock_t lock; // read-write lock
-} cache = {NULL, 0, PTHREAD_RWLOCK_INITIALIZER};
+    int active; // length of `live`
+    conn_t* live; // connections with a running worker
+    conn_t* finished; // workers that exited but were not joined yet
+    pthread_mutex_t lock;
+    pthread_cond_t done; // signalled when a request or worker finishes
+} workers = {0, NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// The connection served by the calling worker thread
+static __thread conn_t* current_conn = NULL;
+
+static void wake_accept_loop() {
+    const int saved_errno = errno;
+    if (write(wake_fds[1], "!", 1) < 0) { /* pipe full: a wakeup is pending anyway */ }
+    errno = saved_errno;
+}
 
-// Thread args struct
-typedef struct {
-    int client_fd;
-} thread_args;
-
-static void cache_init() {
-    pthread_rwlock_init(&cache.lock, NULL);
-}
-
-static void cache_cleanup() {
-    pthread_rwlock_wrlock(&cache.lock);
-
-    cache_entry_t* current = cache.head;
-    while (current != NULL) {
-        cache_entry_t* next = current->next;
-        free(current->url);
-        free(current->data);
-        free(current);
-        current = next;
-    }
-
-    cache.head = NULL;
-    cache.total_size = 0;
-
-    pthread_rwlock_unlock(&cache.lock);
-    pthread_rwlock_destroy(&cache.lock);
-}
-
-// Look up a URL in the cache
-static int cache_lookup(const char* url, char* buffer, size_t* size) {
-    cache_entry_t* entry = cache.head;
-    while (entry) {
-        if (strcmp(entry->url, url) == 0) {
-            if (*size >= entry->size) {
-                memcpy(buffer, entry->data, entry->size);
-                *size = entry->size;
-
-                // If hit is head -> continue
-                cache_entry_t* entry_hit = cache.head;
-                if (strcmp(entry_hit->url, url) == 0) { return 0; }
-
-                // Move cache hit to head of cache
-                cache_entry_t* entry_before_hit = cache.head;
-                entry_hit = entry_hit->next;
-
-                while (entry_hit) {
-                    if (strcmp(entry_hit->url, url) == 0) {
-                        // Is hit
-                        entry_before_hit->next = entry_hit->next; // Skip entry hit in cache
-                        // Move entry hit to front
-                        entry_hit->next = cache.head->next;
-                        cache.head = entry_hit;
-                        return 0;
-                    }
-                    entry_before_hit = entry_hit;
-                    entry_hit = entry_hit->next;
-                }
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+    wake_accept_loop();
+}
 
+static void handle_reload_signal(int sig) {
+    (void)sig;
+    reload_requested = 1;
+    wake_accept_loop();
+}
 
-                cache.head = entry;
+// Block the proxy's signals in the calling thread (and threads it creates),
+// so that they are delivered to the accept loop. Returns the old mask.
+static sigset_t block_proxy_signals() {
+    sigset_t proxy_signals, old_mask;
+    sigemptyset(&proxy_signals);
+    sigaddset(&proxy_signals, SIGTERM);
+    sigaddset(&proxy_signals, SIGINT);
+    sigaddset(&proxy_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &proxy_signals, &old_mask);
+    return old_mask;
+}
 
-                return 0;
-            }
-            return -1;
+// Serve handover requests from a new proxy binary. After one succeeds, this
+// proxy stops accepting and drains (see main).
+static void* upgrade_thread(void* arg) {
+    int* fds = (int*)arg;
+    const int upgrade_fd = fds[0];
+    const int listen_fd = fds[1];
+    free(fds);
+
+    while (!stop_requested) {
+        int conn_fd = accept(upgrade_fd, NULL, NULL);
+        if (conn_fd < 0) {
+            // An interrupted call or a connection that went away is retried at
+            // once; anything else (out of descriptors, say) after a pause rather
+            // than in a busy loop, as in peer.c's listen_loop
+            if (errno != EINTR && errno != ECONNABORTED) { usleep(100000); }
+            continue;
+        }
+
+        char request;
+        if (read_all(conn_fd, &request, 1) != 1 || upgrade_send_listen_fd(conn_fd, listen_fd) < 0) {
+            fprintf(stderr, "\033[31mfailure:\033[0m hand over listening socket. still serving.\n");
+            close(conn_fd);
+            continue;
+        }
+        if (request == 'C' && cache_snapshot_write(conn_fd) < 0) {
+            fprintf(stderr, "\033[31mfailure:\033[0m send cache snapshot. new proxy starts cold.\n");
         }
-        entry = entry->next;
+        close(conn_fd);
+
+        log_info("\033[32msuccess:\033[0m handed over to new proxy. draining.\n");
+        handed_over = 1;
+        stop_requested = 1;
+        wake_accept_loop();
+        break;
     }
-    return -1;
+
+    // NOTE: the socket file now belongs to the new proxy; do not unlink it.
+    close(upgrade_fd);
+    return NULL;
 }
 
-static void cache_insert(const char* url, const char* data, size_t size) {
-    if (size > MAX_OBJECT_SIZE) return;
+static void start_upgrade_thread(const char* path, int listen_fd) {
+    const int upgrade_fd = upgrade_listen(path);
+    if (upgrade_fd < 0) {
+        fprintf(stderr, "\033[31mfailure:\033[0m create upgrade socket %s. upgrades disabled.\n", path);
+        return;
+    }
 
-    pthread_rwlock_wrlock(&cache.lock);
+    int* fds = malloc(2 * sizeof(int));
+    fds[0] = upgrade_fd;
+    fds[1] = listen_fd;
 
-    // Make space by removing older entries
-    while (
-        cache.total_size + size > MAX_CACHE_SIZE
-        && cache.head != NULL
-    ) {
-        cache_entry_t* last = cache.head;
-        cache_entry_t* prev = NULL;
+    sigset_t old_mask = block_proxy_signals();
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, upgrade_thread, fds) != 0) {
+        perror("Failed to create upgrade thread");
+        close(upgrade_fd);
+        free(fds);
+    } else {
+        pthread_detach(thread_id);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
 
-        // Find oldest entry
-        while (last->next != NULL) {
-            prev = last;
-            last = last->next;
-        }
+// Mark the calling worker's connection busy (serving a request) or idle
+static void conn_set_busy(int busy) {
+    if (!current_conn) return;
+    pthread_mutex_lock(&workers.lock);
+    current_conn->busy = busy;
+    if (!busy) pthread_cond_broadcast(&workers.done);
+    pthread_mutex_unlock(&workers.lock);
+}
 
-        // Remove it
-        if (prev) prev->next = NULL;
-        else cache.head = NULL;
+// Record (or, with -1, forget) the server fd of the calling worker's connection
+static void conn_set_server_fd(int server_fd) {
+    if (!current_conn) return;
+    pthread_mutex_lock(&workers.lock);
+    current_conn->server_fd = server_fd;
+    pthread_mutex_unlock(&workers.lock);
+}
+
+// Forget, then close, a server fd (so shutdown never touches a reused fd number)
+static void close_server_fd(int server_fd) {
+    conn_set_server_fd(-1);
+    close(server_fd);
+}
+
+// Join workers that have exited
+static void reap_workers() {
+    pthread_mutex_lock(&workers.lock);
+    conn_t* finished = workers.finished;
+    workers.finished = NULL;
+    pthread_mutex_unlock(&workers.lock);
+
+    while (finished) {
+        conn_t* next = finished->next;
+        pthread_join(finished->thread_id, NULL);
+        free(finished);
+        finished = next;
+    }
+}
+
+// Coordinated shutdown of all connections (the listening socket is closed already):
+// 1. let busy requests finish, up to `timeout` seconds;
+// 2. close idle connections, and interrupt requests that outlived the deadline;
+// 3. join every worker thread.
+// Afterwards no thread but the caller touches the cache.
+static void shutdown_workers(int timeout) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&workers.lock);
+    int busy = 1;
+    while (busy) {
+        busy = 0;
+        for (conn_t* c = workers.live; c; c = c->next) busy += c->busy;
+        if (busy && pthread_cond_timedwait(&workers.done, &workers.lock, &deadline) != 0) { break; }
+    }
+    if (busy > 0) {
+        fprintf(stderr, "\033[31mfailure:\033[0m drain timeout; interrupting %d request(s).\n", busy);
+    } else {
+        log_info("\033[32msuccess:\033[0m drained all requests.\n");
+    }
 
-        cache.total_size -= last->size;
-        free(last->url);
-        free(last->data);
-        free(last);
+    /* `shutdown` (unlike `close`) wakes a thread blocked on the socket. */
+    for (conn_t* c = workers.live; c; c = c->next) {
+        if (c->client_fd >= 0) shutdown(c->client_fd, SHUT_RDWR);
+        if (c->server_fd >= 0) shutdown(c->server_fd, SHUT_RDWR);
+    }
+    fetch_interrupt(); // and requests waiting for a turn at an origin
+    segment_interrupt(); // and the range requests of segmented fetches
+    while (workers.live) {
+        pthread_cond_wait(&workers.done, &workers.lock);
     }
+    pthread_mutex_unlock(&workers.lock);
+
+    reap_workers();
+    log_info("\033[32msuccess:\033[0m joined all workers.\n");
+}
 
-    // Create new entry
-    cache_entry_t* new_entry = malloc(sizeof(cache_entry_t));
-    new_entry->url = strdup(url);
-    new_entry->data = malloc(size);
-    memcpy(new_entry->data, data, size);
-    new_entry->size = size;
+// Re-read the configuration and apply what can change without a restart
+static void reload_config(int listen_fd) {
+    if (config_reload() < 0) {
+        fprintf(stderr, "\033[31mfailure:\033[0m reload configuration. keeping the old one.\n");
+        return;
+    }
 
-    // Add to front of list
-    new_entry->next = cache.head;
-    cache.head = new_entry;
+    struct proxy_config cfg;
+    config_get(&cfg);
+    if (route_load(cfg.routes) < 0) {
+        fprintf(stderr, "\033[31mfailure:\033[0m reload routes. keeping the old ones.\n");
+    }
+    if (hosts_load(cfg.hosts_file) < 0) {
+        fprintf(stderr, "\033[31mfailure:\033[0m reload hosts file. keeping the old one.\n");
+    }
+    cache_configure(cfg.max_cache_size, cfg.max_object_size, cfg.cache_policy,
+                    cfg.cache_compress_types, cfg.cache_gzip_types);
+    negative_configure(cfg.negative_dns_ttl, cfg.negative_connect_ttl, cfg.negative_status_ttl);
+    health_configure(cfg.circuit_error_rate, cfg.circuit_min_requests, cfg.circuit_open_time,
+                     cfg.circuit_probes, cfg.circuit_slow_time);
+    fetch_configure(cfg.origin_max_fetches, cfg.max_fetches, cfg.fetch_queue_length, cfg.fetch_queue_timeout);
+    hedge_configure(cfg.hedge_percentile, cfg.hedge_budget, cfg.hedge_min_delay);
+    peer_configure(cfg.peers, cfg.peer_self, cfg.peer_timeout);
+    parent_configure(cfg.parents);
+
+    // Calling `listen` again on a listening socket only updates the backlog
+    if (listen(listen_fd, cfg.listen_backlog) < 0) {
+        fprintf(stderr, "\033[31mfailure:\033[0m update listen backlog. ignoring that.\n");
+    }
 
-    cache.total_size += size;
+    // Wake an accept loop waiting for a worker slot, in case max_workers grew
+    pthread_cond_broadcast(&workers.done);
 
-    pthread_rwlock_unlock(&cache.lock);
+    log_info("\033[32msuccess:\033[0m reloaded configuration.\n");
 }
 
 int main ( int argc, char **argv )
 {
-    /* Check command line args for presence of a port number. */
-    if ( error_args_fatal ( argc, argv ) ) { exit(1); }
+    /* Check command line args (and config file) for the port number and tunables. */
+    if ( error_args_fatal ( config_init ( argc, argv ), argv ) ) { exit(1); }
 
-    // Initialize cache
-    cache_init();
-    atexit(cache_cleanup);
+    struct proxy_config cfg;
+    config_get(&cfg);
+
+    /* A peer that went away (a client giving up, a connection `shutdown` by
+       the drain) must fail the write to it with EPIPE, not kill the process.
+       Set before any thread starts, so every thread inherits it. */
+    signal(SIGPIPE, SIG_IGN);
+
+    // Reverse-proxy mode, if there are routes
+    if (route_load(cfg.routes) < 0) { return 1; }
+    // Hosts pinned to fixed addresses, if any
+    if (hosts_load(cfg.hosts_file) < 0) { return 1; }
 
-    /* Create a `socket`, `bind` it to listen address, configure it to `listen` (for connection requests). */
-    const int listen_fd = create_listen_fd(atoi(argv[1]));
+    // Initialize cache
+    cache_init(cfg.cache_shards);
+    cache_configure(cfg.max_cache_size, cfg.max_object_size, cfg.cache_policy,
+                    cfg.cache_compress_types, cfg.cache_gzip_types);
+    negative_configure(cfg.negative_dns_ttl, cfg.negative_connect_ttl, cfg.negative_status_ttl);
+    health_configure(cfg.circuit_error_rate, cfg.circuit_min_requests, cfg.circuit_open_time,
+                     cfg.circuit_probes, cfg.circuit_slow_time);
+    fetch_configure(cfg.origin_max_fetches, cfg.max_fetches, cfg.fetch_queue_length, cfg.fetch_queue_timeout);
+    hedge_configure(cfg.hedge_percentile, cfg.hedge_budget, cfg.hedge_min_delay);
+    peer_configure(cfg.peers, cfg.peer_self, cfg.peer_timeout);
+    parent_configure(cfg.parents);
+
+    int listen_fd = -1;
+    if (cfg.upgrade) {
+        /* Take over the listening socket (and cache) of the running proxy. */
+        int conn_fd;
+        listen_fd = upgrade_takeover(cfg.upgrade_socket, cfg.upgrade_cache, &conn_fd);
+        if (listen_fd >= 0) {
+            if (cfg.upgrade_cache) {
+                const int count = cache_snapshot_read(conn_fd);
+                if (count < 0) { fprintf(stderr, "\033[31mfailure:\033[0m read cache snapshot. keeping what arrived.\n"); }
+                else { log_info("\033[32msuccess:\033[0m took over %d cache entries.\n", count); }
+            }
+            close(conn_fd);
+        }
+    }
+    if (listen_fd < 0) {
+        /* Create a `socket`, `bind` it to listen address, configure it to `listen` (for connection requests). */
+        listen_fd = create_listen_fd(cfg.port, cfg.listen_backlog);
+    }
     if (listen_fd < 0) {
         fprintf(stderr, "Failed to create listening socket\n");
         return 1;
     }
 
+    /* The listening socket may be shared with another proxy during an upgrade,
+       so a connection we were woken for may be gone by the time we `accept`. */
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    if (pipe(wake_fds) < 0) { perror("pipe"); return 1; }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+
+    if (cfg.upgrade_socket[0]) { start_upgrade_thread(cfg.upgrade_socket, listen_fd); }
+    if (cfg.peer_self[0]) {
+        sigset_t old_mask = block_proxy_signals();
+        if (peer_start(cfg.peer_self) < 0) {
+            fprintf(stderr, "\033[31mfailure:\033[0m listen for peers on %s. not serving them.\n", cfg.peer_self);
+        }
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
+
+    /* Stop on SIGTERM/SIGINT, reload on SIGHUP. The handlers wake the accept
+       loop below through the self-pipe, and it acts on the flags.
+       NOTE: returning from main (instead of dying on the signal) runs the exit
+       handlers, e.g. the ones writing profile data in `make pgo` builds. */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = handle_reload_signal;
+    sigaction(SIGHUP, &sa, NULL);
+
     /* Handle connection requests. */
-    while ( 1 ) {
+    while ( ! stop_requested ) {
+        if ( reload_requested ) {
+            reload_requested = 0;
+            reload_config ( listen_fd );
+        }
         handle_connection_request ( listen_fd );
     }
+
+    /* Stop accepting. (After a handover, the new proxy accepts from now on.) */
+    close(listen_fd);
+
+    /* A second SIGTERM/SIGINT does not wait for the drain. */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+
+    config_get(&cfg);
+    shutdown_workers(cfg.drain_timeout);
+
+    /* Only now that every worker (and peer connection) is done is it safe to free the cache. */
+    peer_cleanup();
+    cache_cleanup();
+    negative_cleanup();
+    health_cleanup();
+    fetch_cleanup();
+    route_cleanup();
+    parent_cleanup();
+    hosts_cleanup();
+
+    return 0;
 }
 
 void* handle_request_thread(void* arg) {
-    pthread_detach(pthread_self());
-
-    thread_args* args = (thread_args*)arg;
-    int client_fd = args->client_fd;
-    free(args);
+    conn_t* conn = (conn_t*)arg;
+    current_conn = conn;
+    int client_fd = conn->client_fd;
 
     handle_request(client_fd);
-    close(client_fd);
 
+    // Move to the finished list (the accept loop joins us), then close
+    pthread_mutex_lock(&workers.lock);
+    conn_t** link = &workers.live;
+    while (*link != conn) link = &(*link)->next;
+    *link = conn->next;
+    conn->next = workers.finished;
+    workers.finished = conn;
+    conn->client_fd = -1;
+    workers.active--;
+    pthread_cond_broadcast(&workers.done);
+    pthread_mutex_unlock(&workers.lock);
+
+    close(client_fd);
     return NULL;
 }
 
 void handle_connection_request(int listen_fd)
 {
-    printf("\e[1mawaiting connection request...\e[0m\n");
+    struct proxy_config cfg;
+    config_get(&cfg);
+
+    reap_workers();
+
+    /* Wait for a free worker slot (if limited). Connections arriving meanwhile
+       queue up in the listen backlog. Time out now and then to notice signals. */
+    pthread_mutex_lock(&workers.lock);
+    while (cfg.max_workers > 0 && workers.active >= cfg.max_workers && !stop_requested && !reload_requested) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&workers.done, &workers.lock, &deadline);
+    }
+    int full = cfg.max_workers > 0 && workers.active >= cfg.max_workers;
+    pthread_mutex_unlock(&workers.lock);
+    if (full) { return; }
+
+    log_info("\e[1mawaiting connection request...\e[0m\n");
+
+    /* Wait for a connection request, or a wakeup (signal, upgrade) on the self-pipe.
+       https://man7.org/linux/man-pages/man2/poll.2.html (a system call) */
+    struct pollfd pfds[2] = { { .fd = listen_fd, .events = POLLIN }, { .fd = wake_fds[0], .events = POLLIN } };
+    if (poll(pfds, 2, -1) < 0 || pfds[1].revents) {
+        char drain[64];
+        while (read(wake_fds[0], drain, sizeof(drain)) > 0) { /* empty the pipe */ }
+        return;
+    }
 
     /* "Kernel, give me the fd of a connected socket for the next connection request."
-       NOTE: this blocks the proxy until a connection arrives.
+       NOTE: listen_fd is non-blocking; EAGAIN means another proxy took it first.
        https://man7.org/linux/man-pages/man2/accept.2.html (a system call) */
     const int client_fd = accept(listen_fd, NULL, NULL);
     if (error_accept_fatal(client_fd)) { exit(1); }
     if (error_accept(client_fd)) { return; }
 
-    // Create thread args and spawn new thread
-    thread_args* args = malloc(sizeof(thread_args));
-    args->client_fd = client_fd;
-    pthread_t thread_id;
-    if (pthread_create(&thread_id, NULL, handle_request_thread, args) != 0) {
+    if (cfg.client_timeout > 0 && set_socket_timeout(client_fd, cfg.client_timeout) < 0) {
+        error_socket_option(-1);
+    }
+
+    // Register the connection and spawn its worker thread
+    conn_t* conn = malloc(sizeof(conn_t));
+    conn->client_fd = client_fd;
+    conn->server_fd = -1;
+    conn->busy = 0;
+
+    // Workers inherit a mask blocking our signals, so those reach the accept loop.
+    sigset_t old_mask = block_proxy_signals();
+
+    // Hold the lock across creation, so the worker cannot unregister before it is registered
+    pthread_mutex_lock(&workers.lock);
+    int return_cd = pthread_create(&conn->thread_id, NULL, handle_request_thread, conn);
+    if (return_cd == 0) {
+        conn->next = workers.live;
+        workers.live = conn;
+        workers.active++;
+    }
+    pthread_mutex_unlock(&workers.lock);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (return_cd != 0) {
         perror("Failed to create thread");
         close(client_fd);
-        free(args);
+        free(conn);
         return;
     }
 
-    printf("\e[1mspawned new thread for request.\e[0m\n");
+    log_info("\e[1mspawned new thread for request.\e[0m\n");
 }
 
-void handle_request(int client_fd) {
-    char buf[MAX_LINE];
-    char method[32], uri[MAX_LINE], version[32];
-    char hostname[MAX_LINE], path[MAX_LINE], port[16];
-    char request_hdr[MAX_LINE];
+/* make room for `need` staged bytes, growing the buffer (doubling) up to
+   `limit`. returns 0 if that is not possible. */
+static int stage_reserve(char** buffer, size_t* allocated, size_t need, size_t limit) {
+    if (need <= *allocated) return 1;
+    if (need > limit) return 0;
+    size_t size = *allocated * 2 > need ? *allocated * 2 : need;
+    if (size > limit) size = limit;
+    char* grown = realloc(*buffer, size);
+    if (grown == NULL) return 0;
+    *buffer = grown;
+    *allocated = size;
+    return 1;
+}
 
-    /* read HTTP Request-line */
-    ssize_t num_bytes = read_line(client_fd, buf);
-    if ( error_read ( num_bytes ) ) { return; }
+/* May a request go to hostname:port? Not if it failed a moment ago (see
+   negative.c; checked first, so that requests that never reach the origin
+   are not counted against its circuit), nor while its circuit is open (see
+   health.c). Returns 1 (report the outcome on the ticket), or 0 (the client
+   has its answer). Through a parent, only the circuit counts. */
+static int admit_origin(int client_fd, const char* hostname, const char* port, int via_parent, health_ticket_t* ticket) {
+    if (!via_parent && negative_origin(hostname, port) != NEGATIVE_NONE) {
+        log_debug("%s:%s failed recently. not trying again yet.\n", hostname, port);
+        write_all(client_fd, (char*)BAD_GATEWAY, strlen(BAD_GATEWAY));
+        return 0;
+    }
+    if (health_acquire(hostname, port, ticket) == HEALTH_REJECT) {
+        write_all(client_fd, (char*)UNAVAILABLE, strlen(UNAVAILABLE));
+        return 0;
+    }
+    return 1;
+}
 
-    // Parse request line
-    sscanf(buf, "%s %s %s", method, uri, version);
+/* is `port` in the comma-separated list (or is the list `*`)? */
+static int port_allowed(const char* list, const char* port) {
+    size_t n = strlen(port);
+    for (const char* p = list; *p; ) {
+        while (*p == ' ' || *p == ',') p++;
+        const char* end = p;
+        while (*end && *end != ',' && *end != ' ') end++;
+        if ((end - p == 1 && *p == '*') || ((size_t)(end - p) == n && strncmp(p, port, n) == 0)) return 1;
+        p = end;
+    }
+    return 0;
+}
 
-    /* Ignore non-GET requests (your proxy is only tested on GET requests). */
-    if ( error_non_get ( method ) ) { return; }
+/* A tunnel to hostname:port through a parent proxy (its own CONNECT). Bytes
+   of the tunnel that came with the parent's answer are put in early. The
+   tunnel uses its connection up, so it takes a new one: a pooled one could
+   be closed by the parent as the CONNECT goes out. */
+static int connect_via_parent(char* hostname, char* port, const struct proxy_config* cfg,
+                              char* early, size_t early_size, size_t* early_len) {
+    parent_conn_t parent;
+    if (parent_connect(cfg->server_timeout, 1, &parent) < 0) { return -1; }
+
+    char request[2 * MAX_LINE];
+    const char* fmt = strchr(hostname, ':') ? "CONNECT [%s]:%s HTTP/1.1\r\nHost: [%s]:%s\r\n\r\n"
+                                            : "CONNECT %s:%s HTTP/1.1\r\nHost: %s:%s\r\n\r\n";
+    snprintf(request, sizeof(request), fmt, hostname, port, hostname, port);
+    char head[MAX_LINE];
+    size_t head_len = 0;
+    ssize_t num_bytes;
+    response_t resp;
+    response_init(&resp);
+    int parsed = 0;
+    if (write_all(parent.fd, request, strlen(request)) >= 0) {
+        while (parsed == 0 && head_len < sizeof(head) &&
+               (num_bytes = read(parent.fd, head + head_len, sizeof(head) - head_len)) > 0) {
+            head_len += num_bytes;
+            parsed = response_parse(&resp, head, head_len);
+        }
+    }
+    if (parsed != 1 || resp.status / 100 != 2 || head_len - resp.header_size > early_size) {
+        if (parsed == 1) { log_info("parent refused CONNECT to %s:%s (%d).\n", hostname, port, resp.status); }
+        parent_release(&parent, head_len == 0 ? PARENT_FAILED : PARENT_CLOSE);
+        return -1;
+    }
+    *early_len = head_len - resp.header_size;
+    memcpy(early, head + resp.header_size, *early_len);
+    return parent.fd;
+}
 
-    // Check cache first
-    size_t response_size = MAX_OBJECT_SIZE;
-    char response_buffer[MAX_OBJECT_SIZE];
-    if (cache_lookup(uri, response_buffer, &response_size) == 0) {
-        // Cache hit - send directly to client
-        write(client_fd, response_buffer, response_size);
+/* CONNECT host:port: open a tunnel to the origin and relay bytes both ways. */
+static void handle_connect(int client_fd, http_request_t* req, const struct proxy_config* cfg) {
+    static const char* ESTABLISHED = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    static const char* FORBIDDEN   = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
+    char hostname[MAX_LINE], port[16];
+
+    /* the request target is an authority: `host:port`, or `[v6 address]:port`. */
+    char* host = req->uri;
+    char* colon = strrchr(host, ':');
+    if (host[0] == '[') {
+        char* bracket = strchr(host, ']');
+        if (bracket == NULL || colon < bracket) colon = NULL;
+        else { host++; *bracket = '\0'; }
+    }
+    if (colon == NULL || strlen(colon + 1) >= sizeof(port) || !port_allowed(cfg->connect_ports, colon + 1)) {
+        fprintf(stderr, "\033[31mfailure:\033[0m CONNECT to %s not allowed.\n", req->uri);
+        write_all(client_fd, (char*)FORBIDDEN, strlen(FORBIDDEN));
+        return;
+    }
+    *colon = '\0';
+    strcpy(hostname, host);
+    strcpy(port, colon + 1);
+
+    const int via_parent = parent_enabled();
+    health_ticket_t ticket;
+    if (!admit_origin(client_fd, hostname, port, via_parent, &ticket)) { return; }
+    char early[MAX_LINE]; // tunnel bytes a parent sent along with its answer
+    size_t early_len = 0;
+    const int server_fd = via_parent ? connect_via_parent(hostname, port, cfg, early, sizeof(early), &early_len)
+                                     : create_server_fd(hostname, port, cfg->server_timeout);
+    health_report(hostname, port, &ticket, server_fd >= 0);
+    if ( error_socket_server ( server_fd ) ) {
+        write_all(client_fd, (char*)BAD_GATEWAY, strlen(BAD_GATEWAY));
         return;
     }
+    conn_set_server_fd(server_fd);
+
+    if (write_all(client_fd, (char*)ESTABLISHED, strlen(ESTABLISHED)) >= 0 &&
+        write_all(client_fd, early, early_len) >= 0) {
+        static const char* reasons[] = { [TUNNEL_CLOSED] = "closed", [TUNNEL_IDLE] = "idle", [TUNNEL_ERROR] = "error" };
+        tunnel_stats_t stats;
+        const int result = tunnel_relay(client_fd, server_fd, cfg->tunnel_idle_timeout, &stats);
+        log_info("tunnel to %s:%s %s: %zu bytes up, %zu bytes down.\n",
+                 hostname, port, reasons[result], stats.up, stats.down);
+    }
+    close_server_fd(server_fd);
+}
 
-    // Cache miss - need to fetch from server
-    // Parse URI to get hostname, path, and port
-    parse_uri(uri, hostname, path, port);
+/* answer a deferred (Range, conditional) request from the complete response just fetched. */
+static void respond_fetched(int client_fd, http_request_t* req, const char* object, size_t size) {
+    const size_t hlen = http_header_length(object, size);
+    http_respond_cached(client_fd, req, object, hlen, object + hlen, size - hlen);
+}
 
-    /* Set the request header */
-    const int return_cd = set_request_header ( request_hdr, hostname, path, port, client_fd );
-    if ( error_header ( return_cd ) ) { return; }
+/* Where a request goes: the origin in its URI or, in reverse-proxy mode, a
+   server of the pool it was routed to, picked now (only requests that go
+   upstream are balanced). (The path is the URI's either way.) */
+static void request_origin(http_request_t* req, route_t* route, char* hostname, char* path, char* port) {
+    parse_uri(req->uri, hostname, path, port);
+    if (route->table) {
+        const route_backend_t* backend = route_balance(route);
+        strcpy(hostname, backend->host);
+        strcpy(port, backend->port);
+    }
+}
 
-    /* Create the server fd. */
-    const int server_fd = create_server_fd(hostname, port);
-    if ( error_socket_server ( server_fd ) ) { return; }
+/* Route a request in reverse-proxy mode. A target in origin form (a path) is
+   made absolute with the Host field, so that it is cached per virtual host.
+   Its cache key also picks the server in `hash` pools. */
+static int route_request(http_request_t* req, const struct proxy_config* cfg, route_t* route) {
+    char hostname[MAX_LINE], path[MAX_LINE], port[16];
+    if (req->uri[0] == '/') {
+        char host[MAX_LINE], uri[MAX_LINE];
+        if (!http_get_field(req->fields, req->fields_len, "Host", host, sizeof(host)) || host[0] == '\0' ||
+            snprintf(uri, sizeof(uri), "http://%s%s", host, req->uri) >= (int)sizeof(uri)) {
+            return -1;
+        }
+        strcpy(req->uri, uri);
+    }
+    parse_uri(req->uri, hostname, path, port);
+    url_key_t key;
+    url_key(&key, req->uri, cfg);
+    return route_pick(hostname, path, key.hash, route);
+}
+
+/* POST, PUT, PATCH and DELETE: stream the request body to the origin and
+   the response back, storing neither. The cached copy of the URL is stale now. */
+static void forward_uncached(int client_fd, http_request_t* req, const struct proxy_config* cfg, route_t* route) {
+    char buf[MAX_LINE];
+    char hostname[MAX_LINE], path[MAX_LINE], port[16];
+    char request_hdr[2 * MAX_LINE];
+    ssize_t num_bytes;
+
+    url_key_t key;
+    url_key(&key, req->uri, cfg);
+    cache_invalidate(&key);
+    request_origin(req, route, hostname, path, port);
+
+    // The response is relayed up to EOF, so even a parent's connection is not kept
+    // (nor is a pooled one taken: a request with a body cannot be sent again)
+    const int via_parent = parent_enabled();
+    const int return_cd = via_parent
+        ? set_parent_request_header ( request_hdr, sizeof(request_hdr), req, hostname, path, port, 0, 0 )
+        : set_request_header ( request_hdr, sizeof(request_hdr), req, hostname, path, port, 0 );
+    if ( error_header ( return_cd ) ) { return; }
 
-    // Send request to server
-    if (write_all(server_fd, request_hdr, strlen(request_hdr)) < 0) {
-        close(server_fd);
+    health_ticket_t ticket;
+    if (!admit_origin(client_fd, hostname, port, via_parent, &ticket)) { return; }
+    parent_conn_t parent;
+    const int server_fd = via_parent ? parent_connect(cfg->server_timeout, 1, &parent)
+                                     : create_server_fd(hostname, port, cfg->server_timeout);
+    if ( error_socket_server ( server_fd ) ) {
+        health_report(hostname, port, &ticket, 0);
+        write_all(client_fd, (char*)BAD_GATEWAY, strlen(BAD_GATEWAY));
+        return;
+    }
+    conn_set_server_fd(server_fd);
+
+    // Only the server's side failing counts against the origin: a client that
+    // goes away (or sends a malformed body) says nothing about it
+    const int relayed = write_all(server_fd, request_hdr, strlen(request_hdr)) < 0
+        ? -1 : http_relay_body(client_fd, server_fd, req);
+    if (relayed <= 0) {
+        if (relayed < 0) { health_report(hostname, port, &ticket, 0); }
+        else { health_cancel(hostname, port, &ticket); }
+        close_server_fd(server_fd);
         return;
     }
 
-    // Read server response and store for caching
-    size_t total_size = 0;
+    // The origin's health is judged on the first bytes of its response (a 5xx is a failure)
+    int reported = 0;
     while ((num_bytes = read(server_fd, buf, MAX_LINE)) > 0) {
-        // Forward data to client
-        if (write_all(client_fd, buf, num_bytes) < 0) {
+        if (!reported) {
+            const int status = http_response_status(buf, num_bytes);
+            health_report(hostname, port, &ticket, status > 0 && status < 500);
+            reported = 1;
+        }
+        if (write_all(client_fd, buf, num_bytes) < 0) { break; }
+    }
+    if (!reported) { health_report(hostname, port, &ticket, 0); }
+    close_server_fd(server_fd);
+}
+
+/* milliseconds on the monotonic clock */
+static long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* A GET the origin has not answered within its usual time (see hedge.c) is
+   sent again on a second connection. Returns the connection that answers
+   first (the calling worker's server fd), having closed the other. */
+static int hedge_request(int server_fd, char* hostname, char* port, const char* request_hdr, int timeout) {
+    const long delay = hedge_delay(hostname, port);
+    struct pollfd fds[2] = { { server_fd, POLLIN, 0 }, { -1, POLLOUT, 0 } };
+    if (delay < 0 || poll(fds, 1, delay) != 0 || !hedge_take()) { return server_fd; }
+
+    int hedge_fd = create_hedge_fd(hostname, port, timeout, server_fd);
+    if (hedge_fd < 0) { return server_fd; }
+    log_debug("no answer from %s:%s in %ldms. hedging.\n", hostname, port, delay);
+
+    /* Both connections are watched while the hedge connects (POLLOUT), then
+       while it waits for its answer (POLLIN). A hedge that fails at either
+       is dropped, and the first connection waited for alone. The first
+       connection wins a tie, and when neither answers in time (its read
+       then fails as usual). */
+    fds[1].fd = hedge_fd;
+    const long long end = timeout > 0 ? monotonic_ms() + timeout * 1000LL : -1;
+    while (1) {
+        const int wait = end < 0 ? -1 : end > monotonic_ms() ? (int)(end - monotonic_ms()) : 0;
+        const int ready = poll(fds, hedge_fd >= 0 ? 2 : 1, wait);
+        if (ready < 0 && errno == EINTR) { continue; }
+        if (ready <= 0 || fds[0].revents) { break; }
+
+        int ok;
+        char byte;
+        if (fds[1].events == POLLOUT) {
+            // Connected (or not): in blocking mode again, it is sent the request
+            int err = 0;
+            socklen_t len = sizeof(err);
+            ok = getsockopt(hedge_fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0 &&
+                 fcntl(hedge_fd, F_SETFL, fcntl(hedge_fd, F_GETFL) & ~O_NONBLOCK) == 0 &&
+                 write_all(hedge_fd, (char*)request_hdr, strlen(request_hdr)) >= 0;
+            fds[1].events = POLLIN;
+        } else if ((ok = recv(hedge_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0)) {
+            // Readable, and not just because it was reset or closed: it answered
+            log_debug("hedge to %s:%s answered first.\n", hostname, port);
+            conn_set_server_fd(hedge_fd);
             close(server_fd);
-            return;
+            return hedge_fd;
+        }
+        if (!ok) {
+            log_debug("hedge to %s:%s failed. waiting for the first connection.\n", hostname, port);
+            close(hedge_fd);
+            hedge_fd = -1;
         }
+    }
+    if (hedge_fd >= 0) { close(hedge_fd); }
+    return server_fd;
+}
+
+/* Done with a fetch's server connection: a parent's (if parent is given) goes
+   back to it, `how` as for parent_release; any other is closed. */
+static void release_server_fd(int server_fd, parent_conn_t* parent, int how) {
+    conn_set_server_fd(-1);
+    if (parent) { parent_release(parent, how); }
+    else { close(server_fd); }
+}
+
+/* Fetch a GET (or HEAD) miss from the origin, relaying it to the client and
+   storing it if it can be cached. Returns 1 if a deferred request must be
+   sent again as the client made it (its 200 turns out not to be storable,
+   so no answer can be cut from it: the origin is to answer the Range or
+   validators itself), having sent the client nothing; else 0. */
+static int fetch_origin(int client_fd, http_request_t* req, const struct proxy_config* cfg, const url_key_t* key,
+                        char* hostname, char* path, char* port, char* request_hdr, int deferred, int via_parent) {
+    char buf[MAX_LINE], value[MAX_LINE];
+    ssize_t num_bytes;
+    const int is_head = strcasecmp(req->method, "HEAD") == 0;
+
+    /* An origin that just failed, or whose circuit is open, is not tried: nothing cached could answer. */
+    health_ticket_t ticket;
+    if (!admit_origin(client_fd, hostname, port, via_parent, &ticket)) { return 0; }
+
+    parent_conn_t parent;
+    int server_fd;
+    char head[2 * MAX_LINE];
+    size_t head_len;
+    response_t resp;
+    int parsed;
+    /* A pooled connection to a parent may have been closed by it just before
+       the request got there: no fault of the parent's. The request (a GET or
+       HEAD) is then sent once more, on a new connection. */
+    for (int fresh = 0; ; fresh = 1) {
+        /* Create the server fd: to the origin, or to a parent proxy (see parent.c). */
+        server_fd = via_parent ? parent_connect(cfg->server_timeout, fresh, &parent)
+                               : create_server_fd(hostname, port, cfg->server_timeout);
+        if ( error_socket_server ( server_fd ) ) {
+            health_report(hostname, port, &ticket, 0);
+            write_all(client_fd, (char*)BAD_GATEWAY, strlen(BAD_GATEWAY));
+            return 0;
+        }
+        conn_set_server_fd(server_fd);
+
+        // Send request to server
+        // (A parent proxy makes its own connections to the origin: they are its to hedge)
+        const int sent = write_all(server_fd, request_hdr, strlen(request_hdr)) >= 0;
+        if (sent && !is_head && !via_parent) {
+            server_fd = hedge_request(server_fd, hostname, port, request_hdr, cfg->server_timeout);
+        }
+
+        /* Read the response header, classifying it as it arrives. */
+        head_len = 0;
+        response_init(&resp);
+        parsed = 0;
+        while (sent && parsed == 0 && head_len < sizeof(head) &&
+               (num_bytes = read(server_fd, head + head_len, sizeof(head) - head_len)) > 0) {
+            head_len += num_bytes;
+            parsed = response_parse(&resp, head, head_len);
+        }
+        if (!via_parent || !parent.reused || head_len > 0) { break; }
+        log_debug("pooled connection to parent closed. asking again on a new one.\n");
+        release_server_fd(server_fd, &parent, PARENT_CLOSE);
+    }
+    // The origin answered (or not) in time: that is what its circuit is judged on
+    health_report(hostname, port, &ticket, parsed == 1 && resp.status < 500);
+    if (head_len == 0) {
+        write_all(client_fd, (char*)BAD_GATEWAY, strlen(BAD_GATEWAY));
+        release_server_fd(server_fd, via_parent ? &parent : NULL, PARENT_FAILED);
+        return 0;
+    }
+    // The parent asked to keep its connection to us; that is not the client's to see (or store)
+    if (via_parent && parsed == 1) {
+        resp.header_size = http_strip_hop_fields(head, resp.header_size, &head_len, sizeof(head));
+    }
+
+    int forwarding = !deferred;
+    const int authorized = http_get_field(req->fields, req->fields_len, "Authorization", value, sizeof(value));
+    int store = !is_head && parsed == 1 && resp.status < 400 && resp.transfer_coding >= 0 &&
+        response_cacheable(&resp, authorized);
+    // An error (status >= 400) is never stored: a small one is staged all the
+    // same, and remembered for negative_status_ttl seconds instead
+    const int remember = !is_head && cfg->negative_status_ttl > 0 && parsed == 1 &&
+        resp.status >= 400 && resp.transfer_coding == 0 && !resp.no_store && !resp.set_cookie &&
+        !authorized && resp.content_length >= 0 &&
+        resp.header_size + resp.content_length <= NEGATIVE_MAX_RESPONSE;
+    if (remember) { store = 1; }
+
+    /* Large objects from segment hosts are fetched as parallel range requests.
+       That is decided on the response header; otherwise it is relayed as usual.
+       (Requests to them are never deferred: see serve_cacheable.) */
+    if (parsed == 1 && !is_head && !deferred && !via_parent && segment_wanted(cfg, hostname)) {
+        segment_origin_t origin = { req, hostname, path, port, cfg->server_timeout };
+        char* object;
+        size_t object_size;
+        // Streamed to the client, and kept (for the cache) only if the cache takes it
+        const int fetched = segment_fetch(cfg, &origin, server_fd, head, head_len, client_fd,
+                                          store ? cfg->max_object_size : 0, &object, &object_size);
+        if (fetched != 0) {
+            if (fetched > 0 && object) {
+                cache_insert(key, req->fields, req->fields_len, object, object_size);
+                free(object);
+            }
+            close_server_fd(server_fd);
+            return 0;
+        }
+    }
+
+    /* Stage a cacheable response: with a Content-Length, in a buffer of
+       exactly its size; otherwise in one that grows up to the object limit.
+       A chunked body is staged decoded, CHUNKED_HEADER_SLACK bytes after its
+       header, so the header can be given a Content-Length when it is stored. */
+    const int chunked = store && resp.transfer_coding == 1;
+    const size_t body_start = resp.header_size + (chunked ? CHUNKED_HEADER_SLACK : 0);
+    size_t capacity = cfg->max_object_size;
+    if (store && !chunked && resp.content_length >= 0) { capacity = resp.header_size + resp.content_length; }
+    if (body_start > cfg->max_object_size || capacity > cfg->max_object_size) { store = 0; }
+
+    char* response_buffer = NULL;
+    size_t allocated = 0;
+    if (store) {
+        allocated = capacity == cfg->max_object_size && body_start + FILL_INITIAL_SIZE < capacity
+                  ? body_start + FILL_INITIAL_SIZE : capacity;
+        response_buffer = malloc(allocated);
+        if (response_buffer == NULL) { store = 0; }
+        else { memcpy(response_buffer, head, resp.header_size); }
+    }
+    // Not stored, so a deferred answer cannot be cut from it: a 200 is asked for
+    // again as the client made it, anything else (an error, say) is sent as it is
+    int pass = !store && !forwarding && parsed == 1 && resp.status == 200;
+    if (!store) { forwarding = 1; }
+
+    size_t total_size = body_start; // bytes staged
+    int too_large = !store;         // (or otherwise not staged)
+    chunked_t decoder;
+    if (chunked) { chunked_init(&decoder); }
+    int body_done = 0;       // the chunked body has ended
+    int forward_decoded = 0; // forwarding decoded body bytes, not what the server sent
+    // Bytes of body still to come, if the header says (-1: up to EOF)
+    long long body_left = -1;
+    if (is_head || resp.status == 204 || resp.status == 304) { body_left = 0; }
+    else if (parsed == 1 && resp.transfer_coding == 0) { body_left = resp.content_length; }
+
+    // The head goes out as it came; the body bytes read along with it come first in the loop
+    if (!pass && forwarding && write_all(client_fd, head, head_len) < 0) {
+        free(response_buffer);
+        release_server_fd(server_fd, via_parent ? &parent : NULL, PARENT_CLOSE);
+        return 0;
+    }
+    char* chunk = head + resp.header_size;
+    num_bytes = head_len - resp.header_size;
+    for (int first = 1; !pass && !body_done && body_left != 0; first = 0) {
+        if (!first) {
+            if ((num_bytes = read(server_fd, buf, MAX_LINE)) <= 0) { break; }
+            chunk = buf;
+            // Forward data to client
+            if (forwarding && !forward_decoded && write_all(client_fd, chunk, num_bytes) < 0) { break; }
+        }
+        size_t n = num_bytes;
+        if (body_left >= 0) {
+            if ((long long)n > body_left) { n = body_left; }
+            body_left -= n;
+        }
+
+        // Decode chunked body bytes in place
+        if (chunked) {
+            const ssize_t decoded = chunked_decode(&decoder, chunk, n, chunk);
+            if (decoded < 0) {
+                fprintf(stderr, "\033[31mfailure:\033[0m malformed chunked response from %s.\n", hostname);
+                break;
+            }
+            n = decoded;
+            body_done = chunked_done(&decoder);
+            if (forward_decoded && write_all(client_fd, chunk, n) < 0) { break; }
+        }
+        if (too_large) { continue; }
 
         // Store in response buffer for caching if there's space
-        if (total_size + num_bytes <= MAX_OBJECT_SIZE) {
-            memcpy(response_buffer + total_size, buf, num_bytes);
-            total_size += num_bytes;
+        if (!stage_reserve(&response_buffer, &allocated, total_size + n, capacity)) {
+            too_large = 1;
+            // Too large to cache, so a deferred answer cannot be cut from it: as above
+            if (!forwarding && resp.status == 200) {
+                pass = 1;
+                break;
+            }
+            if (!forwarding) {
+                char* staged = response_buffer;
+                if (chunked) {
+                    // What we send is decoded: its end is where the connection closes
+                    const size_t at = chunked_finish_header(response_buffer, resp.header_size, body_start, -1);
+                    staged += at;
+                    total_size -= at;
+                    forward_decoded = 1;
+                }
+                if (write_all(client_fd, staged, total_size) < 0 || write_all(client_fd, chunk, n) < 0) { break; }
+                forwarding = 1;
+            }
+            continue;
         }
+        memcpy(response_buffer + total_size, chunk, n);
+        total_size += n;
     }
 
-    // Store response in cache if it's not too large
-    if (total_size > 0 && total_size <= MAX_OBJECT_SIZE) {
-        cache_insert(uri, response_buffer, total_size);
+    // Complete: a chunked body at its last chunk, one with a length once it is all in, others at EOF
+    const int complete = chunked ? body_done : body_left == 0 || (body_left < 0 && num_bytes == 0);
+    if (complete && !too_large) {
+        // Store response in cache, and answer a deferred request from the complete response
+        char* object = response_buffer;
+        if (chunked) {
+            object += chunked_finish_header(response_buffer, resp.header_size, body_start, total_size - body_start);
+        }
+        const size_t object_size = response_buffer + total_size - object;
+        if (remember) { negative_response_insert(key, object, object_size); }
+        else { cache_insert(key, req->fields, req->fields_len, object, object_size); }
+        if (!forwarding) { respond_fetched(client_fd, req, object, object_size); }
     }
 
-    close(server_fd);
+    free(response_buffer);
+    if (pass) { log_debug("%s is not stored. asking %s:%s again as the client did.\n", req->uri, hostname, port); }
+    // A parent's connection carries the next request if this answer was read
+    // to its (Content-Length) end, and the parent keeps it open
+    const int keep = !pass && parsed == 1 && resp.keep_alive > 0 && resp.transfer_coding == 0 && body_left == 0;
+    release_server_fd(server_fd, via_parent ? &parent : NULL, keep ? PARENT_KEEP : PARENT_CLOSE);
+    return pass;
+}
+
+/* GET and HEAD: answer from the cache, or fetch from the origin (storing what can be). */
+static void serve_cacheable(int client_fd, http_request_t* req, const struct proxy_config* cfg, route_t* route) {
+    char hostname[MAX_LINE], path[MAX_LINE], port[16];
+    char request_hdr[2 * MAX_LINE];
+    const int is_head = strcasecmp(req->method, "HEAD") == 0;
+
+    // The cache key: the canonical URL and its hash, computed once for lookup and insert
+    url_key_t key;
+    url_key(&key, req->uri, cfg);
+
+    // Check cache first (the variant for this request's headers, if the response varies);
+    // HEAD, conditional and Range requests are answered from a cached GET
+    cache_entry_t* entry = cache_lookup(&key, req->fields, req->fields_len);
+    if (entry) {
+        // Cache hit - send directly from cache storage to client: the gzip copy
+        // if the client takes it, else the response (as much of a compressed
+        // body as the answer needs is inflated into a copy first; one that
+        // fails to is refetched)
+        cache_view_t view;
+        const int opened = cache_entry_open(entry, req, &view) == 0;
+        if (opened) {
+            http_respond_cached(client_fd, req, view.header, view.header_size, view.body, view.body_size);
+            cache_entry_close(&view);
+        }
+        cache_release(entry);
+        if (opened) { return; }
+    }
+
+    // An error response the origin gave for this URL a moment ago is sent again
+    char* recent;
+    size_t recent_size;
+    if (negative_response(&key, &recent, &recent_size)) {
+        respond_fetched(client_fd, req, recent, recent_size);
+        free(recent);
+        return;
+    }
+
+    // The sibling proxy that owns this URL may have it (see peer.c); its copy is kept here too
+    if (peer_lookup(&key, req->fields, req->fields_len, cfg->max_object_size, &recent, &recent_size)) {
+        cache_insert(&key, req->fields, req->fields_len, recent, recent_size);
+        respond_fetched(client_fd, req, recent, recent_size);
+        free(recent);
+        return;
+    }
+
+    // Cache miss - need to fetch from server
+    // Parse URI to get hostname, path, and port (of the upstream server, when routed)
+    request_origin(req, route, hostname, path, port);
+
+    /* A GET with Range or validators fetches the whole object, so it can be
+       cached; the client's answer is then cut from the complete response.
+       (If it cannot be cached after all, the request is sent again as it is.)
+       Not from segment hosts: their objects are mostly too large to cache,
+       so a Range there goes to the origin as it is. */
+    const int via_parent = parent_enabled();
+    char value[MAX_LINE];
+    const int deferred = !is_head && (via_parent || !segment_wanted(cfg, hostname)) &&
+        (http_get_field(req->fields, req->fields_len, "Range", value, sizeof(value)) ||
+         http_get_field(req->fields, req->fields_len, "If-None-Match", value, sizeof(value)) ||
+         http_get_field(req->fields, req->fields_len, "If-Modified-Since", value, sizeof(value)));
+
+    /* Wait for a turn at this origin (see fetch.c), then fetch from it. */
+    fetch_slot_t slot;
+    if (fetch_acquire(hostname, port, &slot) < 0) {
+        write_all(client_fd, (char*)UNAVAILABLE, strlen(UNAVAILABLE));
+        return;
+    }
+    for (int strip = deferred, again = 1; again; strip = 0) {
+        /* Set the request header (for a parent proxy: with the absolute URI, keeping the connection) */
+        const int return_cd = via_parent
+            ? set_parent_request_header ( request_hdr, sizeof(request_hdr), req, hostname, path, port, strip, 1 )
+            : set_request_header ( request_hdr, sizeof(request_hdr), req, hostname, path, port, strip );
+        if ( error_header ( return_cd ) ) { break; }
+        again = fetch_origin(client_fd, req, cfg, &key, hostname, path, port, request_hdr, strip, via_parent);
+    }
+    fetch_release(&slot);
 }
 
-int create_listen_fd ( int port )
+void handle_request(int client_fd) {
+    http_request_t req;
+
+    struct proxy_config cfg;
+    config_get(&cfg);
+
+    /* read HTTP Request-line and header fields */
+    if ( ! read_request ( client_fd, &req ) ) { return; }
+
+    // From here on, shutdown lets this request finish (up to the drain timeout)
+    conn_set_busy(1);
+
+    /* Ignore methods we do not relay. */
+    if ( error_method ( req.method ) ) { return; }
+    const int is_head = strcasecmp(req.method, "HEAD") == 0;
+
+    // Reverse-proxy mode: the request goes where the route table says (see route.c)
+    route_t route = { NULL, NULL, 0, NULL };
+    if (route_enabled() && (strcasecmp(req.method, "CONNECT") == 0 || route_request(&req, &cfg, &route) < 0)) {
+        write_all(client_fd, (char*)NOT_FOUND, strlen(NOT_FOUND));
+        return;
+    }
+
+    if (strcasecmp(req.method, "CONNECT") == 0) {
+        handle_connect(client_fd, &req, &cfg);
+    } else if (!is_head && strcasecmp(req.method, "GET") != 0) {
+        // Requests with a body (or side effects) bypass the cache
+        forward_uncached(client_fd, &req, &cfg, &route);
+    } else {
+        serve_cacheable(client_fd, &req, &cfg, &route);
+    }
+    route_done(&route);
+}
+
+int create_listen_fd ( int port, int backlog )
 {
     /* File descriptors */
     int listen_fd; // fd for connection requests from clients.
@@ -285,7 +1125,7 @@ int create_listen_fd ( int port )
        https://man7.org/linux/man-pages/man3/sockaddr.3type.html */
     struct sockaddr_in listen_addr;
 
-    printf("\e[1mcreating listen_fd\e[0m\n");
+    log_info("\e[1mcreating listen_fd\e[0m\n");
     
     /* Set socket address (on which proxy shall listen for connection requests). */
     set_listen_socket_address ( &listen_addr, port );
@@ -310,10 +1150,10 @@ int create_listen_fd ( int port )
 
     /* "Kernel, oh btw, that socket? Make it passive." (it's for connection requests)
        https://man7.org/linux/man-pages/man2/listen.2.html (a system call) */
-    return_cd = listen(listen_fd, LISTENQ);
+    return_cd = listen(listen_fd, backlog);
     if ( error_listen_fatal ( return_cd ) ) { exit(1); }
 
-    printf("\e[1mlisten_fd ready\e[0m\n");
+    log_info("\e[1mlisten_fd ready\e[0m\n");
     
     return listen_fd;
 }
@@ -335,18 +1175,28 @@ void set_listen_socket_address ( struct sockaddr_in *listen_addr, int port )
        instead, here we hard-code port, pick 32-bit IP addresses, and all available interfaces.
        why: because I know cos supports this, and it is simpler; `getaddrinfo` is 
        intimidating for the uninitiated. (why: check out the server socket code.) */
-    printf("\033[32msuccess:\033[0m set socket address of proxy.\n");
+    log_info("\033[32msuccess:\033[0m set socket address of proxy.\n");
 }
 
-int create_server_fd ( char* hostname, char* port )
+int create_server_fd ( char* hostname, char* port, int timeout )
 {
-    int server_fd;
-    int return_cd;
+    int server_fd = -1;
+    int return_cd = -1;
     
-    struct addrinfo *cand_ai; // pointer to heap-allocated candidate server addresses (free this!)
+    struct addrinfo *cand_ai; // pointer to candidate server addresses (free this!)
+    hosts_candidates_t pinned; // where they are built, for a pinned host
+
+    /* an origin that failed a moment ago fails again at once (see negative.c). */
+    const int failed = negative_origin ( hostname, port );
+    if ( failed != NEGATIVE_NONE ) {
+        log_debug ( "%s:%s failed recently (%s). not trying again yet.\n",
+                    hostname, port, failed == NEGATIVE_DNS ? "name lookup" : "connect" );
+        return -1;
+    }
 
     /* Get list of candidate server socket addresses. */
-    return_cd = get_server_socket_address_candidates ( &cand_ai, hostname, port );
+    return_cd = get_server_socket_address_candidates ( &cand_ai, hostname, port, &pinned );
+    if ( return_cd != 0 ) { negative_origin_failed ( hostname, port, NEGATIVE_DNS ); }
     if ( error_address_server ( return_cd ) ) { return -1; }
 
     struct addrinfo *curr_ai; // pointer to current candidate server address in the above list.
@@ -356,35 +1206,79 @@ int create_server_fd ( char* hostname, char* port )
     for ( curr_ai = cand_ai; curr_ai != NULL; curr_ai = curr_ai->ai_next ) {
 	/* "Kernel, make me a socket." (for curr_ai)
 	   https://man7.org/linux/man-pages/man2/socket.2.html (a system call) */
-    printf("HERE\n");
 	server_fd = socket ( curr_ai->ai_family, curr_ai->ai_socktype, curr_ai->ai_protocol );
-    printf("HERE\n");
 	if ( server_fd == -1 )
 	    continue; // try the next ai.
 
+	/* bound connect (and later reads/writes), so a dead server cannot hold this thread forever. */
+	if ( timeout > 0 && set_socket_timeout ( server_fd, timeout ) < 0 ) { error_socket_option ( -1 ); }
+
 	/* "Kernel, please (attempt to) connect to said socket."
 	   https://man7.org/linux/man-pages/man2/connect.2.html (a system call) */
         return_cd = connect ( server_fd, curr_ai->ai_addr, curr_ai->ai_addrlen );
 	//return_cd = connect ( server_fd, (struct sockaddr *)&curr_ai, sizeof(curr_ai) );
-	if ( return_cd < 0 ) { printf("failure connecting to socket. trying next one.\n"); }
+	if ( return_cd < 0 ) { log_info("failure connecting to socket. trying next one.\n"); }
 	if ( return_cd == 0 )
 	    break;    // success
 
 	/* couldn't bind the socket to curr_ai. try the next ai. */
 	close( server_fd );
     }
-    /* free up the heap-allocated linked list. */
-    freeaddrinfo(curr_ai);
+    /* free up the heap-allocated linked list (if it is one). */
+    free_server_socket_address_candidates ( cand_ai, &pinned );
     
-    /* report errors if any. */
-    if ( return_cd < 0 ) { return -1; }
+    /* report errors if any. (an origin that refused or timed out is remembered.) */
+    if ( return_cd < 0 ) {
+        negative_origin_failed ( hostname, port, NEGATIVE_CONNECT );
+        return -1;
+    }
 
     /* success; return the server fd. */
     return server_fd;
 }
 
-int get_server_socket_address_candidates ( struct addrinfo **cand_ai, char* hostname, char* port )
+/* a second connection to hostname:port, for a hedged request: to another of
+   its addresses than first_fd's, if it has more than one. the connection is
+   started, not waited for: the fd is non-blocking, and writable once it is
+   connected (or has failed; see SO_ERROR). -1 if none can be started. */
+int create_hedge_fd ( char* hostname, char* port, int timeout, int first_fd )
 {
+    struct sockaddr_storage first; // the address first_fd is connected to
+    socklen_t first_len = sizeof(first);
+    if ( getpeername ( first_fd, (struct sockaddr *)&first, &first_len ) < 0 ) { first_len = 0; }
+
+    struct addrinfo *cand_ai, *curr_ai;
+    hosts_candidates_t pinned;
+    if ( get_server_socket_address_candidates ( &cand_ai, hostname, port, &pinned ) != 0 ) { return -1; }
+
+    /* two passes over the candidates: the other addresses, then first_fd's. */
+    int server_fd = -1;
+    for ( int same = 0; same < 2 && server_fd < 0; same++ ) {
+        for ( curr_ai = cand_ai; curr_ai != NULL && server_fd < 0; curr_ai = curr_ai->ai_next ) {
+            const int is_first = first_len == curr_ai->ai_addrlen &&
+                                 memcmp ( &first, curr_ai->ai_addr, first_len ) == 0;
+            if ( is_first != same ) { continue; }
+            server_fd = socket ( curr_ai->ai_family, curr_ai->ai_socktype, curr_ai->ai_protocol );
+            if ( server_fd == -1 ) { continue; }
+            if ( timeout > 0 && set_socket_timeout ( server_fd, timeout ) < 0 ) { error_socket_option ( -1 ); }
+            fcntl ( server_fd, F_SETFL, fcntl ( server_fd, F_GETFL ) | O_NONBLOCK );
+            if ( connect ( server_fd, curr_ai->ai_addr, curr_ai->ai_addrlen ) < 0 && errno != EINPROGRESS ) {
+                close ( server_fd );
+                server_fd = -1;
+            }
+        }
+    }
+    free_server_socket_address_candidates ( cand_ai, &pinned );
+    return server_fd;
+}
+
+/* candidate addresses for hostname:port. a pinned host's (see hosts.c) are
+   built in pinned, without a lookup; the others are resolved. */
+int get_server_socket_address_candidates ( struct addrinfo **cand_ai, char* hostname, char* port,
+                                           struct hosts_candidates *pinned )
+{
+    if ( ( *cand_ai = hosts_lookup ( hostname, port, pinned ) ) != NULL ) { return 0; }
+
     struct addrinfo hints_ai; // hints for proposing candidate server addresses (i.e. for generating cand_ai)
     /* set hints. network socket, numeric port, avoid IPv6 socket for hosts that don't support those. */ 
     memset ( &hints_ai, 0, sizeof(struct addrinfo) );
@@ -392,3 +1286,9 @@ int get_server_socket_address_candidates ( struct addrinfo **cand_ai, char* host
     hints_ai.ai_flags    = AI_NUMERICSERV | AI_ADDRCONFIG;
     return getaddrinfo ( hostname, port, &hints_ai, cand_ai );
 }
+
+/* give back what get_server_socket_address_candidates returned. */
+void free_server_socket_address_candidates ( struct addrinfo *cand_ai, struct hosts_candidates *pinned )
+{
+    if ( cand_ai != pinned->ai ) { freeaddrinfo ( cand_ai ); }
+}
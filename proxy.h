@@ -1,4 +1,4 @@
-/* Macro constants */
+/* Macro constants (defaults of the runtime configuration; see config.c) */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define LISTENQ 1024
@@ -8,15 +8,19 @@
 #endif/*MAX_LINE*/
 
 void handle_request ( int fd );
-int  create_listen_fd ( int port);
+int  create_listen_fd ( int port, int backlog );
 void handle_connection_request ( int listen_fd );
 void get_client_socket_address ( struct sockaddr *client_addr, char *hostname, char *port);
 void set_listen_socket_address ( struct sockaddr_in *listen_addr, int port );
-int  get_server_socket_address_candidates ( struct addrinfo **cand_ai, char* hostname, char* port );
-int  create_server_fd ( char* hostname, char* port );
+struct hosts_candidates;
+int  get_server_socket_address_candidates ( struct addrinfo **cand_ai, char* hostname, char* port,
+                                            struct hosts_candidates *pinned );
+void free_server_socket_address_candidates ( struct addrinfo *cand_ai, struct hosts_candidates *pinned );
+int  create_server_fd ( char* hostname, char* port, int timeout );
+int  create_hedge_fd ( char* hostname, char* port, int timeout, int first_fd );
 
 // Additional function declarations
 void handle_connection_request(int listen_fd);
 void* handle_request_thread(void* arg);
 void handle_request(int client_fd);
-int create_listen_fd(int port);
\ No newline at end of file
+int create_listen_fd(int port, int backlog);
\ No newline at end of file
@@ -0,0 +1,127 @@
+/**
+ * Response header parsing and cacheability.
+ *
+ * `response_parse` is fed the bytes of a response as they are read (the
+ * whole buffer each time; it resumes where it stopped), and classifies each
+ * header line as it completes. Once the blank line is seen, the caller knows
+ * how the body is framed and whether the response may be cached, before a
+ * single body byte has been staged.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "response.h"
+
+void response_init ( response_t *resp )
+{
+    memset ( resp, 0, sizeof(*resp) );
+    resp->content_length = -1;
+}
+
+/* does the line start with header field `name` (followed by a colon)?
+   if so, point *value at its (left-trimmed) value. */
+static int field ( const char *line, const char *end, const char *name, const char **value )
+{
+    size_t n = strlen(name);
+    if ( (size_t)( end - line ) <= n || strncasecmp ( line, name, n ) != 0 || line[n] != ':' ) { return 0; }
+    const char *v = line + n + 1;
+    while ( v < end && ( *v == ' ' || *v == '\t' ) ) { v++; }
+    *value = v;
+    return 1;
+}
+
+/* the directives of one Cache-Control line, e.g. `public, max-age=60`. */
+static void cache_control ( response_t *resp, const char *v, const char *end )
+{
+    while ( v < end ) {
+        while ( v < end && ( *v == ' ' || *v == '\t' || *v == ',' ) ) { v++; }
+        const char *d = v;
+        while ( v < end && *v != ',' ) { v++; }
+        size_t n = v - d;
+
+        if ( ( n >= 8 && strncasecmp ( d, "no-store", 8 ) == 0 ) ||
+             ( n >= 8 && strncasecmp ( d, "no-cache", 8 ) == 0 ) || // we cannot revalidate
+             ( n >= 7 && strncasecmp ( d, "private", 7 ) == 0 ) ) {
+            resp->no_store = 1;
+        } else if ( n >= 6 && strncasecmp ( d, "public", 6 ) == 0 ) {
+            resp->shared_ok = 1;
+        } else if ( n > 9 && strncasecmp ( d, "s-maxage=", 9 ) == 0 ) {
+            if ( atoll ( d + 9 ) <= 0 ) { resp->no_store = 1; }
+            else { resp->shared_ok = 1; }
+        } else if ( n > 8 && strncasecmp ( d, "max-age=", 8 ) == 0 ) {
+            if ( atoll ( d + 8 ) <= 0 ) { resp->no_store = 1; }
+        }
+    }
+}
+
+/* classify one header line [line, end) (without its CRLF). */
+static void header_line ( response_t *resp, const char *line, const char *end )
+{
+    const char *v;
+    if ( field ( line, end, "Content-Length", &v ) ) {
+        char *num_end;
+        long long n = strtoll ( v, &num_end, 10 );
+        resp->content_length = num_end == v || n < 0 ? -1 : n;
+    } else if ( field ( line, end, "Transfer-Encoding", &v ) ) {
+        resp->transfer_coding = end - v == 7 && strncasecmp ( v, "chunked", 7 ) == 0 ? 1 : -1;
+    } else if ( field ( line, end, "Cache-Control", &v ) ) {
+        cache_control ( resp, v, end );
+    } else if ( field ( line, end, "Set-Cookie", &v ) ) {
+        resp->set_cookie = 1;
+    } else if ( field ( line, end, "Vary", &v ) ) {
+        if ( memchr ( v, '*', end - v ) ) { resp->vary_any = 1; }
+    } else if ( field ( line, end, "Connection", &v ) || field ( line, end, "Proxy-Connection", &v ) ) {
+        /* close wins over keep-alive, wherever either appears. */
+        if ( strncasecmp ( v, "close", 5 ) == 0 ) { resp->keep_alive = -1; }
+        else if ( strncasecmp ( v, "keep-alive", 10 ) == 0 && resp->keep_alive == 0 ) { resp->keep_alive = 1; }
+    }
+}
+
+/* examine the header lines completed since the last call. data holds the
+   first len bytes of the response. returns 1 once the header is complete
+   (resp->header_size is then set), 0 if more bytes are needed, -1 if this
+   is not an HTTP response. */
+int response_parse ( response_t *resp, const char *data, size_t len )
+{
+    while ( resp->header_size == 0 ) {
+        const char *line = data + resp->scanned;
+        const char *lf = memchr ( line, '\n', len - resp->scanned );
+        if ( lf == NULL ) { return 0; }
+        const char *end = lf > line && lf[-1] == '\r' ? lf - 1 : lf;
+        resp->scanned = lf + 1 - data;
+
+        if ( line == data ) {
+            /* status line: HTTP/1.x SSS reason */
+            if ( end - line < 12 || strncmp ( line, "HTTP/", 5 ) != 0 ) { return -1; }
+            resp->status = atoi ( line + 9 );
+        } else if ( end == line ) {
+            resp->header_size = resp->scanned;
+        } else {
+            header_line ( resp, line, end );
+        }
+    }
+    return 1;
+}
+
+/* may a shared cache store this response? authorized: the request carried
+   Authorization. NOTE: without revalidation, anything that would need it
+   (no-cache, max-age=0) is not stored. `Vary: *` matches no later request. */
+int response_cacheable ( const response_t *resp, int authorized )
+{
+    switch ( resp->status ) {
+    /* cacheable by default (RFC 9110, section 15.1), less 206: we store
+       whole objects only, and cut ranges from them. NOTE: the cache keeps
+       an entry until it is evicted (it has no notion of freshness), so the
+       rest are left out: 301, and errors (404, 405, 410, 414, 501), which
+       the negative cache keeps for a few seconds instead. */
+    case 200: case 203: case 204: case 300: case 308:
+        break;
+    default:
+        return 0;
+    }
+    if ( resp->no_store || resp->set_cookie || resp->vary_any ) { return 0; }
+    if ( authorized && ! resp->shared_ok ) { return 0; }
+    return 1;
+}
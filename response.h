@@ -0,0 +1,25 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+
+/* What the proxy needs to know about a response header. It is filled in
+   by `response_parse` line by line, as the header arrives. */
+typedef struct {
+    size_t scanned;         // bytes of the header examined so far
+    size_t header_size;     // status line through blank line; 0 until complete
+    int status;             // status code
+    long long content_length; // -1 if absent
+    int transfer_coding;    // 0: none, 1: chunked, -1: another coding
+    int no_store;           // Cache-Control: no-store, no-cache, private, or a max-age of 0
+    int shared_ok;          // Cache-Control: public or s-maxage (may store despite Authorization)
+    int set_cookie;         // Set-Cookie present
+    int vary_any;           // Vary: *
+    int keep_alive;         // Connection (or Proxy-Connection): 1 keep-alive, -1 close, 0 neither
+} response_t;
+
+void response_init ( response_t *resp );
+int  response_parse ( response_t *resp, const char *data, size_t len );
+int  response_cacheable ( const response_t *resp, int authorized );
+
+#endif/*RESPONSE_H*/
@@ -0,0 +1,501 @@
+/**
+ * Reverse-proxy routing.
+ *
+ * With a routes file (`routes`), the proxy serves requests for its own
+ * services: each request is routed, by its Host and path, to a pool of
+ * upstream servers, and sent to one of them. The file holds two kinds of line:
+ *
+ *     upstream <name> <policy> <host:port> [weight=<n>] [<host:port> ...]
+ *     route <host>[/path-prefix] <upstream>
+ *
+ * with `#` comments. <policy> is `round-robin`, `least-conn` (the server with
+ * the fewest requests in flight to it), or `p2c` (the less busy of two picked at
+ * random: nearly as good, without looking at every server), or `hash`
+ * (consistent hashing on the request's cache key, so that each object is
+ * fetched through, and cached by, one server only). A route's host
+ * is matched without its port, case-insensitively; `*` matches any host that
+ * has no route of its own. Its path prefix defaults to `/`, and is matched
+ * as a plain string (`/api` matches `/apix`); the longest one wins. An
+ * upstream is declared before the routes to it.
+ *
+ * A `hash` pool places ROUTE_POINTS points on a ring for each unit of a
+ * server's weight (1 by default), at hashes of its address; a key goes to
+ * the server of the first point at or after its hash. Adding or removing a
+ * server (and reloading) moves only the keys on its share of the ring, so
+ * the others' caches stay warm.
+ *
+ * The routes are compiled into a radix trie keyed by `host` + `path`, so a
+ * lookup takes time in the length of the request's host and path, however
+ * many routes there are. A table is never changed once built: reloading
+ * builds a new one and swaps it in, and requests still routed by the old
+ * one keep it alive until they are done.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "route.h"
+#include "io.h" // MAX_LINE
+#include "hash.h"
+
+#define ROUTE_LINE_MAX 4096
+#define ROUTE_POINTS 160         // ring points per unit of weight
+#define ROUTE_WEIGHT_MAX 100
+
+typedef struct {
+    uint64_t hash;
+    route_backend_t *backend;
+} route_point_t;
+
+struct route_pool {
+    char name[64];
+    int policy;                  // ROUTE_*
+    route_backend_t *backends;
+    int n_backends;
+    unsigned next;               // round-robin position (atomic)
+    route_point_t *ring;         // `hash`: sorted by hash
+    size_t n_points;
+};
+
+typedef struct route_node {
+    char *label;                 // the bytes on the edge into this node
+    size_t len;
+    route_pool_t *pool;          // a route ends here
+    struct route_node **children; // sorted by the first byte of their label
+    size_t n_children;
+} route_node_t;
+
+struct route_table {
+    route_node_t root;
+    route_pool_t **pools;
+    int n_pools;
+    int refs;                    // the current table holds one (atomic)
+};
+
+static struct {
+    route_table_t *current;
+    pthread_mutex_t lock;
+} routes = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+/* the child of node whose label starts with c, and where it is (or would go). */
+static route_node_t *child ( const route_node_t *node, unsigned char c, size_t *at )
+{
+    size_t lo = 0, hi = node->n_children;
+    while ( lo < hi ) {
+        const size_t mid = ( lo + hi ) / 2;
+        const unsigned char m = node->children[mid]->label[0];
+        if ( m == c ) { *at = mid; return node->children[mid]; }
+        if ( m < c ) { lo = mid + 1; } else { hi = mid; }
+    }
+    *at = lo;
+    return NULL;
+}
+
+static route_node_t *node_new ( const char *label, size_t len )
+{
+    route_node_t *node = calloc ( 1, sizeof(*node) );
+    if ( node == NULL || ( node->label = strndup ( label, len ) ) == NULL ) {
+        free ( node );
+        return NULL;
+    }
+    node->len = len;
+    return node;
+}
+
+static int add_child ( route_node_t *node, route_node_t *c, size_t at )
+{
+    route_node_t **children = realloc ( node->children, ( node->n_children + 1 ) * sizeof(*children) );
+    if ( children == NULL ) { return -1; }
+    memmove ( children + at + 1, children + at, ( node->n_children - at ) * sizeof(*children) );
+    children[at] = c;
+    node->children = children;
+    node->n_children++;
+    return 0;
+}
+
+/* add key -> pool. returns 0, 1 if key has a route already, or -1 (out of memory). */
+static int trie_insert ( route_node_t *node, const char *key, route_pool_t *pool )
+{
+    for ( ;; ) {
+        if ( *key == '\0' ) {
+            if ( node->pool ) { return 1; }
+            node->pool = pool;
+            return 0;
+        }
+        size_t at;
+        route_node_t *c = child ( node, (unsigned char)*key, &at );
+        if ( c == NULL ) {
+            route_node_t *leaf = node_new ( key, strlen ( key ) );
+            if ( leaf == NULL ) { return -1; }
+            leaf->pool = pool;
+            if ( add_child ( node, leaf, at ) < 0 ) {
+                free ( leaf->label );
+                free ( leaf );
+                return -1;
+            }
+            return 0;
+        }
+
+        size_t common = 0;
+        while ( common < c->len && key[common] == c->label[common] ) { common++; }
+        if ( common < c->len ) {
+            /* the key leaves the edge part way: split it there. */
+            route_node_t *mid = node_new ( c->label, common );
+            route_node_t **children = malloc ( sizeof(*children) );
+            if ( mid == NULL || children == NULL ) {
+                if ( mid ) { free ( mid->label ); }
+                free ( mid );
+                free ( children );
+                return -1;
+            }
+            memmove ( c->label, c->label + common, c->len - common + 1 );
+            c->len -= common;
+            children[0] = c;
+            mid->children = children;
+            mid->n_children = 1;
+            node->children[at] = mid;
+            c = mid;
+        }
+        node = c;
+        key += common;
+    }
+}
+
+/* the pool of the longest route that is a prefix of key, or NULL. */
+static route_pool_t *trie_match ( const route_node_t *node, const char *key, size_t len )
+{
+    route_pool_t *best = node->pool;
+    while ( len > 0 ) {
+        size_t at;
+        const route_node_t *c = child ( node, (unsigned char)*key, &at );
+        if ( c == NULL || c->len > len || memcmp ( c->label, key, c->len ) != 0 ) { break; }
+        key += c->len;
+        len -= c->len;
+        node = c;
+        if ( node->pool ) { best = node->pool; }
+    }
+    return best;
+}
+
+static void trie_free ( route_node_t *node )
+{
+    for ( size_t i = 0; i < node->n_children; i++ ) {
+        trie_free ( node->children[i] );
+        free ( node->children[i]->label );
+        free ( node->children[i] );
+    }
+    free ( node->children );
+}
+
+static void table_free ( route_table_t *table )
+{
+    trie_free ( &table->root );
+    for ( int i = 0; i < table->n_pools; i++ ) {
+        free ( table->pools[i]->backends );
+        free ( table->pools[i]->ring );
+        free ( table->pools[i] );
+    }
+    free ( table->pools );
+    free ( table );
+}
+
+static void table_release ( route_table_t *table )
+{
+    if ( table && __atomic_sub_fetch ( &table->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) { table_free ( table ); }
+}
+
+static route_pool_t *pool_named ( const route_table_t *table, const char *name )
+{
+    for ( int i = 0; i < table->n_pools; i++ ) {
+        if ( strcmp ( table->pools[i]->name, name ) == 0 ) { return table->pools[i]; }
+    }
+    return NULL;
+}
+
+/* `host:port` (or `[v6 address]:port`; the port defaults to 80) into backend. */
+static int parse_backend ( char *addr, route_backend_t *backend )
+{
+    char *host = addr, *port = NULL;
+    if ( host[0] == '[' ) {
+        char *bracket = strchr ( host, ']' );
+        if ( bracket == NULL ) { return -1; }
+        *bracket = '\0';
+        host++;
+        if ( bracket[1] == ':' ) { port = bracket + 2; }
+        else if ( bracket[1] != '\0' ) { return -1; }
+    } else if ( ( port = strrchr ( host, ':' ) ) != NULL ) {
+        *port++ = '\0';
+    }
+    if ( port == NULL ) { port = "80"; }
+    if ( *host == '\0' || strlen ( host ) >= sizeof(backend->host) ||
+         *port == '\0' || strlen ( port ) >= sizeof(backend->port) ) { return -1; }
+    strcpy ( backend->host, host );
+    strcpy ( backend->port, port );
+    backend->weight = 1;
+    backend->active = 0;
+    return 0;
+}
+
+static int point_cmp ( const void *a, const void *b )
+{
+    const uint64_t x = ( (const route_point_t *)a )->hash, y = ( (const route_point_t *)b )->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* place the points of pool's servers on its ring. */
+static int build_ring ( route_pool_t *pool )
+{
+    size_t n = 0;
+    for ( int i = 0; i < pool->n_backends; i++ ) { n += (size_t)pool->backends[i].weight * ROUTE_POINTS; }
+    if ( ( pool->ring = malloc ( n * sizeof(*pool->ring) ) ) == NULL ) { return -1; }
+
+    for ( int i = 0; i < pool->n_backends; i++ ) {
+        route_backend_t *b = &pool->backends[i];
+        for ( int p = 0; p < b->weight * ROUTE_POINTS; p++ ) {
+            char point[320];
+            const int len = snprintf ( point, sizeof(point), "%s:%s-%d", b->host, b->port, p );
+            pool->ring[pool->n_points].hash = hash64 ( point, (size_t)len, 0 );
+            pool->ring[pool->n_points++].backend = b;
+        }
+    }
+    qsort ( pool->ring, pool->n_points, sizeof(*pool->ring), point_cmp );
+    return 0;
+}
+
+/* the server of the first point at or after hash, going round. */
+static route_backend_t *ring_lookup ( const route_pool_t *pool, uint64_t hash )
+{
+    size_t lo = 0, hi = pool->n_points;
+    while ( lo < hi ) {
+        const size_t mid = ( lo + hi ) / 2;
+        if ( pool->ring[mid].hash < hash ) { lo = mid + 1; } else { hi = mid; }
+    }
+    return pool->ring[lo == pool->n_points ? 0 : lo].backend;
+}
+
+/* one `upstream` line (after the keyword), into table. */
+static int parse_upstream ( route_table_t *table, char *rest )
+{
+    char *save, *name = strtok_r ( rest, " \t", &save ), *policy = strtok_r ( NULL, " \t", &save );
+    if ( name == NULL || policy == NULL || strlen ( name ) >= sizeof(table->pools[0]->name) ||
+         pool_named ( table, name ) ) { return -1; }
+
+    route_pool_t *pool = calloc ( 1, sizeof(*pool) );
+    route_pool_t **pools = realloc ( table->pools, ( table->n_pools + 1 ) * sizeof(*pools) );
+    if ( pools ) { table->pools = pools; }
+    if ( pool == NULL || pools == NULL ) {
+        free ( pool );
+        return -1;
+    }
+    table->pools[table->n_pools++] = pool;
+    strcpy ( pool->name, name );
+
+    if ( strcasecmp ( policy, "round-robin" ) == 0 ) { pool->policy = ROUTE_ROUND_ROBIN; }
+    else if ( strcasecmp ( policy, "least-conn" ) == 0 ) { pool->policy = ROUTE_LEAST_CONN; }
+    else if ( strcasecmp ( policy, "p2c" ) == 0 ) { pool->policy = ROUTE_P2C; }
+    else if ( strcasecmp ( policy, "hash" ) == 0 ) { pool->policy = ROUTE_HASH; }
+    else { return -1; }
+
+    for ( char *addr; ( addr = strtok_r ( NULL, " \t", &save ) ) != NULL; ) {
+        if ( strncmp ( addr, "weight=", 7 ) == 0 ) {
+            /* of the server before it; only `hash` pools have weights. */
+            char *end;
+            const long weight = strtol ( addr + 7, &end, 10 );
+            if ( pool->n_backends == 0 || pool->policy != ROUTE_HASH || *end != '\0' ||
+                 weight < 1 || weight > ROUTE_WEIGHT_MAX ) { return -1; }
+            pool->backends[pool->n_backends - 1].weight = (int)weight;
+            continue;
+        }
+        route_backend_t *backends = realloc ( pool->backends, ( pool->n_backends + 1 ) * sizeof(*backends) );
+        if ( backends == NULL ) { return -1; }
+        pool->backends = backends;
+        if ( parse_backend ( addr, &pool->backends[pool->n_backends++] ) < 0 ) { return -1; }
+    }
+    if ( pool->n_backends == 0 ) { return -1; }
+    return pool->policy == ROUTE_HASH ? build_ring ( pool ) : 0;
+}
+
+/* one `route` line (after the keyword), into table. */
+static int parse_route ( route_table_t *table, char *rest )
+{
+    char *save, *match = strtok_r ( rest, " \t", &save ), *name = strtok_r ( NULL, " \t", &save );
+    route_pool_t *pool = name ? pool_named ( table, name ) : NULL;
+    if ( match == NULL || pool == NULL || strtok_r ( NULL, " \t", &save ) ) { return -1; }
+
+    char key[MAX_LINE];
+    char *slash = strchr ( match, '/' );
+    const size_t host_len = slash ? (size_t)( slash - match ) : strlen ( match );
+    if ( host_len == 0 || snprintf ( key, sizeof(key), "%.*s%s", (int)host_len, match, slash ? slash : "/" ) >= (int)sizeof(key) ) {
+        return -1;
+    }
+    for ( size_t i = 0; i < host_len; i++ ) { key[i] = tolower ( (unsigned char)key[i] ); }
+    return trie_insert ( &table->root, key, pool ) == 0 ? 0 : -1;
+}
+
+/* (re)load the routes file at path, replacing the current table. "" turns
+   routing off. returns 0, or -1 (the current table is kept). */
+int route_load ( const char *path )
+{
+    route_table_t *table = NULL;
+    if ( path[0] ) {
+        FILE *f = fopen ( path, "r" );
+        if ( f == NULL ) {
+            fprintf ( stderr, "\033[31mfailure:\033[0m open routes file %s.\n", path );
+            return -1;
+        }
+        table = calloc ( 1, sizeof(*table) );
+        char line[ROUTE_LINE_MAX];
+        int lineno = 0, ok = table != NULL;
+        while ( ok && fgets ( line, sizeof(line), f ) ) {
+            lineno++;
+            char *hash = strchr ( line, '#' );
+            if ( hash ) { *hash = '\0'; }
+            char *save, *word = strtok_r ( line, " \t\r\n", &save );
+            char *rest = save;
+            if ( word == NULL ) { continue; }
+            rest[strcspn ( rest, "\r\n" )] = '\0';
+            if ( strcmp ( word, "upstream" ) == 0 ) { ok = parse_upstream ( table, rest ) == 0; }
+            else if ( strcmp ( word, "route" ) == 0 ) { ok = parse_route ( table, rest ) == 0; }
+            else { ok = 0; }
+            if ( ! ok ) { fprintf ( stderr, "\033[31mfailure:\033[0m %s:%d: bad route.\n", path, lineno ); }
+        }
+        fclose ( f );
+        if ( ! ok ) {
+            if ( table ) { table_free ( table ); }
+            return -1;
+        }
+        table->refs = 1;
+    }
+
+    pthread_mutex_lock ( &routes.lock );
+    route_table_t *old = routes.current;
+    routes.current = table;
+    pthread_mutex_unlock ( &routes.lock );
+    table_release ( old );
+    return 0;
+}
+
+void route_cleanup ( void )
+{
+    route_load ( "" );
+}
+
+int route_enabled ( void )
+{
+    pthread_mutex_lock ( &routes.lock );
+    const int enabled = routes.current != NULL;
+    pthread_mutex_unlock ( &routes.lock );
+    return enabled;
+}
+
+static unsigned random_index ( unsigned n )
+{
+    static __thread unsigned seed = 0;
+    if ( seed == 0 ) { seed = (unsigned)time ( NULL ) ^ (unsigned)(size_t)&seed; }
+    return rand_r ( &seed ) % n;
+}
+
+static route_backend_t *balance ( route_pool_t *pool, uint64_t hash )
+{
+    const int n = pool->n_backends;
+    route_backend_t *b = pool->backends;
+    if ( n == 1 ) { return b; }
+    switch ( pool->policy ) {
+    case ROUTE_HASH:
+        return ring_lookup ( pool, hash );
+    case ROUTE_LEAST_CONN: {
+        /* start where round-robin would, so that ties are spread. */
+        const unsigned start = __atomic_fetch_add ( &pool->next, 1, __ATOMIC_RELAXED ) % n;
+        route_backend_t *best = &b[start];
+        for ( int i = 1; i < n; i++ ) {
+            route_backend_t *c = &b[( start + i ) % n];
+            if ( __atomic_load_n ( &c->active, __ATOMIC_RELAXED ) < __atomic_load_n ( &best->active, __ATOMIC_RELAXED ) ) { best = c; }
+        }
+        return best;
+    }
+    case ROUTE_P2C: {
+        const unsigned i = random_index ( n ), j = ( i + 1 + random_index ( n - 1 ) ) % n;
+        return __atomic_load_n ( &b[j].active, __ATOMIC_RELAXED ) < __atomic_load_n ( &b[i].active, __ATOMIC_RELAXED ) ? &b[j] : &b[i];
+    }
+    default:
+        return &b[__atomic_fetch_add ( &pool->next, 1, __ATOMIC_RELAXED ) % n];
+    }
+}
+
+/* route a request for host (its port is ignored) and path, with cache key
+   hash. returns 0 and the pool it goes to (give it back with route_done;
+   route_balance picks the server, once the request is to be sent), or -1:
+   no route. */
+int route_pick ( const char *host, const char *path, uint64_t hash, route_t *route )
+{
+    route->table = NULL;
+    route->pool = NULL;
+    route->backend = NULL;
+
+    pthread_mutex_lock ( &routes.lock );
+    route_table_t *table = routes.current;
+    if ( table ) { __atomic_add_fetch ( &table->refs, 1, __ATOMIC_RELAXED ); }
+    pthread_mutex_unlock ( &routes.lock );
+    if ( table == NULL ) { return -1; }
+
+    /* the key: the host, lowercased and without its port, then the path. */
+    char key[2 * MAX_LINE];
+    size_t n = 0;
+    if ( host[0] == '[' ) {
+        while ( host[n] && host[n] != ']' && n < MAX_LINE - 1 ) { key[n] = tolower ( (unsigned char)host[n] ); n++; }
+        if ( host[n] == ']' ) { key[n] = ']'; n++; }
+    } else {
+        while ( host[n] && host[n] != ':' && n < MAX_LINE ) { key[n] = tolower ( (unsigned char)host[n] ); n++; }
+    }
+    const size_t host_len = n;
+    const size_t path_len = strnlen ( path, MAX_LINE - 1 );
+    memcpy ( key + n, path, path_len );
+    n += path_len;
+
+    /* every route's key has a `/` right after its host, so one that matches
+       covers all of this host, not just a prefix of it. */
+    route_pool_t *pool = host_len > 0 ? trie_match ( &table->root, key, n ) : NULL;
+    if ( pool == NULL ) {
+        char star[MAX_LINE + 1];
+        star[0] = '*';
+        memcpy ( star + 1, path, path_len );
+        pool = trie_match ( &table->root, star, path_len + 1 );
+    }
+    if ( pool == NULL ) {
+        table_release ( table );
+        return -1;
+    }
+
+    route->table = table;
+    route->pool = pool;
+    route->hash = hash;
+    return 0;
+}
+
+/* the server of its pool a routed request is sent to, counted as busy with
+   it until route_done. only a request that goes upstream picks one (not one
+   answered from the cache), so that least-conn and p2c see only those. */
+route_backend_t *route_balance ( route_t *route )
+{
+    if ( route->backend == NULL ) {
+        route->backend = balance ( route->pool, route->hash );
+        __atomic_add_fetch ( &route->backend->active, 1, __ATOMIC_RELAXED );
+    }
+    return route->backend;
+}
+
+/* the routed request is over. */
+void route_done ( route_t *route )
+{
+    if ( route->table == NULL ) { return; }
+    if ( route->backend ) { __atomic_sub_fetch ( &route->backend->active, 1, __ATOMIC_RELAXED ); }
+    table_release ( route->table );
+    route->table = NULL;
+    route->pool = NULL;
+    route->backend = NULL;
+}
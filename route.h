@@ -0,0 +1,37 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+/* Reverse-proxy routing: a table of `host/path-prefix` routes to pools of
+   upstream servers, each with its own load-balancing policy; see route.c. */
+
+#include <stdint.h>
+
+enum { ROUTE_ROUND_ROBIN, ROUTE_LEAST_CONN, ROUTE_P2C, ROUTE_HASH };
+
+typedef struct route_backend {
+    char host[256];
+    char port[16];
+    int weight;                  // its share of a `hash` pool's keys
+    int active;                  // requests routed to it and not done (atomic)
+} route_backend_t;
+
+typedef struct route_table route_table_t;
+typedef struct route_pool route_pool_t;
+
+/* Where a request goes: the pool, its backend once picked, and the table
+   they belong to (kept alive until route_done). */
+typedef struct {
+    route_table_t *table;        // NULL: not routed (forward proxy)
+    route_pool_t *pool;
+    uint64_t hash;               // the request's cache key's, for `hash` pools
+    route_backend_t *backend;    // NULL until route_balance
+} route_t;
+
+int  route_load ( const char *path );
+void route_cleanup ( void );
+int  route_enabled ( void );
+int  route_pick ( const char *host, const char *path, uint64_t hash, route_t *route );
+route_backend_t *route_balance ( route_t *route );
+void route_done ( route_t *route );
+
+#endif/*ROUTE_H*/
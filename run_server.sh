@@ -1,8 +1,4 @@
 clear
-echo "KILLING PROCESSES..."
-kill -9 $(lsof -t -i:21199)
-clear
-
 echo "PULLING LATEST..."
 git pull
 clear
@@ -15,5 +11,13 @@ echo "MAKE..."
 make
 clear
 
-echo "STARTING ON 21199"
-./proxy 21199
\ No newline at end of file
+# A running proxy hands its listening socket and cache over to the new
+# binary, then drains; no connection is refused or dropped during the deploy.
+UPGRADE_SOCKET=/tmp/proxy-21199.sock
+if [ -S $UPGRADE_SOCKET ] && lsof -t -i:21199 > /dev/null; then
+    echo "UPGRADING ON 21199"
+    ./proxy --upgrade-socket $UPGRADE_SOCKET --upgrade 21199
+else
+    echo "STARTING ON 21199"
+    ./proxy --upgrade-socket $UPGRADE_SOCKET 21199
+fi
@@ -0,0 +1,454 @@
+/**
+ * Parallel segmented fetching of large objects.
+ *
+ * The original request stays in flight and supplies the first segment; the
+ * others are requested with `Range: bytes=a-b` on connections of their own,
+ * one thread each. The worker thread streams the segments to the client in
+ * order as they fill.
+ *
+ * A segment is read ahead of the client into a window of SEGMENT_WINDOW
+ * bytes, not into a copy of the whole object: once its window is full, its
+ * thread stops reading (and TCP holds the origin back) until the worker has
+ * sent the window on. Memory per request is thus bounded by the segment
+ * count, not the object size. Only an object that fits the caller's limit
+ * (the cache's object size) is also assembled whole, for the cache.
+ *
+ * Segment connections are not the worker's server fd, so shutdown cannot
+ * reach them through it: running jobs are listed here instead, and
+ * `segment_interrupt` stops them all.
+ *
+ * Each further segment is a fetch from the origin like any other: it takes
+ * a turn at it (see fetch.c), and a ticket from its circuit breaker (see
+ * health.c) on which its outcome is reported. It must get both at once, or
+ * the object is fetched in fewer segments (or, with none to spare, as one).
+ */
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "proxy.h" // create_server_fd
+#include "segment.h"
+#include "fetch.h"
+#include "health.h"
+#include "error.h"
+#include "io.h"
+
+#define SEGMENT_READ_SIZE 65536
+#define SEGMENT_WINDOW (256 * 1024) // bytes of a segment read ahead of the client
+#define SEGMENT_MAX 16 // upper bound on `segment-count`
+
+struct segment_job;
+
+typedef struct {
+    size_t start, end;  // body offsets of this segment (inclusive)
+    size_t filled;      // bytes of it read so far
+    size_t taken;       // ... of which the worker sent on; the others are in the window
+    char *window;       // ring: byte i of the segment is at i % SEGMENT_WINDOW
+    int fd;             // connection it is read from (-1 if none)
+    int borrowed;       // fd is the caller's, not ours to close
+    int done;           // reading stopped (complete, or failed if filled < length)
+    int joinable;       // a thread runs (or ran) it
+    fetch_slot_t slot;  // its turn at the origin (segment 0 has the caller's)
+    health_ticket_t ticket;
+    int reported;       // the ticket's outcome was reported (its first request's)
+    pthread_t thread_id;
+    struct segment_job *job;
+} segment_t;
+
+typedef struct segment_job {
+    segment_origin_t *origin;
+    segment_t *segs;
+    int n_segs;
+    int stopped;            // failed, or interrupted: no segment connects (or retries) again
+    pthread_mutex_t lock;
+    pthread_cond_t progress; // signalled when any segment gets bytes, or stops
+    struct segment_job *next;
+} segment_job_t;
+
+/* running jobs, so that shutdown can interrupt them. */
+static struct {
+    segment_job_t *jobs;
+    int stopped;            // shutting down: no new jobs
+    pthread_mutex_t lock;
+} segment = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* is segmented fetching configured for this host? `segment-hosts` is a
+   comma-separated list of host names, or `*` for all. */
+int segment_wanted ( const struct proxy_config *cfg, const char *hostname )
+{
+    if ( cfg->segment_count < 2 || cfg->segment_hosts[0] == '\0' ) { return 0; }
+    size_t n = strlen(hostname);
+    for ( const char *p = cfg->segment_hosts; *p; ) {
+        while ( *p == ' ' || *p == ',' ) { p++; }
+        const char *end = p;
+        while ( *end && *end != ',' && *end != ' ' ) { end++; }
+        if ( ( end - p == 1 && *p == '*' ) ||
+             ( (size_t)(end - p) == n && strncasecmp ( p, hostname, n ) == 0 ) ) {
+            return 1;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+/* stop every segment of job: `shutdown` wakes those blocked on their origin,
+   the broadcast those waiting for window room (caller holds job->lock). */
+static void job_stop ( segment_job_t *job )
+{
+    job->stopped = 1;
+    for ( int i = 0; i < job->n_segs; i++ ) {
+        if ( job->segs[i].fd >= 0 ) { shutdown ( job->segs[i].fd, SHUT_RDWR ); }
+    }
+    pthread_cond_broadcast ( &job->progress );
+}
+
+/* stop every running job, and start no more (shutdown, past its drain deadline). */
+void segment_interrupt ( void )
+{
+    pthread_mutex_lock ( &segment.lock );
+    segment.stopped = 1;
+    for ( segment_job_t *job = segment.jobs; job; job = job->next ) {
+        pthread_mutex_lock ( &job->lock );
+        job_stop ( job );
+        pthread_mutex_unlock ( &job->lock );
+    }
+    pthread_mutex_unlock ( &segment.lock );
+}
+
+static void segment_progress ( segment_t *seg, size_t n, int done )
+{
+    pthread_mutex_lock ( &seg->job->lock );
+    seg->filled += n;
+    if ( done ) { seg->done = 1; }
+    pthread_cond_broadcast ( &seg->job->progress );
+    pthread_mutex_unlock ( &seg->job->lock );
+}
+
+/* room for the next bytes of the segment, at most want: the free stretch of
+   its window from `filled` on (up to the end of the ring). waits while the
+   window is full; 0 if the job stopped. */
+static size_t window_room ( segment_t *seg, size_t want )
+{
+    pthread_mutex_lock ( &seg->job->lock );
+    while ( seg->filled - seg->taken == SEGMENT_WINDOW && ! seg->job->stopped ) {
+        pthread_cond_wait ( &seg->job->progress, &seg->job->lock );
+    }
+    size_t room = seg->job->stopped ? 0 : SEGMENT_WINDOW - ( seg->filled - seg->taken );
+    pthread_mutex_unlock ( &seg->job->lock );
+
+    const size_t to_end = SEGMENT_WINDOW - seg->filled % SEGMENT_WINDOW;
+    if ( room > to_end ) { room = to_end; }
+    return room < want ? room : want;
+}
+
+/* store the next n bytes of the segment in its window. returns 0, or -1 if
+   the job stopped. */
+static int window_put ( segment_t *seg, const char *data, size_t n )
+{
+    while ( n > 0 ) {
+        const size_t room = window_room ( seg, n );
+        if ( room == 0 ) { return -1; }
+        memcpy ( seg->window + seg->filled % SEGMENT_WINDOW, data, room );
+        segment_progress ( seg, room, 0 );
+        data += room;
+        n -= room;
+    }
+    return 0;
+}
+
+/* the outcome of the segment's first request, for the origin's circuit. */
+static void segment_report ( segment_t *seg, int ok )
+{
+    if ( seg->reported ) { return; }
+    seg->reported = 1;
+    health_report ( seg->job->origin->hostname, seg->job->origin->port, &seg->ticket, ok );
+}
+
+/* connect, and request the rest of the segment. the bytes of body that arrive
+   along with the response header are stored right away. returns the fd, or -1. */
+static int segment_open ( segment_t *seg )
+{
+    segment_origin_t *origin = seg->job->origin;
+    char request_hdr[2 * MAX_LINE + 64];
+    char head[2 * MAX_LINE];
+    char value[MAX_LINE];
+    const size_t first = seg->start + seg->filled;
+
+    if ( ! set_request_header ( request_hdr, sizeof(request_hdr) - 64, origin->req,
+                                origin->hostname, origin->path, origin->port, 1 ) ) {
+        return -1;
+    }
+    /* insert our Range field before the blank line. */
+    size_t len = strlen(request_hdr) - 2;
+    snprintf ( request_hdr + len, 64, "Range: bytes=%zu-%zu\r\n\r\n", first, seg->end );
+
+    int fd = create_server_fd ( origin->hostname, origin->port, origin->timeout );
+    if ( fd < 0 ) {
+        segment_report ( seg, 0 );
+        return -1;
+    }
+    /* registered where job_stop finds it, unless the job stopped meanwhile. */
+    pthread_mutex_lock ( &seg->job->lock );
+    const int stopped = seg->job->stopped;
+    if ( ! stopped ) { seg->fd = fd; }
+    pthread_mutex_unlock ( &seg->job->lock );
+    if ( stopped ) {
+        close ( fd );
+        return -1;
+    }
+    if ( write_all ( fd, request_hdr, strlen(request_hdr) ) < 0 ) {
+        segment_report ( seg, 0 );
+        return -1;
+    }
+
+    size_t head_len = 0, hlen = 0;
+    while ( hlen == 0 ) {
+        if ( head_len == sizeof(head) ) { return -1; }
+        ssize_t n = read ( fd, head + head_len, sizeof(head) - head_len );
+        if ( n <= 0 ) {
+            segment_report ( seg, 0 );
+            return -1;
+        }
+        head_len += n;
+        hlen = http_header_length ( head, head_len );
+    }
+
+    /* only a 206 starting exactly where we asked will do. */
+    const int ok = head_len >= 12 && strncmp ( head + 8, " 206", 4 ) == 0 &&
+        http_get_field ( head, hlen, "Content-Range", value, sizeof(value) ) &&
+        strncasecmp ( value, "bytes ", 6 ) == 0 && strtoull ( value + 6, NULL, 10 ) == first;
+    segment_report ( seg, ok );
+    if ( ! ok ) { return -1; }
+
+    size_t extra = head_len - hlen;
+    if ( extra > seg->end - first + 1 ) { extra = seg->end - first + 1; }
+    return window_put ( seg, head + hlen, extra ) < 0 ? -1 : fd;
+}
+
+/* read the segment to its end (or until something fails). */
+static void segment_run ( segment_t *seg )
+{
+    const size_t length = seg->end - seg->start + 1;
+    int fd = seg->fd;
+    if ( fd < 0 ) { fd = segment_open ( seg ); }
+
+    while ( fd >= 0 && seg->filled < length ) {
+        const size_t want = length - seg->filled;
+        const size_t room = window_room ( seg, want < SEGMENT_READ_SIZE ? want : SEGMENT_READ_SIZE );
+        if ( room == 0 ) { break; }
+        ssize_t n = read ( fd, seg->window + seg->filled % SEGMENT_WINDOW, room );
+        if ( n <= 0 ) { break; }
+        segment_progress ( seg, n, 0 );
+    }
+
+    pthread_mutex_lock ( &seg->job->lock );
+    if ( seg->fd >= 0 && ! seg->borrowed ) { close ( seg->fd ); }
+    seg->fd = -1;
+    seg->borrowed = 0;
+    pthread_mutex_unlock ( &seg->job->lock );
+    segment_progress ( seg, 0, 1 );
+}
+
+static void *segment_thread ( void *arg )
+{
+    segment_run ( (segment_t *)arg );
+    return NULL;
+}
+
+/* send the bytes [*sent, filled) of seg, from its window, to out_fd,
+   copying them into body (unless NULL: the object is not kept), and free
+   that part of the window. returns 0, or -1 if out_fd failed. */
+static int window_take ( segment_t *seg, size_t filled, size_t *sent, int out_fd, char *body )
+{
+    while ( *sent < filled ) {
+        const size_t at = *sent % SEGMENT_WINDOW;
+        size_t n = filled - *sent;
+        if ( n > SEGMENT_WINDOW - at ) { n = SEGMENT_WINDOW - at; } // up to the end of the ring, then on
+        if ( write_all ( out_fd, seg->window + at, n ) < 0 ) { return -1; }
+        if ( body ) { memcpy ( body + seg->start + *sent, seg->window + at, n ); }
+        *sent += n;
+    }
+    pthread_mutex_lock ( &seg->job->lock );
+    seg->taken = *sent;
+    pthread_cond_broadcast ( &seg->job->progress );
+    pthread_mutex_unlock ( &seg->job->lock );
+    return 0;
+}
+
+/* turns at the origin, and tickets from its circuit, for up to want - 1
+   further segments (segs[1..]). returns how many segments there can be. */
+static int segment_admit ( segment_origin_t *origin, segment_t *segs, int want )
+{
+    int n = 1;
+    for ( ; n < want; n++ ) {
+        if ( fetch_try_acquire ( origin->hostname, origin->port, &segs[n].slot ) < 0 ) { break; }
+        if ( health_acquire ( origin->hostname, origin->port, &segs[n].ticket ) != HEALTH_ALLOW ) {
+            /* a trial of a half-open circuit is not spent on a segment. */
+            health_cancel ( origin->hostname, origin->port, &segs[n].ticket );
+            fetch_release ( &segs[n].slot );
+            break;
+        }
+    }
+    return n;
+}
+
+/* give back the segment's turn at the origin, and its ticket if no request
+   was made on it. */
+static void segment_release ( segment_origin_t *origin, segment_t *seg )
+{
+    if ( ! seg->reported ) {
+        health_cancel ( origin->hostname, origin->port, &seg->ticket );
+        seg->reported = 1;
+    }
+    fetch_release ( &seg->slot );
+}
+
+/* if the response whose first head_len bytes are in `head` is a large,
+   range-capable 200, fetch its body in segments, streaming it to client_fd.
+   The object is also assembled whole if (header and body) it is at most
+   keep_limit bytes. returns 0 if not segmented (the caller relays as
+   usual), 1 if the object was fetched (*object, *size: the complete
+   response, to be freed by the caller; *object is NULL if it was not kept),
+   -1 if it failed midway. */
+int segment_fetch ( const struct proxy_config *cfg, segment_origin_t *origin, int server_fd,
+                    const char *head, size_t head_len, int client_fd, size_t keep_limit,
+                    char **object, size_t *size )
+{
+    char value[MAX_LINE];
+    const size_t hlen = http_header_length ( head, head_len );
+    if ( hlen == 0 || head_len < 12 || strncmp ( head + 8, " 200", 4 ) != 0 ) { return 0; }
+    if ( ! http_get_field ( head, hlen, "Accept-Ranges", value, sizeof(value) ) ||
+         strcasecmp ( value, "bytes" ) != 0 ) { return 0; }
+    if ( http_get_field ( head, hlen, "Transfer-Encoding", value, sizeof(value) ) ) { return 0; }
+    if ( ! http_get_field ( head, hlen, "Content-Length", value, sizeof(value) ) ) { return 0; }
+    const size_t length = strtoull ( value, NULL, 10 );
+    if ( length < cfg->segment_min_size || length > cfg->segment_max_size ) { return 0; }
+
+    /* as many segments as the origin can take now. */
+    segment_t segs[SEGMENT_MAX];
+    memset ( segs, 0, sizeof(segs) );
+    const int count = segment_admit ( origin, segs, cfg->segment_count < SEGMENT_MAX ? cfg->segment_count : SEGMENT_MAX );
+    if ( count < 2 ) { return 0; }
+
+    /* the first segment covers (at least) the body bytes we already have. */
+    size_t leftover = head_len - hlen;
+    if ( leftover > length ) { leftover = length; }
+    size_t seg_size = length / count;
+    size_t first_end = seg_size > leftover ? seg_size : leftover;
+    segment_job_t job = { .origin = origin };
+    int n_segs = count;
+    segs[0].reported = 1; // the caller's request: it reports that
+    for ( int i = 0; i < count; i++ ) {
+        segs[i].job = &job;
+        segs[i].fd = -1;
+        segs[i].start = i == 0 ? 0 : first_end + ( i - 1 ) * ( ( length - first_end ) / ( count - 1 ) );
+        segs[i].end = i == count - 1 ? length - 1
+                    : ( i == 0 ? first_end : first_end + i * ( ( length - first_end ) / ( count - 1 ) ) ) - 1;
+        if ( segs[i].start > segs[i].end ) { n_segs = i; break; } // tiny body: fewer segments
+    }
+    for ( int i = n_segs; i < count; i++ ) { segment_release ( origin, &segs[i] ); }
+    job.segs = segs;
+    job.n_segs = n_segs;
+
+    /* a window per segment; the whole object too, if it is kept. */
+    char *data = hlen + length <= keep_limit ? malloc ( hlen + length ) : NULL;
+    int allocated = hlen + length > keep_limit || data != NULL;
+    for ( int i = 0; i < n_segs && allocated; i++ ) {
+        allocated = ( segs[i].window = malloc ( SEGMENT_WINDOW ) ) != NULL;
+    }
+    pthread_mutex_init ( &job.lock, NULL );
+    pthread_cond_init ( &job.progress, NULL );
+    pthread_mutex_lock ( &segment.lock );
+    const int stopped = segment.stopped;
+    if ( allocated && ! stopped ) {
+        job.next = segment.jobs;
+        segment.jobs = &job;
+    }
+    pthread_mutex_unlock ( &segment.lock );
+    if ( ! allocated || stopped ) {
+        for ( int i = 0; i < n_segs; i++ ) {
+            free ( segs[i].window );
+            segment_release ( origin, &segs[i] );
+        }
+        free ( data );
+        pthread_mutex_destroy ( &job.lock );
+        pthread_cond_destroy ( &job.progress );
+        return 0;
+    }
+
+    if ( data ) { memcpy ( data, head, hlen ); }
+    memcpy ( segs[0].window, head + hlen, leftover ); // (a header's worth: it fits)
+    segs[0].filled = leftover;
+    segs[0].fd = server_fd; // the original response continues with segment 0
+    segs[0].borrowed = 1;
+
+    log_info("fetching %zu bytes from %s in %d segments.\n", length, origin->hostname, n_segs);
+
+    for ( int i = 0; i < n_segs; i++ ) {
+        segs[i].joinable = pthread_create ( &segs[i].thread_id, NULL, segment_thread, &segs[i] ) == 0;
+        if ( ! segs[i].joinable ) { segs[i].done = 1; }
+    }
+
+    /* stream the segments in order, as they fill. a segment that fails is
+       retried once, from where it stopped, on a new thread. */
+    int failed = write_all ( client_fd, (char *)head, hlen ) < 0;
+    for ( int i = 0; i < n_segs && ! failed; i++ ) {
+        segment_t *seg = &segs[i];
+        const size_t seg_length = seg->end - seg->start + 1;
+        size_t sent = 0;
+        int retried = 0;
+        while ( sent < seg_length && ! failed ) {
+            pthread_mutex_lock ( &job.lock );
+            while ( seg->filled == sent && ! seg->done ) { pthread_cond_wait ( &job.progress, &job.lock ); }
+            const size_t filled = seg->filled;
+            const int done = seg->done;
+            const int stopped = job.stopped;
+            pthread_mutex_unlock ( &job.lock );
+
+            if ( filled > sent ) {
+                failed = window_take ( seg, filled, &sent, client_fd, data ? data + hlen : NULL ) < 0;
+            } else if ( done ) {
+                if ( retried || stopped ) { failed = 1; break; }
+                if ( seg->joinable ) { pthread_join ( seg->thread_id, NULL ); }
+                seg->done = 0;
+                retried = 1;
+                seg->joinable = pthread_create ( &seg->thread_id, NULL, segment_thread, seg ) == 0;
+                if ( ! seg->joinable ) { failed = 1; }
+            }
+        }
+    }
+
+    /* on failure, wake segments blocked on their origin (or window); then collect all. */
+    if ( failed ) {
+        pthread_mutex_lock ( &job.lock );
+        job_stop ( &job );
+        pthread_mutex_unlock ( &job.lock );
+    }
+    for ( int i = 0; i < n_segs; i++ ) {
+        if ( segs[i].joinable ) { pthread_join ( segs[i].thread_id, NULL ); }
+        free ( segs[i].window );
+        segment_release ( origin, &segs[i] );
+    }
+    pthread_mutex_lock ( &segment.lock );
+    segment_job_t **link = &segment.jobs;
+    while ( *link != &job ) { link = &( *link )->next; }
+    *link = job.next;
+    pthread_mutex_unlock ( &segment.lock );
+    pthread_mutex_destroy ( &job.lock );
+    pthread_cond_destroy ( &job.progress );
+
+    if ( failed ) {
+        fprintf(stderr, "\033[31mfailure:\033[0m segmented fetch from %s. dropping request.\n", origin->hostname);
+        free ( data );
+        return -1;
+    }
+    *object = data;
+    *size = hlen + length;
+    return 1;
+}
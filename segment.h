@@ -0,0 +1,28 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stddef.h>
+#include "http.h"
+#include "config.h"
+
+/* Segmented fetching: once the response header of a large object is in (a
+   200 with Content-Length and `Accept-Ranges: bytes`), the rest of the body
+   is fetched as several parallel byte-range requests, streamed on in order
+   through a bounded window. It is kept whole only if it fits a given limit. */
+
+/* What a segment request needs to reach the origin. */
+typedef struct {
+    http_request_t *req;
+    char *hostname;
+    char *path;
+    char *port;
+    int timeout;
+} segment_origin_t;
+
+int segment_wanted ( const struct proxy_config *cfg, const char *hostname );
+int segment_fetch ( const struct proxy_config *cfg, segment_origin_t *origin, int server_fd,
+                    const char *head, size_t head_len, int client_fd, size_t keep_limit,
+                    char **object, size_t *size );
+void segment_interrupt ( void );
+
+#endif/*SEGMENT_H*/
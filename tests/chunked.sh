@@ -0,0 +1,41 @@
+#!/bin/bash
+# A chunked response (with chunk extensions and a trailer) is relayed to
+# the client that asked, and stored decoded: hits get the body with a
+# Content-Length, whole or as a Range, from the one origin fetch.
+#     tests/chunked.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18651
+PROXY_PORT=18652
+ORIGIN_LOG=$(mktemp)
+HEAD=$(mktemp)
+OUT=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+$PROXY $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG $HEAD $OUT' EXIT
+sleep 0.5
+
+fetch() { rm -f $OUT; curl -s -D $HEAD -o $OUT -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT "$@" \
+               http://127.0.0.1:$ORIGIN_PORT/chunked/30500; }
+fail() { echo "FAIL: $*"; exit 1; }
+# is $OUT the bytes [first, last) of the origin's body (all of it by default)?
+same() { python3 -c "
+import sys
+want = (b'0123456789abcdef' * 1907)[:30500]
+sys.exit(open('$OUT', 'rb').read() != want[${1:-0}:${2:-30500}])"; }
+
+code=$(fetch)
+[ "$code" = 200 ] && same || fail "the miss: $code, $(wc -c < $OUT) bytes"
+
+code=$(fetch)
+[ "$code" = 200 ] && same || fail "the hit: $code, $(wc -c < $OUT) bytes"
+grep -qi '^Transfer-Encoding' $HEAD && fail "the hit is still chunked"
+grep -qi '^Content-Length: 30500' $HEAD || fail "the hit has no Content-Length: $(cat $HEAD)"
+
+code=$(fetch -H 'Range: bytes=29995-30004')
+[ "$code" = 206 ] && same 29995 30005 || fail "a Range across chunks: $code, $(cat $OUT)"
+
+[ "$(grep -c 'GET /chunked/30500' $ORIGIN_LOG)" = 1 ] || fail "origin requests: $(cat $ORIGIN_LOG)"
+echo "PASS: chunked"
@@ -0,0 +1,39 @@
+#!/bin/bash
+# The circuit breaker: enough failing requests (5xx) to an origin open its
+# circuit, and then its requests are refused (503) without reaching it.
+# After --circuit-open-time a trial request goes through; its success
+# closes the circuit.
+#     tests/circuit.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18611
+PROXY_PORT=18612
+ORIGIN_LOG=$(mktemp)
+LOG=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+stdbuf -oL $PROXY --circuit-min-requests 3 --circuit-error-rate 50 --circuit-open-time 1 \
+    $PROXY_PORT > $LOG 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG $LOG' EXIT
+sleep 0.5
+
+fetch() { curl -s -o /dev/null -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT http://127.0.0.1:$ORIGIN_PORT$1; }
+fail() { echo "FAIL: $*"; exit 1; }
+
+for i in 1 2 3; do
+    code=$(fetch /status/500/$i)
+    [ "$code" = 500 ] || fail "failing request $i: $code"
+done
+grep -q "circuit open" $LOG || fail "the circuit did not open"
+code=$(fetch /file/1)
+[ "$code" = 503 ] || fail "a request to the open circuit: $code"
+grep -q "GET /file/1 " $ORIGIN_LOG && fail "a request to the open circuit reached the origin"
+
+sleep 1.2
+code=$(fetch /file/2)
+[ "$code" = 200 ] || fail "the trial request: $code"
+grep -q "circuit closed" $LOG || fail "the circuit did not close"
+code=$(fetch /file/3)
+[ "$code" = 200 ] || fail "a request after it closed: $code"
+echo "PASS: circuit"
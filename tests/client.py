@@ -0,0 +1,17 @@
+# A client that reads its response slowly (a few MB/s), so the proxy is
+# still writing to it when the test acts. Prints the bytes it got.
+#     python3 client.py <proxy port> <url>
+import socket, sys, time
+
+s = socket.create_connection(('127.0.0.1', int(sys.argv[1])))
+s.sendall(b'GET %s HTTP/1.0\r\n\r\n' % sys.argv[2].encode())
+n = 0
+try:
+    while True:
+        d = s.recv(4096)
+        if not d: break
+        n += len(d)
+        time.sleep(0.001)
+except OSError:
+    pass
+print(n)
@@ -0,0 +1,52 @@
+#!/bin/bash
+# A body stored compressed (--cache-compress-types) comes back intact from
+# the cache: whole, as Range slices (one, several, a suffix), for HEAD and
+# as a 304, all from the one origin fetch.
+#     tests/compress.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18571
+PROXY_PORT=18572
+ORIGIN_LOG=$(mktemp)
+OUT=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+$PROXY --cache-compress-types text/ --object-size 1m $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG $OUT' EXIT
+sleep 0.5
+
+fetch() { rm -f $OUT; curl -s -o $OUT -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT "$@"; }
+fail() { echo "FAIL: $*"; exit 1; }
+URL=http://127.0.0.1:$ORIGIN_PORT/text/300000
+# is $OUT the bytes [first, last) of the origin's text (all of it by default)?
+same() { python3 -c "
+import sys
+want = (b'the quick brown fox jumps over the lazy dog\n' * 6819)[:300000]
+sys.exit(open('$OUT', 'rb').read() != want[${1:-0}:${2:-300000}])"; }
+
+for i in 1 2; do
+    code=$(fetch $URL)
+    [ "$code" = 200 ] && same || fail "GET $i: $code, $(wc -c < $OUT) bytes"
+done
+
+code=$(fetch -H 'Range: bytes=100000-100099' $URL)
+[ "$code" = 206 ] && same 100000 100100 || fail "one range: $code, $(wc -c < $OUT) bytes"
+code=$(fetch -H 'Range: bytes=-44' $URL)
+[ "$code" = 206 ] && same 299956 || fail "a suffix range: $code, $(wc -c < $OUT) bytes"
+code=$(fetch -H 'Range: bytes=0-9,299990-' $URL)
+[ "$code" = 206 ] && python3 -c "
+import sys
+parts = open('$OUT', 'rb').read().split(b'\r\n\r\n')
+sys.exit(not (parts[1].startswith(b'the quick \r\n') and parts[2].startswith(b'g\nthe quic\r\n')))" ||
+    fail "two ranges: $code"
+code=$(fetch -H 'Range: bytes=400000-' $URL)
+[ "$code" = 416 ] || fail "an unsatisfiable range: $code"
+
+len=$(curl -s -I -x http://127.0.0.1:$PROXY_PORT $URL | tr -d '\r' | sed -n 's/^Content-Length: //p')
+[ "$len" = 300000 ] || fail "HEAD: Content-Length \"$len\""
+code=$(fetch -H 'If-None-Match: "t300000"' $URL)
+[ "$code" = 304 ] && [ ! -s $OUT ] || fail "If-None-Match: $code"
+
+[ "$(grep -c 'GET /text/300000' $ORIGIN_LOG)" = 1 ] || fail "origin requests: $(cat $ORIGIN_LOG)"
+echo "PASS: compress"
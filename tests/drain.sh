@@ -0,0 +1,30 @@
+#!/bin/bash
+# Shutdown with a request still being written: the drain deadline passes,
+# the request is interrupted, and the proxy still joins its workers and
+# exits cleanly (status 0), instead of dying on SIGPIPE (status 141).
+#     tests/drain.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18501
+PROXY_PORT=18502
+LOG=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > /dev/null & origin=$!
+$PROXY --drain-timeout 1 $PROXY_PORT > $LOG 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $LOG' EXIT
+sleep 0.5
+
+python3 client.py $PROXY_PORT http://127.0.0.1:$ORIGIN_PORT/big > /dev/null & client=$!
+sleep 1
+kill -TERM $proxy
+wait $proxy; status=$?
+kill $client 2> /dev/null
+
+if [ $status -ne 0 ]; then
+    echo "FAIL: proxy exited with status $status"; exit 1
+fi
+for line in "drain timeout; interrupting 1 request" "joined all workers"; do
+    if ! grep -q "$line" $LOG; then echo "FAIL: no \"$line\" in the log"; exit 1; fi
+done
+echo "PASS: drain"
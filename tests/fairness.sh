@@ -0,0 +1,33 @@
+#!/bin/bash
+# Fair queuing of fetches (--max-fetches): with one fetch at a time, a fast
+# origin's request queued behind a slow origin's backlog gets a turn before
+# that backlog is done, rather than waiting for all of it.
+#     tests/fairness.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+SLOW_PORT=18671
+FAST_PORT=18672
+PROXY_PORT=18673
+
+python3 origin.py $SLOW_PORT > /dev/null & slow=$!
+python3 origin.py $FAST_PORT > /dev/null & fast=$!
+$PROXY --max-fetches 1 $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $slow $fast $proxy 2> /dev/null' EXIT
+sleep 0.5
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+# Six 400ms fetches from the slow origin, queued in order; then one from the fast one
+for i in 1 2 3 4 5 6; do
+    curl -s -o /dev/null -x http://127.0.0.1:$PROXY_PORT "http://127.0.0.1:$SLOW_PORT/slow/400?$i" & backlog="$backlog $!"
+    sleep 0.05
+done
+start=$(date +%s%N)
+code=$(curl -s -o /dev/null -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT http://127.0.0.1:$FAST_PORT/file/10)
+ms=$(( ( $(date +%s%N) - start ) / 1000000 ))
+[ "$code" = 200 ] || fail "the fast origin's request: $code"
+# Behind the whole backlog it would take about 2 seconds
+[ $ms -lt 1200 ] || fail "the fast origin's request waited ${ms}ms"
+wait $backlog
+echo "PASS: fairness"
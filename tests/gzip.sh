@@ -0,0 +1,43 @@
+#!/bin/bash
+# gzip copies (--cache-gzip-types): a client that accepts gzip gets the
+# cached gzip copy, one that does not gets the response as it was; both
+# are told that it varies on Accept-Encoding. One origin fetch serves both.
+#     tests/gzip.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18631
+PROXY_PORT=18632
+ORIGIN_LOG=$(mktemp)
+HEAD=$(mktemp)
+OUT=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+$PROXY --cache-gzip-types text/ $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG $HEAD $OUT' EXIT
+sleep 0.5
+
+fetch() { curl -s -D $HEAD -o $OUT -x http://127.0.0.1:$PROXY_PORT "$@" http://127.0.0.1:$ORIGIN_PORT/text/20000; }
+fail() { echo "FAIL: $*"; exit 1; }
+# is $OUT (gunzipped first, with -z) the origin's text?
+same() { python3 -c "
+import sys, gzip
+body = open('$OUT', 'rb').read()
+if '$1' == '-z': body = gzip.decompress(body)
+sys.exit(body != (b'the quick brown fox jumps over the lazy dog\n' * 455)[:20000])"; }
+
+fetch
+same || fail "the first answer: $(wc -c < $OUT) bytes"
+
+fetch -H 'Accept-Encoding: gzip'
+grep -qi '^Content-Encoding: gzip' $HEAD || fail "no gzip copy: $(cat $HEAD)"
+grep -qi '^Vary: .*Accept-Encoding' $HEAD || fail "the gzip copy does not vary on Accept-Encoding"
+[ "$(wc -c < $OUT)" -lt 20000 ] && same -z || fail "the gzip copy is damaged ($(wc -c < $OUT) bytes)"
+
+fetch
+grep -qi '^Content-Encoding' $HEAD && fail "gzip was sent to a client that does not accept it"
+grep -qi '^Vary: .*Accept-Encoding' $HEAD || fail "the identity response does not vary on Accept-Encoding"
+same || fail "the identity response is damaged ($(wc -c < $OUT) bytes)"
+
+[ "$(grep -c 'GET /text/20000' $ORIGIN_LOG)" = 1 ] || fail "origin requests: $(cat $ORIGIN_LOG)"
+echo "PASS: gzip"
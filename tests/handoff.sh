@@ -0,0 +1,38 @@
+#!/bin/bash
+# Upgrade with a transfer still in flight: the new proxy takes over the
+# listening socket and serves new requests, while the old one drains. The
+# old proxy finishes the transfer (every byte reaches the client), and then
+# exits cleanly.
+#     tests/handoff.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18511
+PROXY_PORT=18512
+SIZE=$(( 20 << 20 ))
+SOCKET=/tmp/proxy-handoff-$$.sock
+OLD_LOG=$(mktemp)
+NEW_LOG=$(mktemp)
+GOT=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT $SIZE > /dev/null & origin=$!
+stdbuf -oL $PROXY --upgrade-socket $SOCKET --drain-timeout 60 $PROXY_PORT > $OLD_LOG 2>&1 & old=$!
+trap 'kill $origin $old $new 2> /dev/null; rm -f $SOCKET $OLD_LOG $NEW_LOG $GOT' EXIT
+sleep 0.5
+
+python3 client.py $PROXY_PORT http://127.0.0.1:$ORIGIN_PORT/big > $GOT & client=$!
+sleep 1
+$PROXY --upgrade-socket $SOCKET --upgrade $PROXY_PORT > $NEW_LOG 2>&1 & new=$!
+sleep 0.5
+
+if ! grep -q "handed over to new proxy" $OLD_LOG; then echo "FAIL: no handover"; exit 1; fi
+if ! kill -0 $old 2> /dev/null; then echo "FAIL: the old proxy did not wait for its transfer"; exit 1; fi
+code=$(curl -s -o /dev/null -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT http://127.0.0.1:$ORIGIN_PORT/new)
+if [ "$code" != 200 ]; then echo "FAIL: the new proxy answered $code"; exit 1; fi
+
+wait $old; status=$?
+wait $client
+if [ $status -ne 0 ]; then echo "FAIL: the old proxy exited with status $status"; exit 1; fi
+if ! grep -q "drained all requests" $OLD_LOG; then echo "FAIL: the old proxy did not drain"; exit 1; fi
+if [ "$(cat $GOT)" -le $SIZE ]; then echo "FAIL: the client got $(cat $GOT) bytes of $SIZE"; exit 1; fi
+echo "PASS: handoff"
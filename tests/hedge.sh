@@ -0,0 +1,36 @@
+#!/bin/bash
+# A hedged request whose second connection is closed on it: the hedge is
+# dropped (it did not answer), and the client still gets the slow first
+# connection's answer. The origin is pinned to two addresses; the second
+# accepts connections and hangs up.
+#     tests/hedge.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18541
+PROXY_PORT=18542
+HOSTS=$(mktemp)
+OUT=$(mktemp)
+printf '127.0.0.1 origin.test\n127.0.0.2 origin.test\n' > $HOSTS
+
+python3 origin.py $ORIGIN_PORT > /dev/null & origin=$!
+python3 -c "
+import socket
+s = socket.socket(); s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.2', $ORIGIN_PORT)); s.listen(8)
+while True: s.accept()[0].close()" & closer=$!
+stdbuf -oL $PROXY --hosts-file $HOSTS --hedge-budget 100 --hedge-min-delay 50 --log-level debug $PROXY_PORT > $OUT 2>&1 & proxy=$!
+trap 'kill $origin $closer $proxy 2> /dev/null; rm -f $HOSTS $OUT' EXIT
+sleep 0.5
+
+fetch() { curl -s -w ' %{http_code}' -x http://127.0.0.1:$PROXY_PORT "$@"; }
+fail() { echo "FAIL: $*"; exit 1; }
+
+# Enough quick answers for the origin's latency percentiles
+for i in $(seq 1 25); do fetch http://origin.test:$ORIGIN_PORT/file/$i > /dev/null; done
+
+got=$(fetch http://origin.test:$ORIGIN_PORT/slow/500)
+[ "$got" = "slow 200" ] || fail "the slow request got \"$got\""
+grep -q "hedging" $OUT || fail "the request was not hedged"
+grep -q "hedge to origin.test:$ORIGIN_PORT failed" $OUT || fail "the closed hedge was not dropped"
+echo "PASS: hedge"
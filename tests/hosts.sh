@@ -0,0 +1,41 @@
+#!/bin/bash
+# Pinned hosts (--hosts-file): names in the file connect to its addresses,
+# never resolved, whatever their case; reloading picks up a changed file.
+#     tests/hosts.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18691
+PROXY_PORT=18692
+HOSTS=$(mktemp)
+ORIGIN_LOG=$(mktemp)
+
+cat > $HOSTS <<END
+# internal origins
+127.0.0.1   alpha.test beta.test  # the stub origin
+127.0.0.9   gone.test
+END
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+$PROXY --hosts-file $HOSTS $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $HOSTS $ORIGIN_LOG' EXIT
+sleep 0.5
+
+fetch() { curl -s -o /dev/null -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT "$@"; }
+fail() { echo "FAIL: $*"; exit 1; }
+
+code=$(fetch http://alpha.test:$ORIGIN_PORT/file/10)
+[ "$code" = 200 ] || fail "alpha.test: $code"
+code=$(fetch http://BETA.Test:$ORIGIN_PORT/file/11)
+[ "$code" = 200 ] || fail "BETA.Test: $code"
+code=$(fetch http://gone.test:$ORIGIN_PORT/file/12)
+[ "$code" = 502 ] || fail "gone.test, pinned to an address with nothing on it: $code"
+grep -q "/file/12" $ORIGIN_LOG && fail "gone.test reached the origin"
+
+# Pinned elsewhere now
+sed -i 's/^127.0.0.1 /127.0.0.9 /' $HOSTS
+kill -HUP $proxy
+sleep 0.3
+code=$(fetch http://alpha.test:$ORIGIN_PORT/file/13)
+[ "$code" = 502 ] || fail "alpha.test after the reload: $code"
+grep -q "/file/13" $ORIGIN_LOG && fail "alpha.test still reached the origin after the reload"
+echo "PASS: hosts"
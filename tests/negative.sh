@@ -0,0 +1,50 @@
+#!/bin/bash
+# The negative cache: an origin's error response is sent again, for
+# --negative-status-ttl, without asking the origin; so is the failure to
+# connect to an origin that refuses connections. When the table is full
+# (4096 entries), a new error response still makes it in.
+#     tests/negative.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18621
+PROXY_PORT=18622
+CLOSED_PORT=18623
+ORIGIN_LOG=$(mktemp)
+LOG=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+stdbuf -oL $PROXY --negative-status-ttl 60 --log-level debug $PROXY_PORT > $LOG 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG $LOG' EXIT
+sleep 0.5
+
+fetch() { curl -s -w ' %{http_code}' -x http://127.0.0.1:$PROXY_PORT "$@"; }
+fail() { echo "FAIL: $*"; exit 1; }
+hits() { grep -c "GET $1 " $ORIGIN_LOG; }
+
+for i in 1 2; do
+    got=$(fetch http://127.0.0.1:$ORIGIN_PORT/status/404/a)
+    [ "$got" = "status 404
+ 404" ] || fail "the error response $i: \"$got\""
+done
+[ "$(hits /status/404/a)" = 1 ] || fail "the error response was fetched $(hits /status/404/a) times"
+
+for i in 1 2; do
+    code=$(curl -s -o /dev/null -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT http://127.0.0.1:$CLOSED_PORT/)
+    [ "$code" = 502 ] || fail "the refusing origin $i: $code"
+done
+grep -q "127.0.0.1:$CLOSED_PORT failed recently" $LOG || fail "the refused connection was not remembered"
+
+# Fill the table, then one more
+python3 -c "
+import socket
+from concurrent.futures import ThreadPoolExecutor
+def get(i):
+    c = socket.create_connection(('127.0.0.1', $PROXY_PORT))
+    c.sendall(b'GET http://127.0.0.1:$ORIGIN_PORT/status/404/%d HTTP/1.0\r\n\r\n' % i)
+    while c.recv(65536): pass
+    c.close()
+with ThreadPoolExecutor(16) as pool: list(pool.map(get, range(4096)))"
+for i in 1 2; do fetch http://127.0.0.1:$ORIGIN_PORT/status/404/b > /dev/null; done
+[ "$(hits /status/404/b)" = 1 ] || fail "an error response was not remembered in the full table"
+echo "PASS: negative"
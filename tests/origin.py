@@ -0,0 +1,121 @@
+# Stub origin for the shell tests. Every request line it gets is printed
+# (with its Range field, if any), so a test can count what reached it. The
+# query of a path is ignored.
+#     python3 origin.py <port> [size]
+#
+#     /file/<n>      n bytes (`0123456789abcdef` repeated), cacheable, with
+#                    Content-Length, an ETag and `Accept-Ranges: bytes`;
+#                    honours one Range, and If-None-Match (304)
+#     /chunked/<n>   the same n bytes, chunked (1000-byte chunks, each with
+#                    an extension; a trailer field after the last)
+#     /text/<n>      n bytes of compressible text/plain, cacheable, with an
+#                    ETag
+#     /vary          cacheable, `Vary: X-Lang`; the body is the X-Lang field
+#     /status/<code> that status, with a short body
+#     /slow/<ms>     a small cacheable body, after a delay of ms
+#     /upload        reads a Content-Length body; the body is `got <n>`
+#     anything else  `size` bytes (`x`s; default 50 MB), without
+#                    Content-Length, then it closes
+import socket, sys, threading, time
+
+port = int(sys.argv[1])
+size = int(sys.argv[2]) if len(sys.argv) > 2 else 50 << 20
+
+def pattern(n):
+    return (b'0123456789abcdef' * (n // 16 + 1))[:n]
+
+def text(n):
+    return (b'the quick brown fox jumps over the lazy dog\n' * (n // 44 + 1))[:n]
+
+def field(head, name):
+    for line in head.split(b'\r\n')[1:]:
+        k, _, v = line.partition(b':')
+        if k.strip().lower() == name.lower().encode(): return v.strip().decode()
+    return None
+
+def respond(c, status, fields, body):
+    head = 'HTTP/1.1 %s\r\n' % status + ''.join('%s: %s\r\n' % f for f in fields)
+    c.sendall(head.encode() + b'Connection: close\r\n\r\n' + body)
+
+def serve_file(c, head, n):
+    body = pattern(n)
+    etag = '"e%d"' % n
+    fields = [('Content-Type', 'application/octet-stream'), ('Cache-Control', 'max-age=60'),
+              ('ETag', etag), ('Accept-Ranges', 'bytes')]
+    if field(head, 'If-None-Match') == etag:
+        return respond(c, '304 Not Modified', fields, b'')
+    r = field(head, 'Range')
+    if r and r.startswith('bytes=') and ',' not in r:
+        first, _, last = r[6:].partition('-')
+        if first:
+            first, last = int(first), min(int(last) if last else n - 1, n - 1)
+        else:
+            first, last = max(n - int(last), 0), n - 1
+        if first < n:
+            fields += [('Content-Range', 'bytes %d-%d/%d' % (first, last, n)), ('Content-Length', last - first + 1)]
+            return respond(c, '206 Partial Content', fields, body[first:last + 1])
+    respond(c, '200 OK', fields + [('Content-Length', n)], body)
+
+def serve_chunked(c, n):
+    body = pattern(n)
+    c.sendall(b'HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nCache-Control: max-age=60\r\n'
+              b'Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n')
+    for i in range(0, n, 1000):
+        part = body[i:i + 1000]
+        c.sendall(b'%x;n=%d\r\n%s\r\n' % (len(part), i // 1000, part))
+    c.sendall(b'0\r\nX-Trailer: 1\r\n\r\n')
+
+def serve(c):
+    try:
+        head = b''
+        while b'\r\n\r\n' not in head:
+            d = c.recv(4096)
+            if not d: return
+            head += d
+        target = head.split(b' ')[1].decode()
+        path = '/' + target.split('://', 1)[1].split('/', 1)[1] if '://' in target else target
+        print(head.split(b'\r\n')[0].decode(), field(head, 'Range') or '', flush=True)
+        parts = path.split('?')[0].split('/')
+        if parts[1] == 'file':
+            serve_file(c, head, int(parts[2]))
+        elif parts[1] == 'chunked':
+            serve_chunked(c, int(parts[2]))
+        elif parts[1] == 'text':
+            respond(c, '200 OK', [('Content-Type', 'text/plain'), ('Cache-Control', 'max-age=60'),
+                                  ('ETag', '"t%s"' % parts[2]), ('Content-Length', int(parts[2]))],
+                    text(int(parts[2])))
+        elif parts[1] == 'vary':
+            body = (field(head, 'X-Lang') or 'none').encode()
+            respond(c, '200 OK', [('Cache-Control', 'max-age=60'), ('Vary', 'X-Lang'),
+                                  ('Content-Length', len(body))], body)
+        elif parts[1] == 'status':
+            body = b'status %s\n' % parts[2].encode()
+            respond(c, '%s Status' % parts[2], [('Content-Length', len(body))], body)
+        elif parts[1] == 'upload':
+            want, got = int(field(head, 'Content-Length') or 0), len(head.split(b'\r\n\r\n', 1)[1])
+            while got < want:
+                d = c.recv(65536)
+                if not d: return
+                got += len(d)
+            body = b'got %d' % got
+            respond(c, '200 OK', [('Content-Length', len(body))], body)
+        elif parts[1] == 'slow':
+            time.sleep(int(parts[2]) / 1000)
+            respond(c, '200 OK', [('Cache-Control', 'max-age=60'), ('Content-Length', 4)], b'slow')
+        else:
+            c.sendall(b'HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n')
+            chunk = b'x' * 65536
+            for _ in range(size // len(chunk)): c.sendall(chunk)
+            c.sendall(b'x' * (size % len(chunk)))
+    except OSError:
+        pass
+    finally:
+        c.close()
+
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', port))
+s.listen(64)
+while True:
+    c, _ = s.accept()
+    threading.Thread(target=serve, args=(c,), daemon=True).start()
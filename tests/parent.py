@@ -0,0 +1,43 @@
+# Stub parent proxy for the shell tests: answers the first request on each
+# connection (`parent <n>`, cacheable, keep-alive) and keeps the connection;
+# a second request on it is met with a close, as if the parent had closed
+# the idle connection just as the request went out. Prints each request.
+#     python3 parent.py <port>
+import socket, sys, threading
+
+port = int(sys.argv[1])
+answered = 0
+lock = threading.Lock()
+
+def request(c):
+    head = b''
+    while b'\r\n\r\n' not in head:
+        d = c.recv(4096)
+        if not d: return None
+        head += d
+    return head
+
+def serve(c):
+    global answered
+    try:
+        head = request(c)
+        if head is None: return
+        print(head.split(b'\r\n')[0].decode(), flush=True)
+        with lock:
+            answered += 1
+            body = b'parent %d' % answered
+        c.sendall(b'HTTP/1.1 200 OK\r\nCache-Control: no-store\r\nConnection: keep-alive\r\n'
+                  b'Keep-Alive: timeout=5\r\nContent-Length: %d\r\n\r\n%s' % (len(body), body))
+        if request(c) is not None: print('closed on a second request', flush=True)
+    except OSError:
+        pass
+    finally:
+        c.close()
+
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', port))
+s.listen(64)
+while True:
+    c, _ = s.accept()
+    threading.Thread(target=serve, args=(c,), daemon=True).start()
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Fetching through a parent proxy over pooled connections. The parent's
+# keep-alive fields are not relayed. When the parent closes a pooled
+# connection as the next request goes out, that request is sent again on a
+# new connection (the client still gets its answer), and the parent is not
+# passed over.
+#     tests/parent.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+PARENT_PORT=18551
+PROXY_PORT=18552
+PARENT_LOG=$(mktemp)
+LOG=$(mktemp)
+OUT=$(mktemp)
+
+python3 parent.py $PARENT_PORT > $PARENT_LOG & parent=$!
+$PROXY --parents 127.0.0.1:$PARENT_PORT $PROXY_PORT > $LOG 2>&1 & proxy=$!
+trap 'kill $parent $proxy 2> /dev/null; rm -f $PARENT_LOG $LOG $OUT' EXIT
+sleep 0.5
+
+fetch() { curl -s -D $OUT -x http://127.0.0.1:$PROXY_PORT "$@"; }
+fail() { echo "FAIL: $*"; exit 1; }
+
+got=$(fetch http://origin.test/a)
+[ "$got" = "parent 1" ] || fail "the first request got \"$got\""
+grep -qi '^Keep-Alive:\|^Connection: keep-alive' $OUT && fail "the parent's keep-alive fields reached the client"
+grep -qi '^Connection: close' $OUT || fail "the client was not told the connection closes"
+
+# The pooled connection is closed on this one: it is asked again, on a new connection
+got=$(fetch http://origin.test/b)
+[ "$got" = "parent 2" ] || fail "the request on the closed pooled connection got \"$got\""
+grep -q "closed on a second request" $PARENT_LOG || fail "the pooled connection was not reused"
+grep -q "parent 127.0.0.1:$PARENT_PORT not answering" $LOG && fail "the parent was passed over"
+echo "PASS: parent"
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Two proxies sharing their caches as peers. Objects fetched through the
+# first are served to the second by the first (the ones it owns), without
+# going to the origin again.
+#     tests/peer.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18591
+PROXY_PORT=18592
+OTHER_PORT=18593
+PEERS=127.0.0.1:18594,127.0.0.1:18595
+ORIGIN_LOG=$(mktemp)
+LOG=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+$PROXY --peers $PEERS --peer-self 127.0.0.1:18594 $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+stdbuf -oL $PROXY --peers $PEERS --peer-self 127.0.0.1:18595 --log-level debug $OTHER_PORT > $LOG 2>&1 & other=$!
+trap 'kill $origin $proxy $other 2> /dev/null; rm -f $ORIGIN_LOG $LOG' EXIT
+sleep 0.5
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+for i in $(seq 1 8); do
+    got=$(curl -s -x http://127.0.0.1:$PROXY_PORT http://127.0.0.1:$ORIGIN_PORT/file/$i)
+    [ "$got" = "$(printf 0123456789abcdef | head -c $i)" ] || fail "/file/$i through the first got \"$got\""
+done
+for i in $(seq 1 8); do
+    got=$(curl -s -x http://127.0.0.1:$OTHER_PORT http://127.0.0.1:$ORIGIN_PORT/file/$i)
+    [ "$got" = "$(printf 0123456789abcdef | head -c $i)" ] || fail "/file/$i through the second got \"$got\""
+done
+
+from_peer=$(grep -c "from peer 127.0.0.1:18594" $LOG)
+[ "$from_peer" -gt 0 ] || fail "nothing was served by the peer"
+# The origin saw each object once, and again only those the second owns
+[ "$(wc -l < $ORIGIN_LOG)" = $((16 - from_peer)) ] || fail "$from_peer from the peer, origin requests: $(cat $ORIGIN_LOG)"
+echo "PASS: peer"
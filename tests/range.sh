@@ -0,0 +1,51 @@
+#!/bin/bash
+# HEAD, Range (one and several), conditional and unsatisfiable requests are
+# answered from a cached GET, without asking the origin again. A Range miss
+# on an object too large to cache reaches the origin with its Range, and
+# the client gets the origin's 206, not the whole object.
+#     tests/range.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18521
+PROXY_PORT=18522
+ORIGIN_LOG=$(mktemp)
+OUT=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+$PROXY $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG $OUT' EXIT
+sleep 0.5
+
+fetch() { rm -f $OUT; curl -s -o $OUT -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT "$@"; }
+fail() { echo "FAIL: $*"; exit 1; }
+URL=http://127.0.0.1:$ORIGIN_PORT/file/1000
+
+# A Range miss on a cacheable object: the whole object is fetched (and cached)
+code=$(fetch -H 'Range: bytes=10-19' $URL)
+[ "$code" = 206 ] && [ "$(cat $OUT)" = abcdef0123 ] || fail "first Range: $code $(cat $OUT)"
+grep -q "GET /file/1000 HTTP/1.0 $" $ORIGIN_LOG || fail "the origin was asked for a range, not the object"
+
+code=$(fetch -H 'Range: bytes=-4' $URL)
+[ "$code" = 206 ] && [ "$(cat $OUT)" = 4567 ] || fail "suffix Range: $code $(cat $OUT)"
+
+code=$(fetch -H 'Range: bytes=0-1,16-17' $URL)
+[ "$code" = 206 ] && grep -q PROXY_BYTERANGES_BOUNDARY $OUT && grep -q 'Content-Range: bytes 0-1/1000' $OUT &&
+    grep -q 'Content-Range: bytes 16-17/1000' $OUT || fail "multipart Range: $code"
+
+code=$(fetch -H 'If-None-Match: "e1000"' $URL)
+[ "$code" = 304 ] && [ ! -s $OUT ] || fail "If-None-Match: $code"
+
+code=$(fetch -H 'Range: bytes=5000-' $URL)
+[ "$code" = 416 ] || fail "unsatisfiable Range: $code"
+
+code=$(fetch -I $URL)
+[ "$code" = 200 ] && grep -q 'Content-Length: 1000' $OUT || fail "HEAD: $code"
+
+[ "$(grep -c 'GET /file/1000 ' $ORIGIN_LOG)" = 1 ] || fail "the origin was asked again: $(cat $ORIGIN_LOG)"
+
+# A Range miss on an object larger than --object-size (100k)
+code=$(fetch -H 'Range: bytes=200000-200009' http://127.0.0.1:$ORIGIN_PORT/file/300000)
+[ "$code" = 206 ] && [ "$(cat $OUT)" = 0123456789 ] || fail "large Range: $code, $(wc -c < $OUT) bytes"
+grep -q "GET /file/300000 HTTP/1.0 bytes=200000-200009" $ORIGIN_LOG || fail "the Range did not reach the origin"
+echo "PASS: range"
@@ -0,0 +1,57 @@
+#!/bin/bash
+# A `hash` pool sends each URL to one server, always the same, and spreads
+# the URLs over all of them. Taking a server out (and reloading) moves only
+# the URLs it had; the others stay where they were.
+#     tests/ring.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+PROXY_PORT=18684
+ROUTES=$(mktemp)
+LOGS=($(mktemp) $(mktemp) $(mktemp))
+
+echo "upstream ring hash 127.0.0.1:18681 127.0.0.1:18682 127.0.0.1:18683" > $ROUTES
+echo "route 127.0.0.1/ ring" >> $ROUTES
+python3 origin.py 18681 > ${LOGS[0]} & o1=$!
+python3 origin.py 18682 > ${LOGS[1]} & o2=$!
+python3 origin.py 18683 > ${LOGS[2]} & o3=$!
+$PROXY --routes $ROUTES $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $o1 $o2 $o3 $proxy 2> /dev/null; rm -f $ROUTES ${LOGS[*]}' EXIT
+sleep 0.5
+
+fail() { echo "FAIL: $*"; exit 1; }
+# POST every key (uncached, so each one reaches a server); then which
+# server (1-3) got key $1 the last time?
+post_all() {
+    for k in $(seq 1 30); do
+        got=$(curl -s -d '' http://127.0.0.1:$PROXY_PORT/upload?k=$k)
+        [ "$got" = "got 0" ] || fail "key $k got \"$got\""
+    done
+}
+server() { local last=none; for s in 0 1 2; do grep "POST /upload?k=$1 " ${LOGS[$s]} > /dev/null && last=$((s + 1)); done; echo $last; }
+
+post_all
+declare -A first
+for k in $(seq 1 30); do first[$k]=$(server $k); done
+for s in 0 1 2; do
+    [ -s ${LOGS[$s]} ] || fail "server $((s + 1)) got no keys"
+    : > ${LOGS[$s]}
+done
+
+post_all
+for k in $(seq 1 30); do
+    [ "$(server $k)" = ${first[$k]} ] || fail "key $k moved from server ${first[$k]} to $(server $k)"
+done
+
+# Without the third server, only its keys move
+echo "upstream ring hash 127.0.0.1:18681 127.0.0.1:18682" > $ROUTES
+echo "route 127.0.0.1/ ring" >> $ROUTES
+kill -HUP $proxy
+sleep 0.3
+for s in 0 1 2; do : > ${LOGS[$s]}; done
+post_all
+[ -s ${LOGS[2]} ] && fail "the removed server still gets keys"
+for k in $(seq 1 30); do
+    [ ${first[$k]} = 3 ] || [ "$(server $k)" = ${first[$k]} ] || fail "key $k moved from server ${first[$k]} to $(server $k)"
+done
+echo "PASS: ring"
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Reverse-proxy routing: the longest matching path prefix picks the pool,
+# round-robin goes through its servers, a request answered from the cache
+# does not take a server's turn, and a host with no route is not found.
+#     tests/route.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+PROXY_PORT=18604
+ROUTES=$(mktemp)
+LOGS=($(mktemp) $(mktemp) $(mktemp))
+
+cat > $ROUTES <<END
+upstream both round-robin 127.0.0.1:18601 127.0.0.1:18602
+upstream nines round-robin 127.0.0.1:18603
+route 127.0.0.1/ both
+route 127.0.0.1/file/9 nines
+END
+python3 origin.py 18601 > ${LOGS[0]} & o1=$!
+python3 origin.py 18602 > ${LOGS[1]} & o2=$!
+python3 origin.py 18603 > ${LOGS[2]} & o3=$!
+$PROXY --routes $ROUTES $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $o1 $o2 $o3 $proxy 2> /dev/null; rm -f $ROUTES ${LOGS[*]}' EXIT
+sleep 0.5
+
+fetch() { curl -s -o /dev/null -w '%{http_code}' "$@"; }
+fail() { echo "FAIL: $*"; exit 1; }
+# which origin (1-3) got `GET $1`?
+served_by() { grep -l "GET $1 " ${LOGS[*]} | sed "s|${LOGS[0]}|1|; s|${LOGS[1]}|2|; s|${LOGS[2]}|3|" | tr '\n' ' '; }
+
+for path in /file/1 /file/1 /file/2 /file/90 /file/8; do
+    code=$(fetch http://127.0.0.1:$PROXY_PORT$path)
+    [ "$code" = 200 ] || fail "$path: $code"
+done
+[ "$(served_by /file/1)" = "1 " ] || fail "/file/1 went to: $(served_by /file/1)"
+[ "$(served_by /file/2)" = "2 " ] || fail "/file/2 went to: $(served_by /file/2) (the hit took a turn)"
+[ "$(served_by /file/90)" = "3 " ] || fail "/file/90 went to: $(served_by /file/90)"
+[ "$(served_by /file/8)" = "1 " ] || fail "/file/8 went to: $(served_by /file/8)"
+
+code=$(fetch -H 'Host: other.test' http://127.0.0.1:$PROXY_PORT/file/1)
+[ "$code" = 404 ] || fail "a host with no route: $code"
+echo "PASS: route"
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Segmented fetching stays within the origin's fetch limit: with
+# --origin-max-fetches 2, a large object is fetched in 2 segments, not
+# --segment-count. The object arrives whole and in order. A Range request
+# to a segment host goes to the origin as it is.
+#     tests/segment.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18561
+PROXY_PORT=18562
+ORIGIN_LOG=$(mktemp)
+LOG=$(mktemp)
+OUT=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+stdbuf -oL $PROXY --segment-hosts '*' --segment-count 4 --segment-min-size 100k --origin-max-fetches 2 \
+    $PROXY_PORT > $LOG 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG $LOG $OUT' EXIT
+sleep 0.5
+
+fail() { echo "FAIL: $*"; exit 1; }
+URL=http://127.0.0.1:$ORIGIN_PORT/file/400000
+
+curl -s -o $OUT -x http://127.0.0.1:$PROXY_PORT $URL
+python3 -c "
+import sys
+want = (b'0123456789abcdef' * 25000)[:400000]
+sys.exit(open('$OUT', 'rb').read() != want)" || fail "the object arrived damaged ($(wc -c < $OUT) bytes)"
+grep -q "fetching 400000 bytes from 127.0.0.1 in 2 segments" $LOG || fail "not fetched in 2 segments: $(grep segments $LOG)"
+[ "$(grep -c "GET /file/400000 HTTP/1.0 bytes=" $ORIGIN_LOG)" = 1 ] || fail "range requests: $(cat $ORIGIN_LOG)"
+
+code=$(curl -s -o $OUT -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT -H 'Range: bytes=1000-1009' \
+       http://127.0.0.1:$ORIGIN_PORT/file/500000)
+[ "$code" = 206 ] && [ "$(cat $OUT)" = 89abcdef01 ] || fail "Range to a segment host: $code, $(wc -c < $OUT) bytes"
+grep -q "GET /file/500000 HTTP/1.0 bytes=1000-1009" $ORIGIN_LOG || fail "the Range did not reach the origin"
+echo "PASS: segment"
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Request bodies are streamed to the origin. A client that abandons its
+# upload part way says nothing about the origin: it does not count towards
+# opening the origin's circuit.
+#     tests/upload.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18581
+PROXY_PORT=18582
+LOG=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > /dev/null & origin=$!
+stdbuf -oL $PROXY --circuit-min-requests 3 --circuit-error-rate 50 $PROXY_PORT > $LOG 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $LOG' EXIT
+sleep 0.5
+
+fail() { echo "FAIL: $*"; exit 1; }
+URL=http://127.0.0.1:$ORIGIN_PORT/upload
+
+got=$(head -c 100000 /dev/zero | curl -s --data-binary @- -x http://127.0.0.1:$PROXY_PORT $URL)
+[ "$got" = "got 100000" ] || fail "the upload got \"$got\""
+
+# Uploads cut off after 10 of 100000 bytes
+for i in 1 2 3 4; do
+    python3 -c "
+import socket, time
+c = socket.create_connection(('127.0.0.1', $PROXY_PORT))
+c.sendall(b'POST $URL HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 100000\r\n\r\n0123456789')
+time.sleep(0.1)
+c.close()"
+done
+sleep 0.2
+
+grep -q "circuit open" $LOG && fail "abandoned uploads opened the origin's circuit"
+code=$(curl -s -o /dev/null -w '%{http_code}' -x http://127.0.0.1:$PROXY_PORT http://127.0.0.1:$ORIGIN_PORT/file/10)
+[ "$code" = 200 ] || fail "the origin is refused: $code"
+echo "PASS: upload"
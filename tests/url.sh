@@ -0,0 +1,45 @@
+#!/bin/bash
+# Cache keys are canonical URLs: requests that differ only in the case of
+# the scheme and host, escaped unreserved characters, a fragment, the
+# order of the query parameters (--cache-query-sort) or stripped ones
+# (--cache-query-strip) share one cached copy. Other queries do not.
+#     tests/url.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18641
+PROXY_PORT=18642
+HOSTS=$(mktemp)
+ORIGIN_LOG=$(mktemp)
+printf '127.0.0.1 origin.test\n' > $HOSTS
+
+python3 origin.py $ORIGIN_PORT 100 > $ORIGIN_LOG & origin=$!
+$PROXY --hosts-file $HOSTS --cache-query-sort yes --cache-query-strip 'utm_*' $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $HOSTS $ORIGIN_LOG' EXIT
+sleep 0.5
+
+fail() { echo "FAIL: $*"; exit 1; }
+# send request target $1 as is; prints the body
+get() { python3 -c "
+import socket, sys
+c = socket.create_connection(('127.0.0.1', $PROXY_PORT))
+c.sendall(b'GET $1 HTTP/1.0\r\n\r\n')
+data = b''
+while True:
+    d = c.recv(65536)
+    if not d: break
+    data += d
+sys.stdout.write(data.split(b'\r\n\r\n', 1)[1].decode())"; }
+hits() { grep -c "GET /file/10" $ORIGIN_LOG; }
+
+for target in "http://origin.test:$ORIGIN_PORT/file/10?b=2&a=1&utm_source=x" \
+              "HTTP://ORIGIN.Test:$ORIGIN_PORT/%66ile/10?a=1&b=2#top" \
+              "http://origin.test:$ORIGIN_PORT/file/10?utm_medium=y&a=1&b=2"; do
+    got=$(get "$target")
+    [ "$got" = 0123456789 ] || fail "$target got \"$got\""
+done
+[ "$(hits)" = 1 ] || fail "the same URL was fetched $(hits) times: $(cat $ORIGIN_LOG)"
+
+got=$(get "http://origin.test:$ORIGIN_PORT/file/10?a=1&b=3")
+[ "$got" = 0123456789 ] && [ "$(hits)" = 2 ] || fail "another query was not fetched: \"$got\", $(hits) fetches"
+echo "PASS: url"
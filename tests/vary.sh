@@ -0,0 +1,33 @@
+#!/bin/bash
+# A response that varies (Vary: X-Lang) is cached once per value of the
+# field: each request gets its own variant, from the cache after the
+# first time. Values are compared normalized (surrounding space ignored).
+#     tests/vary.sh [proxy binary]
+
+PROXY=$(realpath "${1:-$(dirname "$0")/../proxy}")
+cd "$(dirname "$0")"
+ORIGIN_PORT=18661
+PROXY_PORT=18662
+ORIGIN_LOG=$(mktemp)
+
+python3 origin.py $ORIGIN_PORT > $ORIGIN_LOG & origin=$!
+$PROXY $PROXY_PORT > /dev/null 2>&1 & proxy=$!
+trap 'kill $origin $proxy 2> /dev/null; rm -f $ORIGIN_LOG' EXIT
+sleep 0.5
+
+fetch() { curl -s -x http://127.0.0.1:$PROXY_PORT "$@" http://127.0.0.1:$ORIGIN_PORT/vary; }
+fail() { echo "FAIL: $*"; exit 1; }
+
+for lang in en fr en fr; do
+    got=$(fetch -H "X-Lang: $lang")
+    [ "$got" = $lang ] || fail "X-Lang: $lang got \"$got\""
+done
+got=$(fetch -H 'X-Lang:   en  ')
+[ "$got" = en ] || fail "X-Lang with spaces got \"$got\""
+got=$(fetch)
+[ "$got" = none ] || fail "no X-Lang got \"$got\""
+got=$(fetch)
+[ "$got" = none ] || fail "no X-Lang again got \"$got\""
+
+[ "$(grep -c 'GET /vary' $ORIGIN_LOG)" = 3 ] || fail "origin requests (3 variants): $(cat $ORIGIN_LOG)"
+echo "PASS: vary"
@@ -0,0 +1,106 @@
+/**
+ * CONNECT tunnels: once the proxy has answered `200 Connection Established`,
+ * the bytes (TLS, usually) are relayed both ways until both sides are done.
+ *
+ * Each direction has a pipe; bytes are spliced socket -> pipe -> socket, so
+ * they never enter user space. Both sockets are non-blocking and a single
+ * `poll` waits for whichever side can make progress.
+ */
+
+#define _GNU_SOURCE // splice
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "tunnel.h"
+
+#define TUNNEL_SPLICE_SIZE 65536 // at most one (default-sized) pipe's worth per splice
+
+/* one direction of the tunnel. */
+typedef struct {
+    int from, to;     // sockets
+    int pipe_fds[2];
+    size_t pending;   // bytes in the pipe, not yet written to `to`
+    int eof;          // `from` is done sending
+    size_t bytes;     // relayed so far
+} tunnel_dir_t;
+
+/* move what we can in one direction without blocking. returns -1 on error. */
+static int tunnel_pump ( tunnel_dir_t *d, short from_events, short to_events )
+{
+    if ( d->pending == 0 && ! d->eof && ( from_events & ( POLLIN | POLLHUP | POLLERR ) ) ) {
+        ssize_t n = splice ( d->from, NULL, d->pipe_fds[1], NULL, TUNNEL_SPLICE_SIZE,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( n == 0 ) {
+            /* pass the half-close on, so the other side sees EOF too. */
+            d->eof = 1;
+            shutdown ( d->to, SHUT_WR );
+        } else if ( n < 0 ) {
+            if ( errno != EAGAIN && errno != EINTR ) { return -1; }
+        } else {
+            d->pending = n;
+            to_events |= POLLOUT; // most likely writable; try right away
+        }
+    }
+    if ( d->pending > 0 && ( to_events & ( POLLOUT | POLLERR ) ) ) {
+        ssize_t n = splice ( d->pipe_fds[0], NULL, d->to, NULL, d->pending,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( n < 0 ) {
+            if ( errno != EAGAIN && errno != EINTR ) { return -1; }
+        } else {
+            d->pending -= n;
+            d->bytes   += n;
+        }
+    }
+    return 0;
+}
+
+/* relay between client_fd and server_fd until both directions have ended,
+   nothing moved for idle_timeout seconds (0: no limit), or an error.
+   returns TUNNEL_CLOSED, TUNNEL_IDLE or TUNNEL_ERROR; the counts go to stats. */
+int tunnel_relay ( int client_fd, int server_fd, int idle_timeout, tunnel_stats_t *stats )
+{
+    tunnel_dir_t dirs[2] = {
+        { .from = client_fd, .to = server_fd, .pipe_fds = { -1, -1 } },
+        { .from = server_fd, .to = client_fd, .pipe_fds = { -1, -1 } },
+    };
+    int result = TUNNEL_ERROR;
+
+    if ( pipe2 ( dirs[0].pipe_fds, O_NONBLOCK ) < 0 || pipe2 ( dirs[1].pipe_fds, O_NONBLOCK ) < 0 ) { goto out; }
+    fcntl ( client_fd, F_SETFL, fcntl ( client_fd, F_GETFL ) | O_NONBLOCK );
+    fcntl ( server_fd, F_SETFL, fcntl ( server_fd, F_GETFL ) | O_NONBLOCK );
+
+    while ( ! ( dirs[0].eof && dirs[0].pending == 0 && dirs[1].eof && dirs[1].pending == 0 ) ) {
+        /* fds[0] is the client, fds[1] the server; each direction reads one
+           and writes the other. */
+        struct pollfd fds[2] = { { .fd = client_fd }, { .fd = server_fd } };
+        for ( int i = 0; i < 2; i++ ) {
+            if ( dirs[i].pending > 0 ) { fds[1 - i].events |= POLLOUT; }
+            else if ( ! dirs[i].eof ) { fds[i].events |= POLLIN; }
+        }
+
+        int n = poll ( fds, 2, idle_timeout > 0 ? idle_timeout * 1000 : -1 );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) { continue; }
+            goto out;
+        }
+        if ( n == 0 ) { result = TUNNEL_IDLE; goto out; }
+
+        for ( int i = 0; i < 2; i++ ) {
+            if ( fds[i].revents & ( POLLERR | POLLNVAL ) ) { goto out; } // reset
+            if ( tunnel_pump ( &dirs[i], fds[i].revents, fds[1 - i].revents ) < 0 ) { goto out; }
+        }
+    }
+    result = TUNNEL_CLOSED;
+
+out:
+    for ( int i = 0; i < 2; i++ ) {
+        if ( dirs[i].pipe_fds[0] >= 0 ) { close ( dirs[i].pipe_fds[0] ); }
+        if ( dirs[i].pipe_fds[1] >= 0 ) { close ( dirs[i].pipe_fds[1] ); }
+    }
+    stats->up   = dirs[0].bytes;
+    stats->down = dirs[1].bytes;
+    return result;
+}
@@ -0,0 +1,17 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <stddef.h>
+
+/* Byte counts of a finished tunnel. */
+typedef struct {
+    size_t up;   // client -> server
+    size_t down; // server -> client
+} tunnel_stats_t;
+
+/* reasons `tunnel_relay` returns. */
+enum { TUNNEL_CLOSED, TUNNEL_IDLE, TUNNEL_ERROR };
+
+int tunnel_relay ( int client_fd, int server_fd, int idle_timeout, tunnel_stats_t *stats );
+
+#endif/*TUNNEL_H*/
@@ -0,0 +1,100 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "upgrade.h"
+#include "io.h"
+#include "error.h"
+
+static int upgrade_address ( struct sockaddr_un *addr, const char *path )
+{
+    memset ( addr, 0, sizeof(*addr) );
+    addr->sun_family = AF_UNIX;
+    if ( strlen(path) >= sizeof(addr->sun_path) ) { return -1; }
+    strcpy ( addr->sun_path, path );
+    return 0;
+}
+
+/* create the Unix socket on which this proxy hands itself over.
+   a stale socket file (or that of the proxy we just took over from) is replaced. */
+int upgrade_listen ( const char *path )
+{
+    struct sockaddr_un addr;
+    if ( upgrade_address ( &addr, path ) < 0 ) { return -1; }
+
+    int fd = socket ( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 ) { return -1; }
+    unlink ( path );
+    if ( bind ( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 || listen ( fd, 1 ) < 0 ) {
+        close ( fd );
+        return -1;
+    }
+    return fd;
+}
+
+/* pass listen_fd to the peer of conn_fd. the kernel duplicates the fd into
+   the receiving process; both processes then share the listening socket.
+   https://man7.org/linux/man-pages/man7/unix.7.html (SCM_RIGHTS) */
+int upgrade_send_listen_fd ( int conn_fd, int listen_fd )
+{
+    char tag = 'L';
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset ( &control, 0, sizeof(control) );
+
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy ( CMSG_DATA(cmsg), &listen_fd, sizeof(int) );
+
+    return sendmsg ( conn_fd, &msg, 0 ) == 1 ? 0 : -1;
+}
+
+/* ask the proxy listening on `path` to hand over. returns the listening fd
+   (or -1). conn_fd is left open, for reading the cache snapshot if wanted. */
+int upgrade_takeover ( const char *path, int want_cache, int *conn_fd )
+{
+    struct sockaddr_un addr;
+    if ( upgrade_address ( &addr, path ) < 0 ) { return -1; }
+
+    int fd = socket ( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 ) { return -1; }
+    if ( connect ( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 ) {
+        fprintf(stderr, "\033[31mfailure:\033[0m connect to upgrade socket %s.\n", path);
+        close ( fd );
+        return -1;
+    }
+
+    char request = want_cache ? 'C' : 'U';
+    if ( write_all ( fd, &request, 1 ) != 1 ) { close ( fd ); return -1; }
+
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    if ( recvmsg ( fd, &msg, 0 ) != 1 || tag != 'L' ) { close ( fd ); return -1; }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ( cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ) {
+        close ( fd );
+        return -1;
+    }
+    int listen_fd;
+    memcpy ( &listen_fd, CMSG_DATA(cmsg), sizeof(int) );
+
+    log_info("\033[32msuccess:\033[0m took over listening socket from previous proxy.\n");
+    *conn_fd = fd;
+    return listen_fd;
+}
@@ -0,0 +1,13 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/* Zero-downtime binary upgrade. The running proxy listens on a Unix socket;
+   a new proxy started with `--upgrade` connects to it and receives the
+   listening socket (SCM_RIGHTS), and optionally a snapshot of the cache,
+   after which the old proxy stops accepting and drains. */
+
+int upgrade_listen ( const char *path );
+int upgrade_send_listen_fd ( int conn_fd, int listen_fd );
+int upgrade_takeover ( const char *path, int want_cache, int *conn_fd );
+
+#endif/*UPGRADE_H*/
@@ -0,0 +1,215 @@
+/**
+ * URI canonicalization, for cache keys (RFC 3986, section 6.2.2):
+ *  - scheme and host are lowercased, and a default (or empty) port is dropped;
+ *  - percent-escapes of unreserved characters are decoded, others get
+ *    uppercase hex digits; an empty path becomes `/`; a fragment is dropped;
+ *  - query parameters named in `cache-query-strip` are removed (a trailing
+ *    `*` matches a prefix, e.g. `utm_*`), and with `cache-query-sort` the
+ *    remaining ones are sorted (for origins that ignore their order).
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "url.h"
+#include "hash.h"
+
+#define QUERY_PARAMS_MAX 64 // more: the query is kept as it is
+
+/* output buffer; `len` keeps counting past `cap`, so overflow is detected once. */
+typedef struct {
+    char *p;
+    size_t len, cap;
+} out_t;
+
+static void put ( out_t *out, const char *s, size_t n )
+{
+    if ( out->len + n < out->cap ) { memcpy ( out->p + out->len, s, n ); }
+    out->len += n;
+}
+
+static void put_lower ( out_t *out, const char *s, size_t n )
+{
+    for ( size_t i = 0; i < n; i++ ) {
+        char c = tolower ( (unsigned char)s[i] );
+        put ( out, &c, 1 );
+    }
+}
+
+static int hex_digit ( int c )
+{
+    if ( c >= '0' && c <= '9' ) { return c - '0'; }
+    c = tolower ( c );
+    if ( c >= 'a' && c <= 'f' ) { return c - 'a' + 10; }
+    return -1;
+}
+
+static int unreserved ( int c )
+{
+    return isalnum ( c ) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* copy s[0..n), normalizing its percent-escapes. */
+static void put_escaped ( out_t *out, const char *s, size_t n )
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    for ( size_t i = 0; i < n; i++ ) {
+        int hi, lo;
+        if ( s[i] == '%' && i + 2 < n && ( hi = hex_digit ( (unsigned char)s[i + 1] ) ) >= 0 &&
+             ( lo = hex_digit ( (unsigned char)s[i + 2] ) ) >= 0 ) {
+            char c = hi * 16 + lo;
+            if ( unreserved ( (unsigned char)c ) ) {
+                put ( out, &c, 1 );
+            } else {
+                char esc[3] = { '%', HEX[hi], HEX[lo] };
+                put ( out, esc, 3 );
+            }
+            i += 2;
+        } else {
+            put ( out, &s[i], 1 );
+        }
+    }
+}
+
+/* is query parameter `param` (name[=value]) to be stripped? */
+static int stripped ( const char *param, const char *rules )
+{
+    size_t name_len = strcspn ( param, "=" );
+    for ( const char *r = rules; *r; ) {
+        while ( *r == ' ' || *r == ',' ) { r++; }
+        size_t n = strcspn ( r, ", " );
+        if ( n > 0 && r[n - 1] == '*' ) {
+            if ( name_len >= n - 1 && strncmp ( param, r, n - 1 ) == 0 ) { return 1; }
+        } else if ( n > 0 && n == name_len && strncmp ( param, r, n ) == 0 ) {
+            return 1;
+        }
+        r += n;
+    }
+    return 0;
+}
+
+static int param_cmp ( const void *a, const void *b )
+{
+    const char * const *x = a;
+    const char * const *y = b;
+    return strcmp ( *x, *y );
+}
+
+static void put_query ( out_t *out, const char *q, size_t n, const struct proxy_config *cfg )
+{
+    char normalized[MAX_LINE];
+    char *params[QUERY_PARAMS_MAX];
+    int count = 0;
+
+    /* normalize the escapes first, so that rules and sorting see canonical names. */
+    out_t norm = { normalized, 0, sizeof(normalized) };
+    put_escaped ( &norm, q, n );
+    if ( norm.len >= norm.cap ) { out->len = out->cap; return; }
+    normalized[norm.len] = '\0';
+
+    for ( char *p = normalized; *p; ) {
+        char *amp = strchr ( p, '&' );
+        if ( amp ) { *amp = '\0'; }
+        if ( *p && ! stripped ( p, cfg->cache_query_strip ) ) {
+            if ( count == QUERY_PARAMS_MAX ) { count = -1; break; }
+            params[count++] = p;
+        }
+        if ( ! amp ) { break; }
+        p = amp + 1;
+    }
+    if ( count < 0 ) {
+        /* too many to sort or strip; keep the query as sent (escapes normalized). */
+        put ( out, "?", 1 );
+        put_escaped ( out, q, n );
+        return;
+    }
+    if ( cfg->cache_query_sort ) { qsort ( params, count, sizeof(params[0]), param_cmp ); }
+    for ( int i = 0; i < count; i++ ) {
+        put ( out, i == 0 ? "?" : "&", 1 );
+        put ( out, params[i], strlen ( params[i] ) );
+    }
+}
+
+/* write the canonical form of uri to out (of capacity cap). returns 0, or -1 if it does not fit. */
+static int canonicalize ( char *buf, size_t cap, const char *uri, const struct proxy_config *cfg )
+{
+    out_t out = { buf, 0, cap };
+    const char *p = uri;
+
+    /* scheme */
+    const char *sep = strstr ( uri, "://" );
+    const char *scheme = "http";
+    size_t scheme_len = 4;
+    if ( sep && strcspn ( uri, "/?#" ) > (size_t)( sep - uri ) ) {
+        scheme = uri;
+        scheme_len = sep - uri;
+        p = sep + 3;
+    } else if ( strncmp ( p, "//", 2 ) == 0 ) {
+        p += 2;
+    }
+    put_lower ( &out, scheme, scheme_len );
+    put ( &out, "://", 3 );
+
+    /* authority: [userinfo@]host[:port] */
+    size_t authority_len = strcspn ( p, "/?#" );
+    const char *host = p;
+    const char *at = memchr ( p, '@', authority_len );
+    if ( at ) {
+        put ( &out, p, at + 1 - p );
+        host = at + 1;
+    }
+    const char *authority_end = p + authority_len;
+    const char *port = NULL;
+    const char *host_end = authority_end;
+    const char *bracket = host[0] == '[' ? memchr ( host, ']', authority_end - host ) : NULL;
+    const char *colon = memchr ( bracket ? bracket : host, ':', authority_end - ( bracket ? bracket : host ) );
+    if ( colon ) {
+        host_end = colon;
+        port = colon + 1;
+    }
+    put_lower ( &out, host, host_end - host );
+    if ( port ) {
+        /* an empty port (`host:`) is the default one too (RFC 3986, section 6.2.3). */
+        size_t port_len = authority_end - port;
+        int default_port = port_len == 0 ||
+                           ( port_len == 2 && strncmp ( port, "80", 2 ) == 0 &&
+                             scheme_len == 4 && strncasecmp ( scheme, "http", 4 ) == 0 ) ||
+                           ( port_len == 3 && strncmp ( port, "443", 3 ) == 0 &&
+                             scheme_len == 5 && strncasecmp ( scheme, "https", 5 ) == 0 );
+        if ( ! default_port ) {
+            put ( &out, ":", 1 );
+            put ( &out, port, port_len );
+        }
+    }
+    p = authority_end;
+
+    /* path */
+    size_t path_len = strcspn ( p, "?#" );
+    if ( path_len == 0 ) { put ( &out, "/", 1 ); }
+    else { put_escaped ( &out, p, path_len ); }
+    p += path_len;
+
+    /* query (the fragment, if any, is dropped) */
+    if ( *p == '?' ) { put_query ( &out, p + 1, strcspn ( p + 1, "#" ), cfg ); }
+
+    if ( out.len >= out.cap ) { return -1; }
+    buf[out.len] = '\0';
+    return 0;
+}
+
+uint64_t url_hash ( const char *url )
+{
+    return hash64 ( url, strlen ( url ), 0 );
+}
+
+/* the cache key of a request URI. one that cannot be canonicalized is used as is. */
+void url_key ( url_key_t *key, const char *uri, const struct proxy_config *cfg )
+{
+    if ( canonicalize ( key->url, sizeof(key->url), uri, cfg ) < 0 ) {
+        strncpy ( key->url, uri, sizeof(key->url) - 1 );
+        key->url[sizeof(key->url) - 1] = '\0';
+    }
+    key->hash = url_hash ( key->url );
+}
@@ -0,0 +1,20 @@
+#ifndef URL_H
+#define URL_H
+
+#include <stdint.h>
+#include "io.h"     // MAX_LINE
+#include "config.h"
+
+/* A cache key: the canonical form of a request URI, and its hash. Requests
+   for the same resource spelled differently (`http://Host:80/%7ea` and
+   `http://host/~a`) get the same key. The hash is computed once per request,
+   and picks the cache shard and index bucket. */
+typedef struct {
+    char url[MAX_LINE];
+    uint64_t hash;
+} url_key_t;
+
+void     url_key ( url_key_t *key, const char *uri, const struct proxy_config *cfg );
+uint64_t url_hash ( const char *url );
+
+#endif/*URL_H*/